@@ -2,13 +2,24 @@
  * args.h - Parsing de argumentos de línea de comandos
  * 
  * Soporta:
+ *   -a               Fija cada reactor a un CPU (requiere -t).
+ *   -b <n>           Conexiones aceptadas como máximo por cada aviso del selector.
+ *   -c <ms>          Demora entre intentos de conexión en paralelo al origen.
+ *   -D               Despierta al proxy recién cuando el cliente mandó datos.
+ *   -F               TCP Fast Open con los clientes y con los orígenes.
  *   -h               Imprime la ayuda y termina.
+ *   -k               Entrega los túneles establecidos al kernel (BPF sockmap).
  *   -l <SOCKS addr>  Dirección donde servirá el proxy SOCKS.
  *   -L <conf  addr>  Dirección donde servirá el servicio de management.
  *   -p <SOCKS port>  Puerto entrante conexiones SOCKS.
  *   -P <conf port>   Puerto entrante conexiones configuracion
  *   -u <name>:<pass> Usuario y contraseña de usuario que puede usar el proxy.
+ *   -t <threads>     Cantidad de reactores (event loops) en paralelo.
+ *   -T <regla>       Perfil de opciones de socket por socket pasivo, usuario o puerto.
+ *   -U               Usa io_uring como motor de I/O, con accept y copia por
+ *                    completitud (si el kernel lo soporta).
  *   -v               Imprime información sobre la versión y termina.
+ *   -z               Copia los datos con splice(2), sin pasar por userspace.
  */
 #ifndef ARGS_H_kFlmYm1tW9p5npzDr2opQJ9jM8
 #define ARGS_H_kFlmYm1tW9p5npzDr2opQJ9jM8
@@ -16,6 +27,13 @@
 #include <stdbool.h>
 
 #define MAX_USERS 10
+#define MAX_TUNING_ARGS 16
+#define MAX_THREADS 1024
+#define MIN_CONNECT_DELAY 10
+#define MAX_CONNECT_DELAY 2000
+#define MAX_ACCEPT_BATCH 1024
+#define MAX_RELAY_MEMORY 65536
+#define MAX_CONN_SLAB 1048576
 
 struct users {
     char *name;
@@ -31,8 +49,42 @@ struct socks5args {
 
     bool            disectors_enabled;
 
+    /** usar io_uring en lugar del motor de I/O por defecto */
+    bool            io_uring;
+
+    /** cantidad de reactores, cada uno con su selector y su socket pasivo */
+    unsigned        threads;
+    /** fijar cada reactor a un CPU */
+    bool            affinity;
+
+    /** demora (ms) entre intentos de conexión en paralelo (Happy Eyeballs) */
+    unsigned        connect_delay;
+
+    /** conexiones que se aceptan como máximo por cada aviso del selector */
+    unsigned        accept_batch;
+    /** TCP_DEFER_ACCEPT en los sockets pasivos SOCKS */
+    bool            defer_accept;
+    /** TCP Fast Open en los sockets pasivos SOCKS y en los connect al origen */
+    bool            fast_open;
+
+    /** relay zero-copy con splice */
+    bool            zero_copy;
+    /** relay en el kernel con BPF sockmap */
+    bool            kernel_relay;
+    /** memoria (MiB) para los buffers de copia agrandados */
+    unsigned        relay_memory;
+
+    /** estructuras de conexión preasignadas por reactor */
+    unsigned        conn_slab;
+    /** páginas grandes para las estructuras preasignadas */
+    bool            huge_pages;
+
     struct users    users[MAX_USERS];
     int             nusers;
+
+    /** reglas de perfiles de socket (ver tuning.h) */
+    char           *tuning_rules[MAX_TUNING_ARGS];
+    int             ntuning_rules;
 };
 
 /**
@@ -126,6 +126,42 @@ buffer_read(buffer *b);
 void
 buffer_write(buffer *b, uint8_t c);
 
+/**
+ * Operaciones por tramos: evitan pasar por `buffer_read' / `buffer_write'
+ * byte a byte cuando se conoce el largo de lo que se lee o escribe.
+ */
+
+/**
+ * Retorna un puntero a los próximos `n' bytes para leer sin consumirlos,
+ * o NULL si todavía no hay tantos. Se consumen con `buffer_read_adv'.
+ */
+const uint8_t *
+buffer_peek(buffer *b, const size_t n);
+
+/**
+ * Copia y consume `n' bytes en `dst'. Si no hay tantos no consume nada.
+ *
+ * @return true si se copiaron los `n' bytes
+ */
+bool
+buffer_read_n(buffer *b, void *dst, const size_t n);
+
+/**
+ * Copia hasta `n' bytes de `src' al buffer, compactando si hace falta.
+ *
+ * @return la cantidad copiada (menos de `n' si no entraban)
+ */
+size_t
+buffer_write_n(buffer *b, const void *src, const size_t n);
+
+/**
+ * Retorna un puntero donde se pueden escribir `n' bytes contiguos,
+ * compactando si hace falta, o NULL si no entran. Se confirma lo escrito
+ * con `buffer_write_adv'.
+ */
+uint8_t *
+buffer_reserve(buffer *b, const size_t n);
+
 /**
  * compacta el buffer
  */
@@ -0,0 +1,57 @@
+/**
+ * bufpool.h - Pool de buffers por clases de tamaño
+ *
+ * Los buffers de las conexiones se piden al pool solo mientras tienen datos
+ * en vuelo y se devuelven al vaciarse, así que una conexión ociosa no ocupa
+ * memoria de buffers. Las clases son potencias de 2, de BUFPOOL_MIN_SIZE a
+ * BUFPOOL_MAX_SIZE; un pedido se redondea a la clase que lo contiene.
+ *
+ * Cada reactor (thread) guarda los bloques libres de cada clase en su propia
+ * lista, sin locks, hasta BUFPOOL_CACHE_BYTES por clase; lo que sobra vuelve
+ * al sistema.
+ */
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** clase más chica y más grande */
+#define BUFPOOL_MIN_SIZE    64
+#define BUFPOOL_MAX_SIZE    (256 * 1024)
+/** bytes libres que guarda cada thread por clase */
+#define BUFPOOL_CACHE_BYTES (1024 * 1024)
+
+/** uso del pool */
+struct bufpool_stats {
+    /** bytes entregados y todavía no devueltos */
+    size_t in_use;
+    /** bytes libres guardados para reusar */
+    size_t cached;
+};
+
+/**
+ * Pide un bloque de al menos `size' bytes. Los pedidos más grandes que
+ * BUFPOOL_MAX_SIZE se sirven con malloc, sin pasar por las listas.
+ *
+ * @return el bloque, o NULL si no hay memoria
+ */
+uint8_t *bufpool_get(size_t size);
+
+/**
+ * Devuelve un bloque pedido con `bufpool_get', con el mismo `size'. Puede
+ * devolverse desde otro thread.
+ */
+void bufpool_put(uint8_t *data, size_t size);
+
+/**
+ * Libera los bloques libres guardados por el thread actual.
+ */
+void bufpool_thread_destroy(void);
+
+/**
+ * Copia en `stats' el uso del pool (de todos los threads).
+ */
+void bufpool_get_stats(struct bufpool_stats *stats);
+
+#endif
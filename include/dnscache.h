@@ -0,0 +1,104 @@
+/**
+ * dnscache.h - Cache de resoluciones DNS compartido por todos los reactores
+ *
+ * Guarda las direcciones de cada nombre con un TTL, para que los CONNECT a
+ * dominios frecuentes no tengan que esperar una resolución.
+ *
+ *   - Particionado en shards, cada uno con su lock, para que los reactores
+ *     no compitan por un único mutex.
+ *   - Acotado: cada shard desaloja la entrada usada menos recientemente (LRU).
+ *   - Cachea también los nombres inexistentes (NXDOMAIN) por menos tiempo.
+ *   - Stale-while-revalidate: una entrada vencida se sigue sirviendo durante
+ *     una ventana acotada, mientras el primero que la encuentra la refresca.
+ */
+#ifndef DNSCACHE_H
+#define DNSCACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <netdb.h>
+
+/** TTL de las respuestas negativas (NXDOMAIN), en segundos */
+#define DNSCACHE_NEGATIVE_TTL 10
+/** tiempo que se sirve una entrada vencida mientras se refresca, en segundos */
+#define DNSCACHE_STALE_TTL    120
+/** direcciones que se guardan por nombre */
+#define DNSCACHE_MAX_ADDRS    8
+
+/** resultado de `dnscache_lookup' */
+typedef enum {
+    /** no está en el cache (o venció la ventana stale): hay que resolver */
+    DNSCACHE_MISS,
+    /** hay direcciones */
+    DNSCACHE_HIT,
+    /** el nombre no existe */
+    DNSCACHE_NEGATIVE,
+} dnscache_result;
+
+/** contadores del cache */
+struct dnscache_stats {
+    uint64_t hits;
+    /** hits servidos desde una entrada vencida (incluidos en `hits') */
+    uint64_t stale_hits;
+    uint64_t negative_hits;
+    uint64_t misses;
+    uint64_t evictions;
+    /** entradas actualmente en el cache */
+    uint64_t entries;
+};
+
+/**
+ * Inicializa el cache.
+ */
+void dnscache_init(void);
+
+/**
+ * Libera todas las entradas del cache.
+ */
+void dnscache_destroy(void);
+
+/**
+ * Busca un nombre en el cache.
+ *
+ * @param host    Nombre a buscar (no distingue mayúsculas)
+ * @param port    Puerto a completar en las direcciones devueltas
+ * @param res     En DNSCACHE_HIT, lista de direcciones a liberar con
+ *                `dnscache_freeaddrinfo'
+ * @param refresh En DNSCACHE_HIT, true si la entrada está vencida y el
+ *                llamador debe refrescarla (solo se le pide a uno por vez)
+ */
+dnscache_result dnscache_lookup(const char *host, uint16_t port,
+                                struct addrinfo **res, bool *refresh);
+
+/**
+ * Guarda las direcciones de `ai' (se ignora el puerto) para `host'.
+ *
+ * @param ttl Segundos de vigencia. Con 0 no se guarda nada: la respuesta no
+ *            puede cachearse ni servirse vencida
+ */
+void dnscache_store(const char *host, const struct addrinfo *ai, unsigned ttl);
+
+/**
+ * Guarda que `host' no existe. Con `ttl' 0 no se guarda nada.
+ */
+void dnscache_store_negative(const char *host, unsigned ttl);
+
+/**
+ * Copia una lista de direcciones (por ejemplo la de getaddrinfo) en una
+ * lista propia, que se libera con `dnscache_freeaddrinfo'.
+ *
+ * @return la copia, o NULL si `ai' es NULL o no hay memoria
+ */
+struct addrinfo *dnscache_addrinfo_dup(const struct addrinfo *ai);
+
+/**
+ * Libera una lista devuelta por `dnscache_lookup' o `dnscache_addrinfo_dup'.
+ */
+void dnscache_freeaddrinfo(struct addrinfo *ai);
+
+/**
+ * Copia en `stats' los contadores del cache.
+ */
+void dnscache_get_stats(struct dnscache_stats *stats);
+
+#endif
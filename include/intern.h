@@ -0,0 +1,50 @@
+/**
+ * intern.h - Strings compartidos entre conexiones
+ *
+ * Los nombres de usuario y de destino se repiten mucho entre conexiones:
+ * en vez de que cada una guarde su copia en un arreglo fijo, todas apuntan
+ * a una única copia con contador de referencias, que se libera cuando la
+ * suelta la última.
+ *
+ * La tabla es compartida por todos los reactores, particionada en shards
+ * con su propio lock como el cache DNS.
+ */
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stddef.h>
+
+/**
+ * Inicializa la tabla.
+ */
+void intern_init(void);
+
+/**
+ * Libera la tabla. Debe llamarse cuando ya no quedan conexiones.
+ */
+void intern_destroy(void);
+
+/**
+ * Obtiene la copia compartida de `s', creándola si no existe.
+ *
+ * @return la copia (a soltar con `intern_put'), o NULL si no hay memoria
+ */
+const char *intern_get(const char *s);
+
+/**
+ * Igual que `intern_get', para un string de `len' bytes que no
+ * necesariamente termina en '\0'.
+ */
+const char *intern_get_n(const char *s, size_t len);
+
+/**
+ * Suelta una referencia obtenida con `intern_get'. Acepta NULL.
+ */
+void intern_put(const char *s);
+
+/**
+ * @return la cantidad de strings distintos en la tabla
+ */
+size_t intern_entries(void);
+
+#endif
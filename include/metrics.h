@@ -8,6 +8,7 @@
 #define METRICS_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdatomic.h>
 
 /**
@@ -35,6 +36,15 @@ struct server_metrics {
     
     /** Bytes recibidos del cliente (upstream) */
     _Atomic uint64_t bytes_received;
+    
+    /** Clientes que mandaron datos en el SYN (TCP Fast Open) */
+    _Atomic uint64_t fast_open_accepted;
+    
+    /** Conexiones al origen cuyo SYN con datos fue aceptado */
+    _Atomic uint64_t fast_open_connects;
+    
+    /** Conexiones al origen que intentaron Fast Open y no lo lograron */
+    _Atomic uint64_t fast_open_fallbacks;
 };
 
 /**
@@ -82,5 +92,17 @@ void metrics_add_bytes_sent(uint64_t bytes);
  */
 void metrics_add_bytes_received(uint64_t bytes);
 
+/**
+ * Registra un cliente que mandó datos en el SYN.
+ */
+void metrics_fast_open_accepted(void);
+
+/**
+ * Registra una conexión al origen que intentó TCP Fast Open.
+ *
+ * @param syn_data true si el origen aceptó los datos del SYN
+ */
+void metrics_fast_open_connect(bool syn_data);
+
 #endif
 
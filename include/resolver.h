@@ -0,0 +1,122 @@
+/**
+ * resolver.h - Resolvedor DNS stub no bloqueante
+ *
+ * Resuelve nombres sin threads ni llamadas bloqueantes: las consultas A y
+ * AAAA viajan por sockets UDP (o TCP si la respuesta llega truncada)
+ * registrados en el mismo selector que atiende la conexión, y los
+ * reintentos usan los timers del selector. Solo si resolv.conf no tiene
+ * ningún servidor utilizable se recurre a getaddrinfo, en el pool de
+ * trabajos bloqueantes del selector.
+ *
+ * La configuración (`/etc/resolv.conf' y `/etc/hosts') se lee una sola vez
+ * al iniciar. Las respuestas se guardan en el cache DNS con su TTL real.
+ *
+ * Los pedidos simultáneos del mismo nombre en un reactor comparten una
+ * única consulta (singleflight): todos reciben la notificación del mismo
+ * resultado.
+ */
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <netdb.h>
+
+#include "selector.h"
+
+#ifndef RESOLVER_CONF_PATH
+#define RESOLVER_CONF_PATH  "/etc/resolv.conf"
+#endif
+#ifndef RESOLVER_HOSTS_PATH
+#define RESOLVER_HOSTS_PATH "/etc/hosts"
+#endif
+
+/** estado de una consulta */
+typedef enum {
+    /** todavía en curso */
+    RESOLVER_PENDING,
+    /** hay direcciones */
+    RESOLVER_OK,
+    /** el nombre no existe (o no tiene direcciones) */
+    RESOLVER_NOTFOUND,
+    /** ningún servidor respondió, o respondieron con error */
+    RESOLVER_FAILED,
+} resolver_status;
+
+struct resolver_query;
+
+/** contadores del resolvedor */
+struct resolver_stats {
+    /** consultas enviadas a los servidores */
+    uint64_t lookups;
+    /** pedidos que se sumaron a una consulta ya en vuelo */
+    uint64_t coalesced;
+};
+
+/**
+ * Lee la configuración del sistema. Debe llamarse antes de iniciar los
+ * reactores; si un archivo no existe se usan los valores por defecto
+ * (sin servidores, timeout de 5s, 2 intentos).
+ */
+void resolver_init(void);
+
+/**
+ * Libera la configuración.
+ */
+void resolver_destroy(void);
+
+/**
+ * Resuelve sin consultar a la red: direcciones IP literales y nombres de
+ * `/etc/hosts'.
+ *
+ * @param host Nombre a resolver
+ * @param port Puerto a completar en las direcciones
+ * @return la lista de direcciones (a liberar con `dnscache_freeaddrinfo'), o
+ *         NULL si el nombre no se resuelve localmente
+ */
+struct addrinfo *resolver_lookup_local(const char *host, uint16_t port);
+
+/**
+ * Inicia la resolución de `host' en el selector `s', o se suma a la que ya
+ * esté en vuelo para el mismo nombre. Al terminar se notifica a `notify_fd'
+ * como con `selector_notify_block'; el resultado se consulta con
+ * `resolver_query_status' y `resolver_query_take'.
+ *
+ * @return la consulta (a liberar con `resolver_query_free'), o NULL si no se
+ *         pudo iniciar
+ */
+struct resolver_query *resolver_query_start(fd_selector s, int notify_fd,
+                                            const char *host, uint16_t port);
+
+/**
+ * Inicia una consulta que solo actualiza el cache DNS: no notifica a nadie
+ * y se libera sola al terminar. No hace nada si el nombre ya está en vuelo.
+ */
+void resolver_refresh(fd_selector s, const char *host);
+
+/**
+ * Estado de una consulta.
+ */
+resolver_status resolver_query_status(const struct resolver_query *q);
+
+/**
+ * Devuelve las direcciones de una consulta RESOLVER_OK, con el puerto pedido
+ * en `resolver_query_start'. La lista se libera con `dnscache_freeaddrinfo'.
+ *
+ * @return la lista, o NULL si la consulta falló o no hay memoria
+ */
+struct addrinfo *resolver_query_take(struct resolver_query *q);
+
+/**
+ * Deja de esperar una consulta. Si nadie más la espera y todavía está en
+ * curso, termina sola (para llenar el cache). Debe llamarse desde el thread
+ * del selector en el que se inició.
+ */
+void resolver_query_free(struct resolver_query *q);
+
+/**
+ * Copia en `stats' los contadores del resolvedor (de todos los reactores).
+ */
+void resolver_get_stats(struct resolver_stats *stats);
+
+#endif
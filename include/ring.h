@@ -0,0 +1,99 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdbool.h>
+#include <unistd.h>  // size_t, ssize_t
+#include <stdint.h>
+#include <sys/uio.h> // struct iovec
+
+/**
+ * ring.c - variante circular de buffer.c, con el mismo contrato de
+ *          punteros de lectura y escritura.
+ *
+ * A diferencia del buffer lineal, lo que se libera al leer vuelve a estar
+ * disponible para escribir sin compactar: cuando los datos dan la vuelta,
+ * el espacio libre (o el ocupado) son dos tramos, que se obtienen juntos con
+ * `ring_write_iov' / `ring_read_iov' para usar con readv/writev.
+ *
+ * La capacidad es una potencia de 2. Los contadores de lectura y escritura
+ * solo crecen y se enmascaran con `size - 1'.
+ *
+ *      W=2     R=4
+ *       ↓       ↓
+ * +---+---+---+---+---+---+---+---+
+ * | C | D |   |   | A | B | ..... |
+ * +---+---+---+---+---+---+---+---+
+ *
+ * Para leer:    iov[0] = R..fin, iov[1] = inicio..W
+ * Para escribir: iov[0] = W..R
+ *
+ * Al vaciarse vuelven los dos al principio, así el próximo tramo para
+ * escribir es el más largo posible.
+ */
+typedef struct ring ring;
+struct ring {
+    uint8_t *data;
+
+    /** capacidad (potencia de 2). inmutable */
+    size_t size;
+
+    /** contador de lectura */
+    size_t read;
+
+    /** contador de escritura */
+    size_t write;
+};
+
+/**
+ * inicializa el anillo sobre `data', de `n' bytes (potencia de 2)
+ */
+void
+ring_init(ring *r, const size_t n, uint8_t *data);
+
+/** bytes para leer */
+size_t
+ring_readable(const ring *r);
+
+/** bytes libres para escribir */
+size_t
+ring_writable(const ring *r);
+
+/**
+ * Retorna un puntero donde se pueden escribir hasta `*nbytes` contiguos.
+ * Se debe notificar mediante la función `ring_write_adv'
+ */
+uint8_t *
+ring_write_ptr(ring *r, size_t *nbyte);
+void
+ring_write_adv(ring *r, const ssize_t bytes);
+
+uint8_t *
+ring_read_ptr(ring *r, size_t *nbyte);
+void
+ring_read_adv(ring *r, const ssize_t bytes);
+
+/**
+ * Completa `iov' con los tramos libres (uno o dos).
+ *
+ * @return la cantidad de tramos (0 si está lleno)
+ */
+int
+ring_write_iov(ring *r, struct iovec iov[2]);
+
+/**
+ * Completa `iov' con los tramos ocupados (uno o dos).
+ *
+ * @return la cantidad de tramos (0 si está vacío)
+ */
+int
+ring_read_iov(ring *r, struct iovec iov[2]);
+
+/** retorna true si hay bytes para leer del anillo */
+bool
+ring_can_read(const ring *r);
+
+/** retorna true si se pueden escribir bytes en el anillo */
+bool
+ring_can_write(const ring *r);
+
+#endif
@@ -2,6 +2,7 @@
 #define SELECTOR_H_W50GNLODsARolpHbsDsrvYvMsbT
 
 #include <sys/time.h>
+#include <sys/types.h>
 #include <stdbool.h>
 
 /**
@@ -58,19 +59,47 @@ typedef enum {
     SELECTOR_FDINUSE  = 4,
     /** I/O error check errno */
     SELECTOR_IO       = 5,
+    /** la cola de trabajos bloqueantes está llena */
+    SELECTOR_BUSY     = 6,
 } selector_status;
 
 /** retorna una descripción humana del fallo */
 const char *
 selector_error(const selector_status status);
 
+/**
+ * Motor de notificación de eventos de los selectores.
+ *
+ * SELECTOR_ENGINE_DEFAULT usa epoll(7) en Linux y pselect(2) en el resto.
+ * SELECTOR_ENGINE_URING agrupa los cambios de interés y la espera en una
+ * única llamada a io_uring_enter(2) por iteración, y además puede hacer el
+ * I/O por completitud (ver `selector_accept' y `selector_relay'). Necesita
+ * accept multishot y buffers provistos (Linux 5.19); si el kernel no los
+ * soporta se usa el motor por defecto (ver `selector_get_engine').
+ */
+typedef enum {
+    SELECTOR_ENGINE_DEFAULT = 0,
+    SELECTOR_ENGINE_URING   = 1,
+} selector_engine;
+
 /** opciones de inicialización del selector */
 struct selector_init {
-    /** señal a utilizar para notificaciones internas */
+    /** señal a utilizar para interrumpir la espera desde otros threads */
     const int signal;
 
     /** tiempo máximo de bloqueo durante `selector_iteratate' */
     struct timespec select_timeout;
+
+    /** motor preferido para los selectores que se creen */
+    selector_engine engine;
+
+    /**
+     * threads del pool de trabajos bloqueantes (`selector_submit_blocking').
+     * 0 usa el valor por defecto.
+     */
+    unsigned blocking_workers;
+    /** trabajos que pueden esperar en la cola del pool. 0: por defecto */
+    unsigned blocking_queue;
 };
 
 /** inicializa la librería */
@@ -89,6 +118,10 @@ selector_new(const size_t initial_elements);
 void
 selector_destroy(fd_selector s);
 
+/** motor que efectivamente utiliza el selector */
+selector_engine
+selector_get_engine(fd_selector s);
+
 /**
  * Intereses sobre un file descriptor (quiero leer, quiero escribir, …)
  *
@@ -127,6 +160,12 @@ typedef struct fd_handler {
   void (*handle_read)      (struct selector_key *key);
   void (*handle_write)     (struct selector_key *key);
   void (*handle_block)     (struct selector_key *key);
+  /** llamado cuando vence el timer del fd (ver `selector_set_timeout') */
+  void (*handle_timeout)   (struct selector_key *key);
+  /** llamado con cada conexión aceptada por `selector_accept' */
+  void (*handle_accept)    (struct selector_key *key, int fd);
+  /** llamado con el avance de la dirección de `selector_relay' que sale del fd */
+  void (*handle_relay)     (struct selector_key *key, ssize_t n);
 
   /**
    * llamado cuando se se desregistra el fd
@@ -169,14 +208,72 @@ selector_set_interest(fd_selector s, int fd, fd_interest i);
 selector_status
 selector_set_interest_key(struct selector_key *key, fd_interest i);
 
+/**
+ * marca (o desmarca) `fd' como prioritario: en cada iteración sus eventos se
+ * despachan antes que los del resto. Pensado para los sockets pasivos, así
+ * los accept no esperan detrás de las copias.
+ */
+selector_status
+selector_set_priority(fd_selector s, int fd, bool priority);
+
+/**
+ * accept por completitud (solo SELECTOR_ENGINE_URING): el socket pasivo
+ * `fd', ya registrado, queda aceptando en el kernel con un accept multishot,
+ * y cada conexión se entrega a `handle_accept' (no bloqueante y con
+ * close-on-exec). Los accept completados se atienden antes que los eventos
+ * de la iteración. Dura hasta desregistrar el fd.
+ *
+ * @return SELECTOR_IARGS si el motor no es io_uring
+ */
+selector_status
+selector_accept(fd_selector s, const int fd);
+
+/**
+ * copia por completitud (solo SELECTOR_ENGINE_URING): desde acá el selector
+ * mueve los bytes entre `a' y `b', ambos registrados, en las dos
+ * direcciones, sin pasar por los handlers: recv sobre buffers provistos al
+ * kernel y send al otro extremo de lo recibido. Si el destino no da abasto
+ * se deja de recibir del origen. Los intereses de los dos fds conviene
+ * dejarlos en OP_NOOP.
+ *
+ * Cada dirección se reporta a `handle_relay' del fd de donde salen los
+ * bytes: n > 0 son bytes entregados al otro extremo; 0, que llegó al EOF,
+ * entregó todo y ya hizo shutdown(2) de escritura del otro extremo; n < 0 un
+ * error (-errno). Desregistrar cualquiera de los dos fds corta el relay.
+ *
+ * @return SELECTOR_IARGS si el motor no es io_uring; SELECTOR_FDINUSE si
+ *         alguno ya está en un relay
+ */
+selector_status
+selector_relay(fd_selector s, const int a, const int b);
+
 
 /**
  * se bloquea hasta que hay eventos disponible y los despacha.
  * Retorna luego de cada iteración, o al llegar al timeout.
+ *
+ * Despacha primero los fds prioritarios y después el resto en round-robin:
+ * el primero que se atiende rota de una iteración a la siguiente.
  */
 selector_status
 selector_select(fd_selector s);
 
+/**
+ * arma (o rearma, si ya estaba armado) el timer de `fd' para que venza en
+ * `ms' milisegundos; al vencer se llama a `handle_timeout' del handler.
+ * Hay un timer por fd, y armar, rearmar y cancelar son O(1). El timer se
+ * cancela solo al desregistrar el fd.
+ *
+ * La espera de `selector_select' se acorta para no demorar el próximo
+ * vencimiento.
+ */
+selector_status
+selector_set_timeout(fd_selector s, const int fd, const unsigned ms);
+
+/** cancela el timer de `fd', si estaba armado */
+selector_status
+selector_cancel_timeout(fd_selector s, const int fd);
+
 /**
  * Método de utilidad que activa O_NONBLOCK en un fd.
  *
@@ -185,7 +282,48 @@ selector_select(fd_selector s);
 int
 selector_fd_set_nio(const int fd);
 
-/** notifica que un trabajo bloqueante terminó */
+/** trabajo bloqueante a correr en el pool (ver `selector_submit_blocking') */
+typedef void (*blocking_fn)(void *arg);
+
+/**
+ * encola `fn(arg)' para que corra en uno de los threads del pool de trabajos
+ * bloqueantes (compartido por todos los selectores). Al terminar se notifica
+ * a `fd' como con `selector_notify_block'.
+ *
+ * El pool tiene una cantidad fija de threads y una cola acotada: si la cola
+ * está llena el trabajo se rechaza con SELECTOR_BUSY y `fn' no se llama.
+ */
+selector_status
+selector_submit_blocking(fd_selector s, const int fd, blocking_fn fn, void *arg);
+
+/** estado del pool de trabajos bloqueantes */
+struct selector_blocking_stats {
+    /** threads del pool */
+    unsigned workers;
+    /** threads corriendo un trabajo en este momento */
+    unsigned busy;
+    /** capacidad de la cola */
+    unsigned queue_capacity;
+    /** trabajos esperando en la cola */
+    unsigned queue_depth;
+    /** máxima profundidad observada */
+    unsigned queue_high_water;
+    /** trabajos aceptados, rechazados y terminados desde el inicio */
+    unsigned long long submitted, rejected, completed;
+};
+
+/** copia en `stats' el estado actual del pool de trabajos bloqueantes */
+void
+selector_blocking_stats(struct selector_blocking_stats *stats);
+
+/**
+ * notifica que un trabajo bloqueante terminó. Pensado para llamarse desde
+ * otro thread: encola `fd' sin tomar locks ni reservar memoria y despierta al
+ * selector, que llamará a `handle_block' del fd desde su propio thread.
+ *
+ * Si la cola está llena espera a que el selector la vacíe; llamado desde el
+ * thread del selector retorna SELECTOR_ENOMEM en ese caso.
+ */
 selector_status
 selector_notify_block(fd_selector s,
                  const int   fd);
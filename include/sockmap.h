@@ -0,0 +1,57 @@
+/**
+ * sockmap.h - Relay en el kernel con BPF sockmap
+ *
+ * Un túnel ya establecido (cliente <-> origen) se puede entregar al kernel:
+ * los dos sockets entran a un SOCKHASH con un programa sk_skb que redirige
+ * cada segmento que llega a uno de ellos a la cola de salida del otro, sin
+ * despertar al proxy. El proxy solo sigue mirando los cierres y cosecha los
+ * contadores de bytes con TCP_INFO.
+ *
+ * El mapa y los programas se cargan una sola vez al iniciar y los comparten
+ * todos los reactores. Si el kernel no lo soporta o no hay permisos (hace
+ * falta CAP_BPF o CAP_SYS_ADMIN) queda desactivado y se usa la copia en
+ * userspace.
+ */
+#ifndef SOCKMAP_H
+#define SOCKMAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/** sockets que puede tener el mapa (dos por túnel) */
+#define SOCKMAP_MAX_ENTRIES 65536
+
+/**
+ * Crea el mapa y carga los programas.
+ *
+ * @return true si el relay en el kernel quedó disponible
+ */
+bool sockmap_init(void);
+
+/**
+ * Libera el mapa y los programas.
+ */
+void sockmap_destroy(void);
+
+/**
+ * @return true si `sockmap_init' tuvo éxito
+ */
+bool sockmap_enabled(void);
+
+/**
+ * Entrega el par de sockets al kernel: desde ahora lo que llegue a uno se
+ * reenvía al otro. Al cerrar un socket el kernel lo saca solo del mapa.
+ *
+ * @return false si no se pudo (se sigue con la copia en userspace)
+ */
+bool sockmap_pair(int a, int b);
+
+/**
+ * Bytes recibidos por un socket TCP en toda su vida (tcpi_bytes_received),
+ * incluidos los que el kernel redirigió sin pasar por el proxy.
+ *
+ * @return false si no se pudo consultar
+ */
+bool sockmap_bytes_received(int fd, uint64_t *bytes);
+
+#endif
@@ -7,6 +7,9 @@
 #ifndef SOCKS5NIO_H
 #define SOCKS5NIO_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <netdb.h>
 #include "selector.h"
 
@@ -18,11 +21,120 @@ void
 socksv5_passive_accept(struct selector_key *key);
 
 /**
- * Libera el pool de estructuras socks5 reutilizables.
- * Debe llamarse al terminar el servidor.
+ * Handler de las conexiones aceptadas por completitud en el socket pasivo
+ * (ver `selector_accept'), con el motor io_uring.
+ */
+void
+socksv5_accept(struct selector_key *key, int fd);
+
+/**
+ * Fija la demora (ms) entre intentos de conexión en paralelo al origen
+ * (Happy Eyeballs). Debe llamarse antes de arrancar los reactores.
+ */
+void
+socksv5_set_connect_delay(unsigned ms);
+
+/**
+ * Fija cuántas conexiones acepta como máximo `socksv5_passive_accept' cada
+ * vez que el socket pasivo está listo. Debe llamarse antes de arrancar los
+ * reactores.
+ */
+void
+socksv5_set_accept_batch(unsigned n);
+
+/**
+ * Activa el relay zero-copy: en COPY los bytes van socket -> pipe -> socket
+ * con splice(2), sin pasar por los buffers de la conexión. Solo en Linux;
+ * en otras plataformas se sigue usando la copia con buffers.
+ */
+void
+socksv5_set_zero_copy(bool enabled);
+
+/**
+ * Indica si los disectores de credenciales están activos. Las conexiones
+ * cuyo payload inspeccionan usan siempre la copia con buffers.
+ */
+void
+socksv5_set_dissectors(bool enabled);
+
+/**
+ * Activa TCP Fast Open hacia los orígenes: si el cliente mandó datos junto
+ * con el REQUEST, viajan en el SYN del connect (cuando ya hay cookie para
+ * ese origen). También cuenta los clientes que mandan datos en su SYN.
+ */
+void
+socksv5_set_fast_open(bool enabled);
+
+/**
+ * Fija cuánta memoria pueden sumar entre todas las conexiones los buffers de
+ * copia agrandados (los de hasta 4 KiB no cuentan). Debe llamarse antes de
+ * arrancar los reactores.
+ */
+void
+socksv5_set_relay_memory_cap(size_t bytes);
+
+/** uso de los buffers de las conexiones */
+struct socksv5_relay_stats {
+    /** bytes en buffers con datos en vuelo */
+    size_t in_use;
+    /** bytes libres en el pool, listos para reusar */
+    size_t cached;
+    /** bytes en buffers agrandados (incluidos en `in_use'), y su tope */
+    size_t memory;
+    size_t memory_cap;
+};
+
+/**
+ * Copia en `stats' el uso de los buffers de copia (de todos los reactores).
+ */
+void
+socksv5_relay_stats(struct socksv5_relay_stats *stats);
+
+/**
+ * Fija cuántas estructuras de conexión preasigna cada reactor (0 para
+ * pedirlas siempre con malloc), y si usa páginas grandes. Debe llamarse
+ * antes de arrancar los reactores.
+ */
+void
+socksv5_set_slab(size_t capacity, bool huge_pages);
+
+/**
+ * Preasigna el slab de conexiones del thread actual. Cada reactor debe
+ * llamarla desde su thread antes de aceptar conexiones.
+ */
+void
+socksv5_pool_init(void);
+
+/** ocupación de los slabs de conexiones */
+struct socksv5_slab_stats {
+    /** estructuras preasignadas entre todos los reactores */
+    size_t capacity;
+    /** en uso, y máximo en uso desde que arrancó */
+    size_t in_use;
+    size_t high_water;
+    /** conexiones que no encontraron lugar y se pidieron con malloc */
+    uint64_t overflow;
+};
+
+/**
+ * Copia en `stats' la ocupación de los slabs (de todos los reactores).
+ */
+void
+socksv5_slab_stats(struct socksv5_slab_stats *stats);
+
+/**
+ * Libera el pool de estructuras socks5 reutilizables del thread actual.
+ * Cada thread que atendió conexiones debe llamarla antes de terminar.
  */
 void
 socksv5_pool_destroy(void);
 
+/**
+ * Libera los slabs de todos los reactores. Debe llamarse al final, cuando
+ * ya no quedan conexiones.
+ */
+void
+socksv5_slabs_destroy(void);
+
 #endif
 
@@ -0,0 +1,124 @@
+/**
+ * tuning.h - Perfiles de opciones para los sockets de la copia
+ *
+ * Un perfil es un conjunto de opciones de socket (TCP_NODELAY, buffers,
+ * TCP_NOTSENT_LOWAT, keepalive, TCP_USER_TIMEOUT, TCP_CONGESTION); las que
+ * no fija quedan con el valor del kernel. Además fija el peso de la conexión
+ * en el reparto de I/O del reactor. Vienen definidos:
+ *
+ *   default      no toca nada
+ *   interactive  latencia: sin Nagle, poco dato sin enviar en el socket,
+ *                keepalive y corte si el otro extremo deja de confirmar
+ *   bulk         throughput: con Nagle y keepalive largo
+ *
+ * Qué perfil usa una conexión lo deciden reglas por puerto destino, por
+ * usuario y por socket pasivo, en ese orden de prioridad. Al aceptar solo se
+ * conoce el socket pasivo; al conectar al origen se elige con las tres y, si
+ * cambió, se vuelve a aplicar también al socket del cliente.
+ *
+ * Perfiles y reglas se pueden cambiar en tiempo de ejecución (gestión), así
+ * que se protegen con un rwlock como los usuarios.
+ */
+#ifndef TUNING_H
+#define TUNING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define TUNING_NAME_LEN      15
+#define TUNING_CONGESTION_LEN 15
+#define MAX_TUNING_PROFILES  16
+#define MAX_TUNING_RULES     64
+#define TUNING_WEIGHT_MAX    16
+
+/** valor de una opción que el perfil no fija */
+#define TUNING_UNSET (-1)
+
+struct tuning_profile {
+    char name[TUNING_NAME_LEN + 1];
+    /** TCP_NODELAY (0/1) */
+    int  nodelay;
+    /** SO_SNDBUF y SO_RCVBUF (bytes) */
+    int  sndbuf;
+    int  rcvbuf;
+    /** TCP_NOTSENT_LOWAT (bytes) */
+    int  notsent_lowat;
+    /** segundos sin tráfico hasta el primer keepalive; 0 lo apaga */
+    int  keepalive;
+    /** TCP_USER_TIMEOUT (ms) */
+    int  user_timeout;
+    /** TCP_CONGESTION; vacío si no se fija */
+    char congestion[TUNING_CONGESTION_LEN + 1];
+    /**
+     * presupuesto de bytes y lecturas por vuelta del reactor, en múltiplos
+     * del de una conexión común (1..TUNING_WEIGHT_MAX; sin fijar vale 1).
+     * No es una opción de socket: `tuning_apply' lo ignora
+     */
+    int  weight;
+};
+
+/**
+ * Carga los perfiles predefinidos y borra las reglas.
+ */
+void tuning_init(void);
+
+/**
+ * Crea un perfil o modifica uno existente.
+ *
+ * @param name    Nombre del perfil
+ * @param options Opciones "clave=valor" separadas por espacios (nodelay,
+ *                sndbuf, rcvbuf, lowat, keepalive, user_timeout, congestion,
+ *                weight);
+ *                el valor "-" vuelve al del kernel
+ * @return false si alguna opción es inválida (no se cambia nada) o no hay
+ *         lugar para otro perfil
+ */
+bool tuning_profile_set(const char *name, const char *options);
+
+/**
+ * Fija o borra una regla de selección:
+ *
+ *   listener=<perfil>        el de las conexiones aceptadas
+ *   user:<usuario>=<perfil>  el de las conexiones de un usuario
+ *   port:<puerto>=<perfil>   el de las conexiones a un puerto destino
+ *
+ * Con el perfil vacío se borra la regla (la del socket pasivo vuelve a
+ * `default').
+ *
+ * @return false si la regla es inválida, el perfil no existe o no hay lugar
+ */
+bool tuning_rule_set(const char *rule);
+
+/**
+ * Perfil del socket pasivo, para aplicar al aceptar.
+ *
+ * @return identificador del perfil elegido
+ */
+int tuning_for_listener(struct tuning_profile *out);
+
+/**
+ * Perfil de una conexión ya autenticada.
+ *
+ * @param username usuario autenticado (o NULL)
+ * @param port     puerto destino
+ * @return identificador del perfil elegido
+ */
+int tuning_for_connection(const char *username, uint16_t port, struct tuning_profile *out);
+
+/**
+ * Aplica al socket las opciones que fija el perfil. Las que el kernel
+ * rechaza (por ejemplo un algoritmo de congestión que no existe) se
+ * ignoran.
+ */
+void tuning_apply(int fd, const struct tuning_profile *profile);
+
+/**
+ * Recorre los perfiles y las reglas, una línea legible por cada uno.
+ *
+ * @param callback Función a llamar por cada línea
+ * @param ctx Contexto a pasar al callback
+ */
+void tuning_foreach(void (*callback)(const char *line, void *ctx), void *ctx);
+
+#endif
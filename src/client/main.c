@@ -47,6 +47,9 @@ usage(const char *progname) {
             "   USERS            List proxy users\n"
             "   ADDUSER u p      Add proxy user\n"
             "   DELUSER u        Delete proxy user\n"
+            "   PROFILES         List socket tuning profiles and rules\n"
+            "   PROFILE n k=v..  Create or change a tuning profile\n"
+            "   TUNE rule        Select a profile (listener=, user:u=, port:p=)\n"
             "   HELP             Show available commands\n"
             "   QUIT             Close connection\n"
             "\n",
@@ -87,6 +87,52 @@ buffer_write(buffer *b, uint8_t c) {
     }
 }
 
+const uint8_t *
+buffer_peek(buffer *b, const size_t n) {
+    const uint8_t *ret = NULL;
+    if((size_t)(b->write - b->read) >= n) {
+        ret = b->read;
+    }
+    return ret;
+}
+
+bool
+buffer_read_n(buffer *b, void *dst, const size_t n) {
+    const uint8_t *ptr = buffer_peek(b, n);
+    if(ptr == NULL) {
+        return false;
+    }
+    memcpy(dst, ptr, n);
+    buffer_read_adv(b, n);
+    return true;
+}
+
+size_t
+buffer_write_n(buffer *b, const void *src, const size_t n) {
+    size_t count = n;
+    if((size_t)(b->limit - b->write) < count) {
+        buffer_compact(b);
+        if((size_t)(b->limit - b->write) < count) {
+            count = b->limit - b->write;
+        }
+    }
+    memcpy(b->write, src, count);
+    buffer_write_adv(b, count);
+    return count;
+}
+
+uint8_t *
+buffer_reserve(buffer *b, const size_t n) {
+    if((size_t)(b->limit - b->write) < n) {
+        buffer_compact(b);
+    }
+    uint8_t *ret = NULL;
+    if((size_t)(b->limit - b->write) >= n) {
+        ret = b->write;
+    }
+    return ret;
+}
+
 void
 buffer_compact(buffer *b) {
     if(b->data == b->read) {
@@ -0,0 +1,111 @@
+/**
+ * ring.c - buffer circular con acceso directo (útil para I/O con
+ *          readv/writev).
+ */
+#include <assert.h>
+
+#include "ring.h"
+
+void
+ring_init(ring *r, const size_t n, uint8_t *data) {
+    assert((n & (n - 1)) == 0);
+    r->data  = data;
+    r->size  = n;
+    r->read  = 0;
+    r->write = 0;
+}
+
+inline size_t
+ring_readable(const ring *r) {
+    return r->write - r->read;
+}
+
+inline size_t
+ring_writable(const ring *r) {
+    return r->size - (r->write - r->read);
+}
+
+inline bool
+ring_can_read(const ring *r) {
+    return ring_readable(r) > 0;
+}
+
+inline bool
+ring_can_write(const ring *r) {
+    return ring_writable(r) > 0;
+}
+
+uint8_t *
+ring_write_ptr(ring *r, size_t *nbyte) {
+    const size_t at = r->write & (r->size - 1);
+    const size_t free = ring_writable(r);
+    *nbyte = r->size - at < free ? r->size - at : free;
+    return r->data + at;
+}
+
+uint8_t *
+ring_read_ptr(ring *r, size_t *nbyte) {
+    const size_t at = r->read & (r->size - 1);
+    const size_t used = ring_readable(r);
+    *nbyte = r->size - at < used ? r->size - at : used;
+    return r->data + at;
+}
+
+void
+ring_write_adv(ring *r, const ssize_t bytes) {
+    if(bytes > -1) {
+        r->write += (size_t) bytes;
+        assert(ring_readable(r) <= r->size);
+    }
+}
+
+void
+ring_read_adv(ring *r, const ssize_t bytes) {
+    if(bytes > -1) {
+        r->read += (size_t) bytes;
+        assert(r->read <= r->write);
+
+        if(r->read == r->write) {
+            // vacío: volver al principio no mueve datos
+            r->read  = 0;
+            r->write = 0;
+        }
+    }
+}
+
+int
+ring_write_iov(ring *r, struct iovec iov[2]) {
+    size_t n;
+    int cnt = 0;
+
+    iov[0].iov_base = ring_write_ptr(r, &n);
+    iov[0].iov_len  = n;
+    if(n > 0) {
+        cnt++;
+        if(n < ring_writable(r)) {
+            // el espacio libre sigue desde el principio
+            iov[1].iov_base = r->data;
+            iov[1].iov_len  = ring_writable(r) - n;
+            cnt++;
+        }
+    }
+    return cnt;
+}
+
+int
+ring_read_iov(ring *r, struct iovec iov[2]) {
+    size_t n;
+    int cnt = 0;
+
+    iov[0].iov_base = ring_read_ptr(r, &n);
+    iov[0].iov_len  = n;
+    if(n > 0) {
+        cnt++;
+        if(n < ring_readable(r)) {
+            iov[1].iov_base = r->data;
+            iov[1].iov_len  = ring_readable(r) - n;
+            cnt++;
+        }
+    }
+    return cnt;
+}
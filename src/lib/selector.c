@@ -7,6 +7,8 @@
 #include <assert.h> // :)
 #include <errno.h>  // :)
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 
 #include <stdint.h> // SIZE_MAX
 #include <unistd.h>
@@ -15,12 +17,65 @@
 #include <sys/socket.h>
 #include <sys/select.h>
 #include <signal.h>
+#include <time.h>
+#include <limits.h> // INT_MAX
 #include "selector.h"
 
+/**
+ * En Linux usamos epoll(7): el costo de cada iteración depende de la cantidad
+ * de eventos listos y no del fd máximo, y no estamos atados a FD_SETSIZE.
+ * En el resto de las plataformas seguimos usando pselect(2).
+ */
+#if defined(__linux__) && !defined(SELECTOR_USE_SELECT)
+#define SELECTOR_USE_EPOLL 1
+#include <sys/epoll.h>
+
+/**
+ * io_uring(7) como motor alternativo, elegible al iniciar. No dependemos de
+ * liburing: hablamos directamente con las syscalls.
+ */
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define SELECTOR_USE_URING 1
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#endif
+#endif
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
 #define N(x) (sizeof(x)/sizeof((x)[0]))
 
 #define ERROR_DEFAULT_MSG "something failed"
 
+/** cantidad máxima de eventos que se despachan por iteración (epoll) */
+#define SELECTOR_MAX_EVENTS 1024
+
+/** threads y capacidad por defecto del pool de trabajos bloqueantes */
+#define BLOCKING_DEFAULT_WORKERS 8
+#define BLOCKING_DEFAULT_QUEUE   1024
+
+/**
+ * capacidad de la cola de trabajos bloqueantes terminados.
+ * Tiene que ser potencia de 2.
+ */
+#define SELECTOR_COMPLETIONS 4096
+
+/**
+ * timer wheel jerárquico: WHEEL_LEVELS niveles de WHEEL_SLOTS slots. El tick
+ * es de 1ms; el nivel L tiene granularidad WHEEL_SLOTS^L ticks, así que los
+ * 5 niveles cubren 2^30 ms (~12 días).
+ */
+#define WHEEL_BITS   6
+#define WHEEL_SLOTS  (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 5
+#define WHEEL_SPAN   ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+
 /** retorna una descripción humana del fallo */
 const char *
 selector_error(const selector_status status) {
@@ -41,6 +96,9 @@ selector_error(const selector_status status) {
         case SELECTOR_IO:
             msg = "I/O error";
             break;
+        case SELECTOR_BUSY:
+            msg = "Blocking job queue is full";
+            break;
         default:
             msg = ERROR_DEFAULT_MSG;
     }
@@ -58,6 +116,9 @@ wake_handler(const int signal) {
 struct selector_init conf;
 static sigset_t emptyset, blockset;
 
+static selector_status blocking_pool_start(void);
+static void            blocking_pool_stop(void);
+
 selector_status
 selector_init(const struct selector_init  *c) {
     memcpy(&conf, c, sizeof(conf));
@@ -90,13 +151,16 @@ selector_init(const struct selector_init  *c) {
     }
     sigemptyset(&emptyset);
 
+    // 2. Threads para los trabajos bloqueantes
+    ret = blocking_pool_start();
+
 finally:
     return ret;
 }
 
 selector_status
 selector_close(void) {
-    // Nada para liberar.
+    blocking_pool_stop();
     // TODO(juan): podriamos reestablecer el handler de la señal.
     return SELECTOR_SUCCESS;
 }
@@ -107,20 +171,50 @@ struct item {
    fd_interest         interest;
    const fd_handler   *handler;
    void *              data;
+   /** posición en `active' del selector */
+   size_t              active_idx;
+   /** se despacha antes que el resto (ver `selector_set_priority') */
+   bool                priority;
+#ifdef SELECTOR_USE_EPOLL
+   /** intereses que tiene registrados el kernel (OP_NOOP: fuera del epoll) */
+   fd_interest         kinterest;
+   /**
+    * generación del registro. Viaja en cada evento para descartar eventos
+    * viejos de un fd que se cerró y se reutilizó en la misma iteración.
+    */
+   uint32_t            gen;
+#endif
+#ifdef SELECTOR_USE_URING
+   /** está en la lista de items a (re)armar antes de la próxima espera */
+   bool                dirty;
+   /** pidió accept multishot (ver `selector_accept') */
+   bool                accept;
+   /** user_data del accept en vuelo, 0 si no está armado */
+   uint64_t            accept_ud;
+   /** relay del que es extremo (ver `selector_relay'), o NULL */
+   struct uring_relay *relay;
+#endif
+   /** vencimiento del timer, en ticks del wheel */
+   uint64_t            expires;
+   /** slot del wheel donde está el timer, -1 si no está armado */
+   int                 tslot;
+   /** lista doblemente enlazada (por fd, sobrevive al realloc) del slot */
+   int                 tnext, tprev;
 };
 
-/* tarea bloqueante */
-struct blocking_job {
-    /** selector dueño de la resolucion */
-    fd_selector  s;
-    /** file descriptor dueño de la resolucion */
-    int fd;
-
-    /** datos del trabajo provisto por el usuario */
-    void *data;
-
-    /** el siguiente en la lista */
-    struct blocking_job *next;
+/**
+ * celda de la cola de trabajos bloqueantes terminados.
+ *
+ * La cola es un ring acotado multi-productor / único-consumidor (el de
+ * Dmitry Vyukov): cada celda lleva un número de secuencia que dice si está
+ * libre para el productor de la vuelta `pos' (seq == pos) o publicada para el
+ * consumidor (seq == pos + 1). Los productores compiten por `tail' con un CAS;
+ * el consumidor es el thread del selector y no necesita atómicos para `head'.
+ */
+struct completion {
+    atomic_size_t seq;
+    /** file descriptor dueño del trabajo */
+    int           fd;
 };
 
 /** marca para usar en item->fd para saber que no está en uso */
@@ -129,6 +223,76 @@ static const int FD_UNUSED = -1;
 /** verifica si el item está usado */
 #define ITEM_USED(i) ( ( FD_UNUSED != (i)->fd) )
 
+#ifdef SELECTOR_USE_URING
+/** ring de io_uring mapeado en memoria */
+struct uring {
+    int                  fd;
+
+    /** submission queue */
+    void                *sq_ptr;
+    size_t               sq_size;
+    unsigned            *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned             sq_entries;
+    struct io_uring_sqe *sqes;
+    size_t               sqes_size;
+    /** tail local: las SQE se publican todas juntas antes de entrar */
+    unsigned             sqe_tail;
+
+    /** completion queue */
+    void                *cq_ptr;
+    size_t               cq_size;
+    unsigned            *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+/**
+ * bytes recibidos que esperan salir. Se copian del buffer provisto, que
+ * vuelve enseguida al anillo: un destino lento no retiene buffers del
+ * kernel (que comparten todas las conexiones del selector).
+ */
+struct uring_chunk {
+    struct uring_chunk *next;
+    /** bytes en `data', y cuántos ya salieron */
+    uint32_t            len, sent;
+    /** URING_BUF_SIZE bytes */
+    uint8_t             data[];
+};
+
+/** una dirección de un relay: recv de `from' y send a `to' */
+struct uring_dir {
+    struct uring_relay *relay;
+    int                 from, to;
+    /** recv en vuelo, y si ya se pidió cancelarlo */
+    bool                recv_armed, recv_cancel;
+    /** send en vuelo (del primer chunk de la cola) */
+    bool                sending;
+    /** `from' llegó al EOF: no se vuelve a armar el recv */
+    bool                eof;
+    /** falló y se reportó el error; ya se reportó el EOF */
+    bool                failed, done;
+    /** espera buffers libres en la lista `starved' del selector */
+    bool                starved;
+    struct uring_dir   *next_starved;
+    /** chunks que esperan salir, en orden */
+    struct uring_chunk *head, *tail;
+    unsigned            queued;
+};
+
+/**
+ * relay entre dos fds (ver `selector_relay'). Vive hasta que terminan todas
+ * sus operaciones en vuelo, aunque los fds ya se hayan desregistrado.
+ */
+struct uring_relay {
+    struct uring_dir    dir[2];
+    /** operaciones en vuelo (y completions que se están atendiendo) */
+    unsigned            inflight;
+    /** se desregistró alguno de los fds: ya no se reporta nada */
+    bool                detached;
+    /** lista de todos los relays del selector */
+    struct uring_relay *prev, *next;
+};
+#endif
+
 struct fdselector {
     // almacenamos en una jump table donde la entrada es el file descriptor.
     // Asumimos que el espacio de file descriptors no va a ser esparso; pero
@@ -139,31 +303,98 @@ struct fdselector {
     /** fd maximo para usar en select() */
     int max_fd;  // max(.fds[].fd)
 
+    /**
+     * fds registrados de forma densa, para recorrer solo los vivos.
+     * Tiene la misma capacidad que `fds'.
+     */
+    int            *active;
+    size_t          active_len;
+
+    /** rota el primer fd que se atiende en cada iteración (round-robin) */
+    size_t          rr;
+
+    /** motor en uso */
+    selector_engine engine;
+
+#ifdef SELECTOR_USE_URING
+    struct uring        ring;
+    /** fds a (re)armar en el ring antes de la próxima espera */
+    int                *dirty;
+    size_t              dirty_len, dirty_size;
+
+    /** anillo de buffers provistos para los recv del relay, y su memoria */
+    struct io_uring_buf_ring *buf_ring;
+    uint8_t            *bufs;
+    /** tail local del anillo de buffers */
+    uint16_t            buf_tail;
+    /** buffers que el kernel tiene disponibles */
+    unsigned            buf_free;
+    /** chunks libres para reusar (a lo sumo URING_CHUNK_CACHE) */
+    struct uring_chunk *chunks;
+    unsigned            chunks_len;
+    /** direcciones que se quedaron sin buffers, en orden de llegada */
+    struct uring_dir   *starved_head, *starved_tail;
+    /** relays vivos o esperando sus últimas completions */
+    struct uring_relay *relays;
+#endif
+#ifdef SELECTOR_USE_EPOLL
+    /** instancia de epoll(7) */
+    int                 epfd;
+    /** eventos retornados por epoll_pwait() */
+    struct epoll_event  events[SELECTOR_MAX_EVENTS];
+    /** generador de generaciones para los items */
+    uint32_t            next_gen;
+#else
     /** descriptores prototipicos ser usados en select */
     fd_set master_r, master_w;
     /** para ser usado en el select() (recordar que select cambia el valor) */
     fd_set  slave_r,  slave_w;
+    /** fds listos en la iteración actual. Misma capacidad que `fds' */
+    int            *ready;
+#endif
+
+    /** slots del timer wheel: fd del primer item de cada lista, o -1 */
+    int             wheel[WHEEL_LEVELS * WHEEL_SLOTS];
+    /** slots no vacíos de cada nivel */
+    uint64_t        wheel_bits[WHEEL_LEVELS];
+    /** último tick procesado (ms de CLOCK_MONOTONIC) */
+    uint64_t        wheel_now;
+    /** cantidad de timers armados */
+    size_t          timers;
 
     /** timeout prototipico para usar en select() */
     struct timespec master_t;
-    /** tambien select() puede cambiar el valor */
+    /**
+     * timeout de la espera en curso: el menor entre `master_t' y el próximo
+     * timer. También select() puede cambiar el valor.
+     */
     struct timespec slave_t;
 
     // notificaciónes entre blocking jobs y el selector
     volatile pthread_t      selector_thread;
-    /** protege el acceso a resolutions jobs */
-    pthread_mutex_t         resolution_mutex;
+    /** trabajos bloqueantes que finalizaron y que pueden ser notificados */
+    struct completion      *completions;
+    /** próxima posición a ocupar (productores) */
+    atomic_size_t           completions_tail;
+    /** próxima posición a consumir (solo el thread del selector) */
+    size_t                  completions_head;
     /**
-     * lista de trabajos blockeantes que finalizaron y que pueden ser
-     * notificados.
+     * fd registrado en el propio selector que se vuelve legible cuando hay
+     * trabajos terminados (eventfd(2), o el extremo de lectura de un pipe).
      */
-    struct blocking_job    *resolution_jobs;
+    int                     wake_rfd, wake_wfd;
+    /** ya hay un despertar en vuelo: los productores no necesitan escribir */
+    atomic_bool             wake_pending;
 };
 
 /** cantidad máxima de file descriptors que la plataforma puede manejar */
+#ifdef SELECTOR_USE_EPOLL
+// epoll(7) no tiene límite propio: el techo lo pone RLIMIT_NOFILE.
+#define ITEMS_MAX_SIZE      INT_MAX
+#else
+// el máximo está dado por el límite natural de select(2).
 #define ITEMS_MAX_SIZE      FD_SETSIZE
-
-// en esta implementación el máximo está dado por el límite natural de select(2).
+#endif
 
 /**
  * determina el tamaño a crecer, generando algo de slack para no tener
@@ -190,6 +421,16 @@ size_t next_capacity(const size_t n) {
 static inline void
 item_init(struct item *item) {
     item->fd = FD_UNUSED;
+    item->tslot = -1;
+#ifdef SELECTOR_USE_EPOLL
+    item->kinterest = OP_NOOP;
+#endif
+#ifdef SELECTOR_USE_URING
+    item->dirty     = false;
+    item->accept    = false;
+    item->accept_ud = 0;
+    item->relay     = NULL;
+#endif
 }
 
 /**
@@ -204,24 +445,1079 @@ items_init(fd_selector s, const size_t last) {
     }
 }
 
+/** agrega el item a los registrados */
+static inline void
+items_active_add(fd_selector s, struct item *item) {
+    item->active_idx = s->active_len;
+    s->active[s->active_len++] = item->fd;
+}
+
+/** quita el item de los registrados en O(1) (mueve el último a su lugar) */
+static inline void
+items_active_remove(fd_selector s, struct item *item) {
+    const int last = s->active[--s->active_len];
+    s->active[item->active_idx] = last;
+    s->fds[last].active_idx     = item->active_idx;
+}
+
+// ============================================================================
+// Timer wheel
+// ============================================================================
+
+/** reloj del wheel: milisegundos monotónicos */
+static uint64_t
+wheel_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/** engancha el item en el slot que le corresponde según `wheel_now' */
+static void
+timer_link(fd_selector s, struct item *item) {
+    if(item->expires - s->wheel_now >= WHEEL_SPAN) {
+        item->expires = s->wheel_now + WHEEL_SPAN - 1;
+    }
+    const uint64_t delta = item->expires - s->wheel_now;
+    unsigned level = 0;
+    while(level + 1 < WHEEL_LEVELS
+          && delta >= ((uint64_t)1 << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    const unsigned slot = (item->expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    const int idx = (int)(level * WHEEL_SLOTS + slot);
+
+    item->tslot = idx;
+    item->tprev = -1;
+    item->tnext = s->wheel[idx];
+    if(item->tnext != -1) {
+        s->fds[item->tnext].tprev = item->fd;
+    }
+    s->wheel[idx] = item->fd;
+    s->wheel_bits[level] |= (uint64_t)1 << slot;
+}
+
+/** desengancha el item de su slot */
+static void
+timer_unlink(fd_selector s, struct item *item) {
+    const int idx = item->tslot;
+    if(item->tprev != -1) {
+        s->fds[item->tprev].tnext = item->tnext;
+    } else {
+        s->wheel[idx] = item->tnext;
+        if(-1 == item->tnext) {
+            s->wheel_bits[idx / WHEEL_SLOTS] &= ~((uint64_t)1 << (idx % WHEEL_SLOTS));
+        }
+    }
+    if(item->tnext != -1) {
+        s->fds[item->tnext].tprev = item->tprev;
+    }
+    item->tslot = -1;
+}
+
+/** redistribuye un slot de un nivel superior en los niveles inferiores */
+static void
+timer_cascade(fd_selector s, const unsigned level, const unsigned slot) {
+    const int idx = (int)(level * WHEEL_SLOTS + slot);
+    int fd = s->wheel[idx];
+    s->wheel[idx] = -1;
+    s->wheel_bits[level] &= ~((uint64_t)1 << slot);
+    while(fd != -1) {
+        struct item *item = s->fds + fd;
+        fd = item->tnext;
+        timer_link(s, item);
+    }
+}
+
+/** vence los timers del slot del tick actual */
+static void
+timer_expire(fd_selector s, const unsigned slot) {
+    while(s->wheel[slot] != -1) {
+        struct item *item = s->fds + s->wheel[slot];
+        timer_unlink(s, item);
+        s->timers--;
+        if(NULL != item->handler->handle_timeout) {
+            struct selector_key key = {
+                .s    = s,
+                .fd   = item->fd,
+                .data = item->data,
+            };
+            item->handler->handle_timeout(&key);
+        }
+    }
+}
+
+/**
+ * avanza el wheel hasta el presente, venciendo lo que corresponda.
+ * Es O(1) por tick transcurrido mientras haya timers armados.
+ */
+static void
+timers_run(fd_selector s) {
+    const uint64_t now = wheel_clock();
+    while(s->wheel_now < now) {
+        if(0 == s->timers) {
+            s->wheel_now = now;
+            break;
+        }
+        const uint64_t t = ++s->wheel_now;
+        // de arriba hacia abajo: lo que baja de nivel puede volver a bajar
+        for(unsigned level = WHEEL_LEVELS - 1; level > 0; level--) {
+            const unsigned shift = WHEEL_BITS * level;
+            if(0 == (t & (((uint64_t)1 << shift) - 1))) {
+                timer_cascade(s, level, (t >> shift) & WHEEL_MASK);
+            }
+        }
+        timer_expire(s, t & WHEEL_MASK);
+    }
+}
+
+/**
+ * calcula cuánto se puede esperar: el menor entre `master_t' y el próximo
+ * tick en el que el wheel tiene algo que hacer (vencer o redistribuir).
+ */
+static void
+timers_wait(fd_selector s, struct timespec *ts) {
+    *ts = s->master_t;
+    uint64_t next = UINT64_MAX;
+    for(unsigned level = 0; 0 != s->timers && level < WHEEL_LEVELS; level++) {
+        const uint64_t bits = s->wheel_bits[level];
+        if(0 == bits) {
+            continue;
+        }
+        const unsigned shift = WHEEL_BITS * level;
+        const unsigned from  = ((s->wheel_now >> shift) + 1) & WHEEL_MASK;
+        // rotamos para que el slot siguiente al actual quede en el bit 0
+        const uint64_t rot   = (bits >> from) | (bits << ((WHEEL_SLOTS - from) & WHEEL_MASK));
+        const uint64_t d     = (uint64_t)__builtin_ctzll(rot) + 1;
+        const uint64_t tick  = ((s->wheel_now >> shift) + d) << shift;
+        if(tick < next) {
+            next = tick;
+        }
+    }
+    if(UINT64_MAX != next) {
+        const uint64_t now = wheel_clock();
+        const uint64_t ms  = next > now ? next - now : 0;
+        const uint64_t max = (uint64_t)ts->tv_sec * 1000 + (uint64_t)ts->tv_nsec / 1000000;
+        if(ms < max) {
+            ts->tv_sec  = (time_t)(ms / 1000);
+            ts->tv_nsec = (long)(ms % 1000) * 1000000;
+        }
+    }
+}
+
+selector_status
+selector_set_timeout(fd_selector s, const int fd, const unsigned ms) {
+    if(NULL == s || fd < 0 || (size_t)fd >= s->fd_size || !ITEM_USED(s->fds + fd)) {
+        return SELECTOR_IARGS;
+    }
+    struct item *item = s->fds + fd;
+    const uint64_t now = wheel_clock();
+    if(-1 != item->tslot) {
+        timer_unlink(s, item);
+    } else if(0 == s->timers++) {
+        // sin timers el wheel no avanza: lo traemos al presente
+        s->wheel_now = now;
+    }
+    item->expires = now + ms;
+    if(item->expires <= s->wheel_now) {
+        item->expires = s->wheel_now + 1;
+    }
+    timer_link(s, item);
+    return SELECTOR_SUCCESS;
+}
+
+selector_status
+selector_cancel_timeout(fd_selector s, const int fd) {
+    if(NULL == s || fd < 0 || (size_t)fd >= s->fd_size || !ITEM_USED(s->fds + fd)) {
+        return SELECTOR_IARGS;
+    }
+    struct item *item = s->fds + fd;
+    if(-1 != item->tslot) {
+        timer_unlink(s, item);
+        s->timers--;
+    }
+    return SELECTOR_SUCCESS;
+}
+
+#ifdef SELECTOR_USE_EPOLL
+
+static uint32_t
+interest_to_epoll(const fd_interest interest) {
+    uint32_t events = 0;
+    if(interest & OP_READ) {
+        events |= EPOLLIN | EPOLLRDHUP;
+    }
+    if(interest & OP_WRITE) {
+        events |= EPOLLOUT;
+    }
+    return events;
+}
+
 /**
- * calcula el fd maximo para ser utilizado en select()
+ * sincroniza el interés del item con el kernel.
+ *
+ * Los fds sin interés se sacan del epoll: epoll(7) siempre reporta
+ * EPOLLHUP/EPOLLERR, y como es level-triggered un fd sin interés que el
+ * peer cerró nos haría girar en vacío hasta que alguien lo atienda.
+ */
+static selector_status
+epoll_update(fd_selector s, struct item * item) {
+    selector_status ret = SELECTOR_SUCCESS;
+    const fd_interest want = ITEM_USED(item) ? item->interest : OP_NOOP;
+
+    if(want == item->kinterest) {
+        goto finally;
+    }
+
+    int op;
+    if(want == OP_NOOP) {
+        op = EPOLL_CTL_DEL;
+    } else if(item->kinterest == OP_NOOP) {
+        op = EPOLL_CTL_ADD;
+    } else {
+        op = EPOLL_CTL_MOD;
+    }
+
+    struct epoll_event ev = {
+        .events   = interest_to_epoll(want),
+        .data.u64 = ((uint64_t)item->gen << 32) | (uint32_t)item->fd,
+    };
+    if(-1 == epoll_ctl(s->epfd, op, item->fd, &ev)) {
+        // EBADF / ENOENT en un DEL: el fd ya se cerró y el kernel lo sacó solo.
+        if(op != EPOLL_CTL_DEL) {
+            ret = SELECTOR_IO;
+            goto finally;
+        }
+    }
+    item->kinterest = want;
+
+finally:
+    return ret;
+}
+
+
+#ifdef SELECTOR_USE_URING
+
+/**
+ * Motor io_uring.
+ *
+ * Cada fd con interés tiene a lo sumo un IORING_OP_POLL_ADD one-shot en
+ * vuelo. Al completarse se despacha y, si sigue habiendo interés, se vuelve
+ * a armar: como el poll revisa el estado actual al armarse, se conserva la
+ * semántica level-triggered de select(2)/epoll(7) de la que dependen los
+ * handlers. Los (re)armados se acumulan en `dirty' y se envían junto con la
+ * espera en un único io_uring_enter(2) por iteración.
+ *
+ * Además de avisar, el motor hace el I/O por completitud:
+ *  - `selector_accept': un IORING_OP_ACCEPT multishot por socket pasivo, que
+ *    entrega cada conexión aceptada a `handle_accept'.
+ *  - `selector_relay': por cada dirección, un IORING_OP_RECV que toma un
+ *    buffer de un anillo provisto al kernel (IORING_REGISTER_PBUF_RING) recién
+ *    cuando llegan datos, y un IORING_OP_SEND al otro extremo. Lo recibido se
+ *    copia a la cola de la dirección y el buffer vuelve al anillo en el
+ *    momento, así que el anillo no se agota porque algunos destinos no lean.
+ *    El recv es de un buffer por vez y solo se arma si hay lugar en la cola:
+ *    uno multishot vacía el socket en el anillo aunque el destino no lea, y
+ *    la cola no tendría más tope que el anillo entero. Los recv y send de
+ *    todas las conexiones salen en el mismo io_uring_enter(2) que la espera.
+ */
+
+/** entradas de la submission queue (el kernel puede ajustarlo) */
+#define URING_SQ_ENTRIES    4096
+/** entradas de la completion queue: un poll en vuelo por fd */
+#define URING_CQ_ENTRIES    65536
+/** completions que se atienden como máximo por iteración */
+#define URING_CQ_BATCH      (4 * SELECTOR_MAX_EVENTS)
+/** user_data de las completions que no hay que despachar */
+#define URING_UD_IGNORE     UINT64_MAX
+/**
+ * user_data de las demás: los polls llevan la generación del item (acotada
+ * a URING_GEN_MASK) y el fd; los accept lo mismo con URING_UD_ACCEPT; las
+ * del relay, la dirección del `struct uring_dir' con URING_UD_RELAY y la
+ * operación en los bits bajos.
+ */
+#define URING_UD_ACCEPT     ((uint64_t)1 << 62)
+#define URING_UD_RELAY      ((uint64_t)1 << 63)
+#define URING_GEN_MASK      0x3fffffffu
+#define URING_RELAY_RECV    1u
+#define URING_RELAY_SEND    2u
+#define URING_RELAY_OPS     3u
+
+/** tamaño y cantidad (potencia de 2) de los buffers provistos */
+#define URING_BUF_SIZE      (64 * 1024)
+#define URING_BUF_COUNT     64
+/** grupo de los buffers provistos */
+#define URING_BUF_GROUP     0
+/**
+ * chunks que puede acumular una dirección cuyo destino no da abasto: con la
+ * cola llena no se arma el recv hasta que salga el primero.
+ */
+#define URING_RELAY_QUEUE   4
+/** chunks libres que se guardan para reusar */
+#define URING_CHUNK_CACHE   16
+
+static int
+uring_enter(struct uring *r, unsigned to_submit, unsigned min_complete,
+            unsigned flags, const void *arg, size_t argsz) {
+    return (int) syscall(__NR_io_uring_enter, r->fd, to_submit, min_complete,
+                         flags, arg, argsz);
+}
+
+static void
+uring_close(struct uring *r) {
+    if(r->sqes != NULL && r->sqes != MAP_FAILED) {
+        munmap(r->sqes, r->sqes_size);
+    }
+    if(r->cq_ptr != NULL && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr) {
+        munmap(r->cq_ptr, r->cq_size);
+    }
+    if(r->sq_ptr != NULL && r->sq_ptr != MAP_FAILED) {
+        munmap(r->sq_ptr, r->sq_size);
+    }
+    if(r->fd >= 0) {
+        close(r->fd);
+    }
+    memset(r, 0x00, sizeof(*r));
+    r->fd = -1;
+}
+
+/**
+ * crea y mapea el ring. Falla (-1) si el kernel no soporta io_uring o no
+ * tiene lo que necesitamos: IORING_ENTER_EXT_ARG (timeout + máscara de
+ * señales en el enter, 5.11) y completions que no se pierdan (NODROP).
+ */
+static int
+uring_setup(struct uring *r) {
+    struct io_uring_params p;
+    memset(&p, 0x00, sizeof(p));
+    memset(r, 0x00, sizeof(*r));
+    p.flags      = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+    p.cq_entries = URING_CQ_ENTRIES;
+
+    r->fd = (int) syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &p);
+    if(r->fd < 0) {
+        r->fd = -1;
+        goto fail;
+    }
+    if(0 == (p.features & IORING_FEAT_EXT_ARG)
+    || 0 == (p.features & IORING_FEAT_NODROP)) {
+        errno = ENOSYS;
+        goto fail;
+    }
+
+    r->sq_size   = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size   = p.cq_off.cqes  + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        if(r->cq_size > r->sq_size) {
+            r->sq_size = r->cq_size;
+        }
+        r->cq_size = r->sq_size;
+    }
+    r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if(MAP_FAILED == r->sq_ptr) {
+        goto fail;
+    }
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if(MAP_FAILED == r->cq_ptr) {
+            goto fail;
+        }
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if(MAP_FAILED == r->sqes) {
+        goto fail;
+    }
+
+    uint8_t *sq = r->sq_ptr, *cq = r->cq_ptr;
+    r->sq_head    = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail    = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask    = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array   = (unsigned *)(sq + p.sq_off.array);
+    r->sq_entries = p.sq_entries;
+    r->cq_head    = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail    = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask    = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes       = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    r->sqe_tail   = *r->sq_tail;
+
+    // el índice de cada slot es fijo: la SQE i siempre vive en sqes[i]
+    for(unsigned i = 0; i < r->sq_entries; i++) {
+        r->sq_array[i] = i;
+    }
+    return 0;
+
+fail:
+    uring_close(r);
+    return -1;
+}
+
+static inline uint8_t *
+uring_buf(fd_selector s, const int bid) {
+    return s->bufs + (size_t)bid * URING_BUF_SIZE;
+}
+
+/** devuelve el buffer `bid' al anillo, para que el kernel lo vuelva a usar */
+static void
+uring_buf_put(fd_selector s, const int bid) {
+    struct io_uring_buf *b = s->buf_ring->bufs + (s->buf_tail & (URING_BUF_COUNT - 1));
+    b->addr = (uint64_t)(uintptr_t)uring_buf(s, bid);
+    b->len  = URING_BUF_SIZE;
+    b->bid  = (uint16_t)bid;
+    s->buf_tail++;
+    __atomic_store_n(&s->buf_ring->tail, s->buf_tail, __ATOMIC_RELEASE);
+    s->buf_free++;
+}
+
+static void
+uring_bufs_close(fd_selector s) {
+    if(NULL != s->buf_ring) {
+        munmap(s->buf_ring, URING_BUF_COUNT * sizeof(struct io_uring_buf));
+        s->buf_ring = NULL;
+    }
+    if(NULL != s->bufs) {
+        munmap(s->bufs, (size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+        s->bufs = NULL;
+    }
+    while(NULL != s->chunks) {
+        struct uring_chunk *next = s->chunks->next;
+        free(s->chunks);
+        s->chunks = next;
+    }
+    s->chunks_len = 0;
+}
+
+/**
+ * prepara lo que usa el I/O por completitud. Falla (-1) si el kernel no
+ * tiene accept multishot ni anillos de buffers provistos (5.19; se detecta
+ * por IORING_OP_SOCKET, que llegó en la misma versión).
  */
 static int
-items_max_fd(fd_selector s) {
-    int max = 0;
-    for(int i = 0; i <= s->max_fd; i++) {
-        struct item *item = s->fds + i;
-        if(ITEM_USED(item)) {
-            if(item->fd > max) {
-                max = item->fd;
+uring_bufs_setup(fd_selector s) {
+    const unsigned nops = 256;
+    struct io_uring_probe *probe = calloc(1, sizeof(*probe) + nops * sizeof(probe->ops[0]));
+    if(NULL == probe) {
+        goto fail;
+    }
+    const bool multishot =
+        syscall(__NR_io_uring_register, s->ring.fd, IORING_REGISTER_PROBE, probe, nops) >= 0
+        && probe->ops_len > IORING_OP_SOCKET
+        && 0 != (probe->ops[IORING_OP_SOCKET].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    if(!multishot) {
+        errno = ENOSYS;
+        goto fail;
+    }
+
+    s->buf_ring = mmap(NULL, URING_BUF_COUNT * sizeof(struct io_uring_buf),
+                       PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(MAP_FAILED == s->buf_ring) {
+        s->buf_ring = NULL;
+    }
+    s->bufs = mmap(NULL, (size_t)URING_BUF_COUNT * URING_BUF_SIZE,
+                   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(MAP_FAILED == s->bufs) {
+        s->bufs = NULL;
+    }
+    if(NULL == s->buf_ring || NULL == s->bufs) {
+        goto fail;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0x00, sizeof(reg));
+    reg.ring_addr    = (uint64_t)(uintptr_t)s->buf_ring;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid         = URING_BUF_GROUP;
+    if(syscall(__NR_io_uring_register, s->ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        goto fail;
+    }
+    for(int i = 0; i < URING_BUF_COUNT; i++) {
+        uring_buf_put(s, i);
+    }
+    return 0;
+
+fail:
+    uring_bufs_close(s);
+    return -1;
+}
+
+/** publica las SQE preparadas y retorna cuántas faltan enviar al kernel */
+static unsigned
+uring_flush_sq(struct uring *r) {
+    __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+    return r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/** obtiene una SQE libre. Si la cola está llena la envía sin esperar. */
+static struct io_uring_sqe *
+uring_get_sqe(struct uring *r) {
+    if(r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE)
+       >= r->sq_entries) {
+        const unsigned n = uring_flush_sq(r);
+        if(uring_enter(r, n, 0, 0, NULL, 0) < 0) {
+            return NULL;
+        }
+    }
+    struct io_uring_sqe *sqe = r->sqes + (r->sqe_tail & *r->sq_mask);
+    r->sqe_tail++;
+    memset(sqe, 0x00, sizeof(*sqe));
+    return sqe;
+}
+
+static inline uint64_t
+item_user_data(const struct item *item) {
+    return ((uint64_t)(item->gen & URING_GEN_MASK) << 32) | (uint32_t)item->fd;
+}
+
+/** arma un poll one-shot con el interés actual del item */
+static selector_status
+uring_poll_add(fd_selector s, struct item *item) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&s->ring);
+    if(NULL == sqe) {
+        return SELECTOR_IO;
+    }
+    item->gen       = s->next_gen++;
+    item->kinterest = item->interest;
+    sqe->opcode        = IORING_OP_POLL_ADD;
+    sqe->fd            = item->fd;
+    sqe->poll32_events = interest_to_epoll(item->interest);
+    sqe->user_data     = item_user_data(item);
+    return SELECTOR_SUCCESS;
+}
+
+/**
+ * cancela el poll en vuelo. Se hace en el momento (no se difiere) porque
+ * el poll retiene una referencia al archivo: si el usuario cierra el fd
+ * el socket no se libera hasta que el poll termina.
+ */
+static selector_status
+uring_poll_remove(fd_selector s, struct item *item) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&s->ring);
+    if(NULL == sqe) {
+        return SELECTOR_IO;
+    }
+    sqe->opcode    = IORING_OP_POLL_REMOVE;
+    sqe->fd        = -1;
+    sqe->addr      = item_user_data(item);
+    sqe->user_data = URING_UD_IGNORE;
+    item->kinterest = OP_NOOP;
+    return SELECTOR_SUCCESS;
+}
+
+/** agenda al item para ser (re)armado antes de la próxima espera */
+static selector_status
+uring_mark_dirty(fd_selector s, struct item *item) {
+    if(item->dirty) {
+        return SELECTOR_SUCCESS;
+    }
+    if(s->dirty_len == s->dirty_size) {
+        const size_t new_size = s->dirty_size == 0 ? 64 : s->dirty_size * 2;
+        int *tmp = realloc(s->dirty, new_size * sizeof(*tmp));
+        if(NULL == tmp) {
+            return SELECTOR_ENOMEM;
+        }
+        s->dirty      = tmp;
+        s->dirty_size = new_size;
+    }
+    s->dirty[s->dirty_len++] = item->fd;
+    item->dirty = true;
+    return SELECTOR_SUCCESS;
+}
+
+/** cancela las operaciones en vuelo con user_data `ud' */
+static selector_status
+uring_cancel(fd_selector s, const uint64_t ud) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&s->ring);
+    if(NULL == sqe) {
+        return SELECTOR_IO;
+    }
+    sqe->opcode       = IORING_OP_ASYNC_CANCEL;
+    sqe->fd           = -1;
+    sqe->addr         = ud;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data    = URING_UD_IGNORE;
+    return SELECTOR_SUCCESS;
+}
+
+/** arma el accept multishot del socket pasivo del item */
+static selector_status
+uring_accept_arm(fd_selector s, struct item *item) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&s->ring);
+    if(NULL == sqe) {
+        return SELECTOR_IO;
+    }
+    item->accept_ud = URING_UD_ACCEPT
+                    | ((uint64_t)(s->next_gen++ & URING_GEN_MASK) << 32)
+                    | (uint32_t)item->fd;
+    sqe->opcode       = IORING_OP_ACCEPT;
+    sqe->fd           = item->fd;
+    sqe->ioprio       = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data    = item->accept_ud;
+    return SELECTOR_SUCCESS;
+}
+
+/** entrega una conexión aceptada (o un error del accept) */
+static void
+uring_accept_complete(fd_selector s, const uint64_t ud, const int32_t res,
+                      const uint32_t flags) {
+    const int fd = (int)(uint32_t)ud;
+    struct item *item = (size_t)fd < s->fd_size ? s->fds + fd : NULL;
+
+    if(NULL == item || !ITEM_USED(item) || item->accept_ud != ud) {
+        // de un registro anterior: la conexión no tiene quién la atienda
+        if(res >= 0) {
+            close(res);
+        }
+        return;
+    }
+    if(0 == (flags & IORING_CQE_F_MORE)) {
+        // se cortó (p.ej. por falta de fds): se rearma antes de la espera
+        item->accept_ud = 0;
+        if(SELECTOR_SUCCESS != uring_mark_dirty(s, item)) {
+            uring_accept_arm(s, item);
+        }
+    }
+    if(res < 0) {
+        return;
+    }
+    if(NULL == item->handler->handle_accept) {
+        close(res);
+        return;
+    }
+    struct selector_key key = {
+        .s    = s,
+        .fd   = item->fd,
+        .data = item->data,
+    };
+    item->handler->handle_accept(&key, res);
+}
+
+static inline uint64_t
+dir_user_data(const struct uring_dir *d, const unsigned op) {
+    return URING_UD_RELAY | (uint64_t)(uintptr_t)d | op;
+}
+
+static void
+uring_chunk_put(fd_selector s, struct uring_chunk *c) {
+    if(s->chunks_len < URING_CHUNK_CACHE) {
+        c->next   = s->chunks;
+        s->chunks = c;
+        s->chunks_len++;
+    } else {
+        free(c);
+    }
+}
+
+/** agrega `len' bytes al final de la cola; llena el último chunk si entran */
+static selector_status
+dir_push(fd_selector s, struct uring_dir *d, const uint8_t *src, const uint32_t len) {
+    struct uring_chunk *c = d->tail;
+    // el send en vuelo del primero solo lee lo que había: se puede agregar
+    if(NULL == c || URING_BUF_SIZE - c->len < len) {
+        c = s->chunks;
+        if(NULL != c) {
+            s->chunks = c->next;
+            s->chunks_len--;
+        } else if(NULL == (c = malloc(sizeof(*c) + URING_BUF_SIZE))) {
+            return SELECTOR_ENOMEM;
+        }
+        c->next = NULL;
+        c->len  = c->sent = 0;
+        if(NULL == d->tail) {
+            d->head = c;
+        } else {
+            d->tail->next = c;
+        }
+        d->tail = c;
+        d->queued++;
+    }
+    memcpy(c->data + c->len, src, len);
+    c->len += len;
+    return SELECTOR_SUCCESS;
+}
+
+/** libera el primer chunk de la cola, que ya salió entero */
+static void
+dir_pop(fd_selector s, struct uring_dir *d) {
+    struct uring_chunk *c = d->head;
+    d->head = c->next;
+    if(NULL == d->head) {
+        d->tail = NULL;
+    }
+    d->queued--;
+    uring_chunk_put(s, c);
+}
+
+/**
+ * libera los chunks de la cola, menos el primero si `keep' (lo está usando
+ * un send en vuelo).
+ */
+static void
+dir_drop(fd_selector s, struct uring_dir *d, const bool keep) {
+    if(NULL == d->head) {
+        return;
+    }
+    struct uring_chunk *c = keep ? d->head->next : d->head;
+    while(NULL != c) {
+        struct uring_chunk *next = c->next;
+        uring_chunk_put(s, c);
+        c = next;
+    }
+    if(keep) {
+        d->head->next = NULL;
+        d->tail   = d->head;
+        d->queued = 1;
+    } else {
+        d->head   = d->tail = NULL;
+        d->queued = 0;
+    }
+}
+
+/** anota a la dirección para rearmar su recv cuando vuelvan buffers */
+static void
+dir_starve(fd_selector s, struct uring_dir *d) {
+    d->starved      = true;
+    d->next_starved = NULL;
+    if(NULL == s->starved_tail) {
+        s->starved_head = d;
+    } else {
+        s->starved_tail->next_starved = d;
+    }
+    s->starved_tail = d;
+}
+
+static void
+dir_unstarve(fd_selector s, struct uring_dir *d) {
+    struct uring_dir *prev = NULL;
+    for(struct uring_dir *i = s->starved_head; i != NULL; prev = i, i = i->next_starved) {
+        if(i == d) {
+            if(NULL == prev) {
+                s->starved_head = d->next_starved;
+            } else {
+                prev->next_starved = d->next_starved;
+            }
+            if(s->starved_tail == d) {
+                s->starved_tail = prev;
             }
+            break;
+        }
+    }
+    d->starved = false;
+}
+
+static selector_status
+uring_relay_recv(fd_selector s, struct uring_dir *d) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&s->ring);
+    if(NULL == sqe) {
+        return SELECTOR_IO;
+    }
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->fd        = d->from;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = dir_user_data(d, URING_RELAY_RECV);
+    d->recv_armed  = true;
+    d->recv_cancel = false;
+    d->relay->inflight++;
+    return SELECTOR_SUCCESS;
+}
+
+/**
+ * manda lo que falta del primer chunk de la cola. Con `poll_first' espera
+ * a que el socket tenga lugar en vez de intentar primero.
+ */
+static selector_status
+uring_relay_send(fd_selector s, struct uring_dir *d, const bool poll_first) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&s->ring);
+    if(NULL == sqe) {
+        return SELECTOR_IO;
+    }
+    sqe->opcode    = IORING_OP_SEND;
+    sqe->fd        = d->to;
+    sqe->addr      = (uint64_t)(uintptr_t)(d->head->data + d->head->sent);
+    sqe->len       = d->head->len - d->head->sent;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->ioprio    = poll_first ? IORING_RECVSEND_POLL_FIRST : 0;
+    sqe->user_data = dir_user_data(d, URING_RELAY_SEND);
+    d->sending = true;
+    d->relay->inflight++;
+    return SELECTOR_SUCCESS;
+}
+
+/** reporta `n' a `handle_relay' del fd de origen de la dirección */
+static void
+uring_relay_report(fd_selector s, struct uring_dir *d, const ssize_t n) {
+    struct item *item = s->fds + d->from;
+    if(!ITEM_USED(item) || item->relay != d->relay
+       || NULL == item->handler->handle_relay) {
+        return;
+    }
+    struct selector_key key = {
+        .s    = s,
+        .fd   = item->fd,
+        .data = item->data,
+    };
+    item->handler->handle_relay(&key, n);
+}
+
+/** la dirección falló: deja de recibir y lo reporta */
+static void
+uring_dir_fail(fd_selector s, struct uring_dir *d, const int err) {
+    d->failed = true;
+    d->eof    = true;
+    if(d->starved) {
+        dir_unstarve(s, d);
+    }
+    if(d->recv_armed && !d->recv_cancel
+       && SELECTOR_SUCCESS == uring_cancel(s, dir_user_data(d, URING_RELAY_RECV))) {
+        d->recv_cancel = true;
+    }
+    uring_relay_report(s, d, err);
+}
+
+/**
+ * hace avanzar la dirección: manda el próximo chunk, rearma el recv si la
+ * cola bajó y, al llegar al EOF con todo entregado, cierra la escritura del
+ * otro extremo y lo reporta.
+ */
+static void
+uring_dir_pump(fd_selector s, struct uring_dir *d) {
+    if(!d->sending && d->queued > 0
+       && SELECTOR_SUCCESS != uring_relay_send(s, d, false)) {
+        uring_dir_fail(s, d, -EIO);
+        return;
+    }
+    if(!d->eof && !d->recv_armed && !d->starved && d->queued < URING_RELAY_QUEUE
+       && SELECTOR_SUCCESS != uring_relay_recv(s, d)) {
+        uring_dir_fail(s, d, -EIO);
+        return;
+    }
+    if(d->eof && !d->done && !d->sending && 0 == d->queued) {
+        d->done = true;
+        shutdown(d->to, SHUT_WR);
+        uring_relay_report(s, d, 0);
+    }
+}
+
+/** libera el relay si ya no pertenece a los fds y no le queda nada en vuelo */
+static void
+uring_relay_free_if_idle(fd_selector s, struct uring_relay *relay) {
+    if(!relay->detached || relay->inflight > 0) {
+        return;
+    }
+    if(NULL == relay->prev) {
+        s->relays = relay->next;
+    } else {
+        relay->prev->next = relay->next;
+    }
+    if(NULL != relay->next) {
+        relay->next->prev = relay->prev;
+    }
+    free(relay);
+}
+
+/**
+ * corta el relay: cancela lo que tiene en vuelo y suelta la cola. Se
+ * libera cuando llegan las últimas completions.
+ */
+static void
+uring_relay_detach(fd_selector s, struct uring_relay *relay) {
+    relay->detached = true;
+    for(unsigned i = 0; i < N(relay->dir); i++) {
+        struct uring_dir *d = relay->dir + i;
+        if(d->starved) {
+            dir_unstarve(s, d);
+        }
+        if(d->recv_armed && !d->recv_cancel) {
+            uring_cancel(s, dir_user_data(d, URING_RELAY_RECV));
+            d->recv_cancel = true;
+        }
+        if(d->sending) {
+            uring_cancel(s, dir_user_data(d, URING_RELAY_SEND));
+        }
+        dir_drop(s, d, d->sending);
+
+        struct item *item = s->fds + d->from;
+        if(item->relay == relay) {
+            item->relay = NULL;
+        }
+    }
+    uring_relay_free_if_idle(s, relay);
+}
+
+static void
+uring_relay_recv_complete(fd_selector s, struct uring_dir *d, const int32_t res,
+                          const uint32_t flags) {
+    struct uring_relay *relay = d->relay;
+
+    d->recv_armed = false;
+    relay->inflight--;
+
+    selector_status st = SELECTOR_SUCCESS;
+    if(flags & IORING_CQE_F_BUFFER) {
+        const int bid = (int)(flags >> IORING_CQE_BUFFER_SHIFT);
+        s->buf_free--;
+        if(res > 0 && !relay->detached && !d->failed) {
+            st = dir_push(s, d, uring_buf(s, bid), (uint32_t)res);
+        }
+        uring_buf_put(s, bid);
+    }
+    if(relay->detached || d->failed) {
+        return;
+    }
+    if(SELECTOR_SUCCESS != st) {
+        uring_dir_fail(s, d, -ENOMEM);
+        return;
+    }
+    if(0 == res) {
+        d->eof = true;
+    } else if(-ENOBUFS == res) {
+        dir_starve(s, d);
+    } else if(res < 0 && -ECANCELED != res) {
+        uring_dir_fail(s, d, res);
+        return;
+    }
+    uring_dir_pump(s, d);
+}
+
+static void
+uring_relay_send_complete(fd_selector s, struct uring_dir *d, const int32_t res) {
+    struct uring_relay *relay = d->relay;
+
+    d->sending = false;
+    relay->inflight--;
+    if(relay->detached) {
+        dir_drop(s, d, false);
+        return;
+    }
+    if(-EAGAIN == res) {
+        if(SELECTOR_SUCCESS != uring_relay_send(s, d, true)) {
+            uring_dir_fail(s, d, -EIO);
+        }
+        return;
+    }
+    if(res <= 0) {
+        uring_dir_fail(s, d, res < 0 ? res : -EPIPE);
+        return;
+    }
+    d->head->sent += (uint32_t)res;
+    if(d->head->sent == d->head->len) {
+        dir_pop(s, d);
+    }
+    uring_relay_report(s, d, res);
+    if(!relay->detached) {
+        uring_dir_pump(s, d);
+    }
+}
+
+/** atiende una completion del relay */
+static void
+uring_relay_complete(fd_selector s, const uint64_t ud, const int32_t res,
+                     const uint32_t flags) {
+    struct uring_dir *d = (struct uring_dir *)(uintptr_t)
+                          (ud & ~(URING_UD_RELAY | URING_RELAY_OPS));
+    struct uring_relay *relay = d->relay;
+
+    // el handler puede cortar el relay: no se libera mientras se atiende
+    relay->inflight++;
+    if(URING_RELAY_RECV == (ud & URING_RELAY_OPS)) {
+        uring_relay_recv_complete(s, d, res, flags);
+    } else {
+        uring_relay_send_complete(s, d, res);
+    }
+    relay->inflight--;
+    uring_relay_free_if_idle(s, relay);
+}
+
+/** rearma los recv que esperaban buffers, mientras haya libres */
+static void
+uring_arm_starved(fd_selector s) {
+    while(NULL != s->starved_head && s->buf_free > 0) {
+        struct uring_dir *d = s->starved_head;
+        s->starved_head = d->next_starved;
+        if(NULL == s->starved_head) {
+            s->starved_tail = NULL;
         }
+        d->starved = false;
+        d->relay->inflight++;
+        uring_dir_pump(s, d);
+        d->relay->inflight--;
+        uring_relay_free_if_idle(s, d->relay);
     }
-    return max;
 }
 
+/** suelta lo que el item tiene en vuelo por completitud al desregistrarse */
 static void
+uring_release(fd_selector s, struct item *item) {
+    if(0 != item->accept_ud) {
+        uring_cancel(s, item->accept_ud);
+        item->accept_ud = 0;
+    }
+    if(NULL != item->relay) {
+        uring_relay_detach(s, item->relay);
+    }
+}
+
+static selector_status
+uring_update(fd_selector s, struct item *item) {
+    selector_status ret = SELECTOR_SUCCESS;
+    const fd_interest want = ITEM_USED(item) ? item->interest : OP_NOOP;
+
+    if(item->kinterest != OP_NOOP && item->kinterest != want) {
+        ret = uring_poll_remove(s, item);
+    }
+    if(SELECTOR_SUCCESS == ret && want != OP_NOOP
+       && item->kinterest == OP_NOOP) {
+        ret = uring_mark_dirty(s, item);
+    }
+    return ret;
+}
+
+/** arma los polls de los items que lo necesitan */
+static selector_status
+uring_arm_dirty(fd_selector s) {
+    selector_status ret = SELECTOR_SUCCESS;
+    size_t i;
+    for(i = 0; i < s->dirty_len && SELECTOR_SUCCESS == ret; i++) {
+        struct item *item = s->fds + s->dirty[i];
+        // se pudo haber desregistrado (y hasta re-registrado) en el medio
+        if(!ITEM_USED(item) || !item->dirty) {
+            continue;
+        }
+        item->dirty = false;
+        if(item->interest != OP_NOOP && item->kinterest == OP_NOOP) {
+            ret = uring_poll_add(s, item);
+        }
+        if(SELECTOR_SUCCESS == ret && item->accept && 0 == item->accept_ud) {
+            ret = uring_accept_arm(s, item);
+        }
+    }
+    s->dirty_len = 0;
+    return ret;
+}
+
+#endif
+
+/** sincroniza el interés del item con el motor en uso */
+static selector_status
+items_update_fdset_for_fd(fd_selector s, struct item * item) {
+#ifdef SELECTOR_USE_URING
+    if(SELECTOR_ENGINE_URING == s->engine) {
+        return uring_update(s, item);
+    }
+#endif
+    return epoll_update(s, item);
+}
+
+#else
+
+static selector_status
 items_update_fdset_for_fd(fd_selector s, const struct item * item) {
     FD_CLR(item->fd, &s->master_r);
     FD_CLR(item->fd, &s->master_w);
@@ -235,6 +1531,33 @@ items_update_fdset_for_fd(fd_selector s, const struct item * item) {
             FD_SET(item->fd, &(s->master_w));
         }
     }
+    return SELECTOR_SUCCESS;
+}
+
+#endif
+
+/**
+ * agranda los arreglos auxiliares indexados por registro para que
+ * acompañen a `fds'.
+ */
+static selector_status
+aux_capacity(fd_selector s, const size_t n) {
+    if (n > SIZE_MAX/sizeof(int)) { // ver MEM07-C
+        return SELECTOR_ENOMEM;
+    }
+    int *tmp = realloc(s->active, n * sizeof(*tmp));
+    if(NULL == tmp) {
+        return SELECTOR_ENOMEM;
+    }
+    s->active = tmp;
+#ifndef SELECTOR_USE_EPOLL
+    tmp = realloc(s->ready, n * sizeof(*tmp));
+    if(NULL == tmp) {
+        return SELECTOR_ENOMEM;
+    }
+    s->ready = tmp;
+#endif
+    return SELECTOR_SUCCESS;
 }
 
 /**
@@ -260,6 +1583,9 @@ ensure_capacity(fd_selector s, const size_t n) {
         s->fds = calloc(new_size, element_size);
         if(NULL == s->fds) {
             ret = SELECTOR_ENOMEM;
+        } else if(SELECTOR_SUCCESS != (ret = aux_capacity(s, new_size))) {
+            free(s->fds);
+            s->fds = NULL;
         } else {
             s->fd_size = new_size;
             items_init(s, 0);
@@ -269,6 +1595,8 @@ ensure_capacity(fd_selector s, const size_t n) {
         const size_t new_size = next_capacity(n);
         if (new_size > SIZE_MAX/element_size) { // ver MEM07-C
             ret = SELECTOR_ENOMEM;
+        } else if(SELECTOR_SUCCESS != (ret = aux_capacity(s, new_size))) {
+            // nada: los arreglos auxiliares quedan más grandes, no molesta
         } else {
             struct item *tmp = realloc(s->fds, new_size * element_size);
             if(NULL == tmp) {
@@ -278,11 +1606,158 @@ ensure_capacity(fd_selector s, const size_t n) {
                 const size_t old_size = s->fd_size;
                 s->fd_size = new_size;
 
-                items_init(s, old_size);
-            }
+                items_init(s, old_size);
+            }
+        }
+    }
+
+    return ret;
+}
+
+/**
+ * encola un trabajo terminado. Lock-free: los productores solo compiten por
+ * `completions_tail'. Retorna false si la cola está llena.
+ */
+static bool
+completions_push(fd_selector s, const int fd) {
+    const size_t mask = SELECTOR_COMPLETIONS - 1;
+    struct completion *c;
+    size_t pos = atomic_load_explicit(&s->completions_tail, memory_order_relaxed);
+    for(;;) {
+        c = s->completions + (pos & mask);
+        const size_t   seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+        const intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if(dif == 0) {
+            if(atomic_compare_exchange_weak_explicit(&s->completions_tail, &pos,
+                    pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+            // el CAS fallido actualizó pos
+        } else if(dif < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&s->completions_tail, memory_order_relaxed);
+        }
+    }
+    c->fd = fd;
+    atomic_store_explicit(&c->seq, pos + 1, memory_order_release);
+    return true;
+}
+
+/** desencola un trabajo terminado. Solo desde el thread del selector. */
+static bool
+completions_pop(fd_selector s, int *fd) {
+    const size_t pos = s->completions_head;
+    struct completion *c = s->completions + (pos & (SELECTOR_COMPLETIONS - 1));
+    if(atomic_load_explicit(&c->seq, memory_order_acquire) != pos + 1) {
+        return false;
+    }
+    *fd = c->fd;
+    atomic_store_explicit(&c->seq, pos + SELECTOR_COMPLETIONS, memory_order_release);
+    s->completions_head = pos + 1;
+    return true;
+}
+
+/** despierta al selector, salvo que ya haya un despertar pendiente */
+static void
+completions_wake(fd_selector s) {
+    if(!atomic_exchange(&s->wake_pending, true)) {
+        const uint64_t one = 1;
+        ssize_t n;
+        do {
+            n = write(s->wake_wfd, &one, sizeof(one));
+        } while(-1 == n && EINTR == errno);
+        // EAGAIN: ya hay algo para leer, el selector se va a despertar igual
+    }
+}
+
+/**
+ * handler del fd de despertar: corre el handle_block de cada trabajo
+ * terminado. No se toma ningún lock mientras corren los handlers.
+ */
+static void
+handle_block_notifications(struct selector_key *wkey) {
+    fd_selector s = wkey->s;
+    uint64_t buff[8];
+    while(read(s->wake_rfd, buff, sizeof(buff)) > 0) {
+        // vaciamos el eventfd / pipe
+    }
+    // a partir de acá un productor que publique vuelve a despertarnos; los
+    // que publicaron antes los vemos en el recorrido de abajo
+    atomic_store(&s->wake_pending, false);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    struct selector_key key = {
+        .s = s,
+    };
+    int fd;
+    while(completions_pop(s, &fd)) {
+        if(fd < 0 || (size_t)fd >= s->fd_size) {
+            continue;
+        }
+        struct item *item = s->fds + fd;
+        if(ITEM_USED(item) && item->handler->handle_block != NULL) {
+            key.fd   = item->fd;
+            key.data = item->data;
+            item->handler->handle_block(&key);
+        }
+    }
+}
+
+static const struct fd_handler completions_handler = {
+    .handle_read = handle_block_notifications,
+};
+
+/** crea la cola de trabajos terminados y registra su fd de despertar */
+static selector_status
+completions_init(fd_selector s) {
+    s->completions = malloc(SELECTOR_COMPLETIONS * sizeof(*s->completions));
+    if(NULL == s->completions) {
+        return SELECTOR_ENOMEM;
+    }
+    for(size_t i = 0; i < SELECTOR_COMPLETIONS; i++) {
+        atomic_init(&s->completions[i].seq, i);
+    }
+    atomic_init(&s->completions_tail, 0);
+    s->completions_head = 0;
+    atomic_init(&s->wake_pending, false);
+#ifdef __linux__
+    s->wake_rfd = s->wake_wfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(-1 == s->wake_rfd) {
+        return SELECTOR_IO;
+    }
+#else
+    int p[2];
+    if(-1 == pipe(p)) {
+        return SELECTOR_IO;
+    }
+    s->wake_rfd = p[0];
+    s->wake_wfd = p[1];
+    if(-1 == selector_fd_set_nio(p[0]) || -1 == selector_fd_set_nio(p[1])) {
+        return SELECTOR_IO;
+    }
+#endif
+    return selector_register(s, s->wake_rfd, &completions_handler, OP_READ, s);
+}
+
+selector_status
+selector_notify_block(fd_selector  s,
+                 const int    fd) {
+    selector_status ret = SELECTOR_SUCCESS;
+
+    while(!completions_push(s, fd)) {
+        // cola llena: esperamos a que el selector la vacíe, salvo que seamos
+        // el propio thread del selector (nadie más la va a vaciar)
+        if(pthread_equal(pthread_self(), s->selector_thread)) {
+            ret = SELECTOR_ENOMEM;
+            goto finally;
         }
+        completions_wake(s);
+        sched_yield();
     }
+    completions_wake(s);
 
+finally:
     return ret;
 }
 
@@ -295,13 +1770,43 @@ selector_new(const size_t initial_elements) {
         ret->master_t.tv_sec  = conf.select_timeout.tv_sec;
         ret->master_t.tv_nsec = conf.select_timeout.tv_nsec;
         assert(ret->max_fd == 0);
-        ret->resolution_jobs  = 0;
-        pthread_mutex_init(&ret->resolution_mutex, 0);
-        if(0 != ensure_capacity(ret, initial_elements)) {
+        ret->wake_rfd = ret->wake_wfd = -1;
+        for(size_t i = 0; i < N(ret->wheel); i++) {
+            ret->wheel[i] = -1;
+        }
+        ret->wheel_now = wheel_clock();
+        ret->engine = SELECTOR_ENGINE_DEFAULT;
+#ifdef SELECTOR_USE_URING
+        ret->ring.fd = -1;
+        // si el kernel no soporta io_uring seguimos con epoll
+        if(SELECTOR_ENGINE_URING == conf.engine && 0 == uring_setup(&ret->ring)) {
+            if(0 == uring_bufs_setup(ret)) {
+                ret->engine = SELECTOR_ENGINE_URING;
+            } else {
+                uring_close(&ret->ring);
+            }
+        }
+#endif
+#ifdef SELECTOR_USE_EPOLL
+        ret->epfd = -1;
+        if(SELECTOR_ENGINE_DEFAULT == ret->engine) {
+            ret->epfd = epoll_create1(EPOLL_CLOEXEC);
+            if(-1 == ret->epfd) {
+                free(ret);
+                ret = NULL;
+                goto finally;
+            }
+        }
+#endif
+        if(SELECTOR_SUCCESS != ensure_capacity(ret, initial_elements)
+           || SELECTOR_SUCCESS != completions_init(ret)) {
             selector_destroy(ret);
             ret = NULL;
         }
     }
+#ifdef SELECTOR_USE_EPOLL
+finally:
+#endif
     return ret;
 }
 
@@ -310,26 +1815,55 @@ selector_destroy(fd_selector s) {
     // lean ya que se llama desde los casos fallidos de _new.
     if(s != NULL) {
         if(s->fds != NULL) {
-            for(size_t i = 0; i < s->fd_size ; i++) {
-                if(ITEM_USED(s->fds + i)) {
-                    selector_unregister_fd(s, i);
-                }
-            }
-            pthread_mutex_destroy(&s->resolution_mutex);
-            struct blocking_job* j = s->resolution_jobs;
-            while (j != NULL) {
-                struct blocking_job* aux = j;
-                j = j->next;
-                free(aux);
+            // unregister saca al fd de `active'
+            while(s->active_len > 0) {
+                selector_unregister_fd(s, s->active[s->active_len - 1]);
             }
             free(s->fds);
             s->fds     = NULL;
             s->fd_size = 0;
         }
+        free(s->active);
+        free(s->completions);
+        if(s->wake_wfd >= 0 && s->wake_wfd != s->wake_rfd) {
+            close(s->wake_wfd);
+        }
+        if(s->wake_rfd >= 0) {
+            close(s->wake_rfd);
+        }
+#ifndef SELECTOR_USE_EPOLL
+        free(s->ready);
+#endif
+#ifdef SELECTOR_USE_URING
+        if(SELECTOR_ENGINE_URING == s->engine) {
+            uring_close(&s->ring);
+        }
+        free(s->dirty);
+        // los relays que esperaban sus últimas completions
+        while(NULL != s->relays) {
+            struct uring_relay *next = s->relays->next;
+            for(unsigned i = 0; i < N(s->relays->dir); i++) {
+                dir_drop(s, s->relays->dir + i, false);
+            }
+            free(s->relays);
+            s->relays = next;
+        }
+        uring_bufs_close(s);
+#endif
+#ifdef SELECTOR_USE_EPOLL
+        if(s->epfd >= 0) {
+            close(s->epfd);
+        }
+#endif
         free(s);
     }
 }
 
+selector_engine
+selector_get_engine(fd_selector s) {
+    return s->engine;
+}
+
 #define INVALID_FD(fd)  ((fd) < 0 || (fd) >= ITEMS_MAX_SIZE)
 
 selector_status
@@ -346,7 +1880,7 @@ selector_register(fd_selector        s,
     }
     // 1. tenemos espacio?
     size_t ufd = (size_t)fd;
-    if(ufd > s->fd_size) {
+    if(ufd >= s->fd_size) {
         ret = ensure_capacity(s, ufd);
         if(SELECTOR_SUCCESS != ret) {
             goto finally;
@@ -363,12 +1897,21 @@ selector_register(fd_selector        s,
         item->handler  = handler;
         item->interest = interest;
         item->data     = data;
+#ifdef SELECTOR_USE_EPOLL
+        item->gen      = s->next_gen++;
+#endif
+
+        ret = items_update_fdset_for_fd(s, item);
+        if(SELECTOR_SUCCESS != ret) {
+            item_init(item);
+            goto finally;
+        }
 
         // actualizo colaterales
+        items_active_add(s, item);
         if(fd > s->max_fd) {
             s->max_fd = fd;
         }
-        items_update_fdset_for_fd(s, item);
     }
 
 finally:
@@ -380,7 +1923,7 @@ selector_unregister_fd(fd_selector       s,
                        const int         fd) {
     selector_status ret = SELECTOR_SUCCESS;
 
-    if(NULL == s || INVALID_FD(fd)) {
+    if(NULL == s || INVALID_FD(fd) || (size_t)fd >= s->fd_size) {
         ret = SELECTOR_IARGS;
         goto finally;
     }
@@ -402,10 +1945,27 @@ selector_unregister_fd(fd_selector       s,
 
     item->interest = OP_NOOP;
     items_update_fdset_for_fd(s, item);
+#ifdef SELECTOR_USE_URING
+    if(SELECTOR_ENGINE_URING == s->engine) {
+        uring_release(s, item);
+    }
+#endif
 
+    if(-1 != item->tslot) {
+        timer_unlink(s, item);
+        s->timers--;
+    }
+    items_active_remove(s, item);
     memset(item, 0x00, sizeof(*item));
     item_init(item);
-    s->max_fd = items_max_fd(s);
+
+    // en vez de recalcular el máximo sobre toda la tabla, bajamos desde el
+    // actual hasta el próximo en uso: amortizado es O(1) por baja.
+    if(fd == s->max_fd) {
+        while(s->max_fd > 0 && !ITEM_USED(s->fds + s->max_fd)) {
+            s->max_fd--;
+        }
+    }
 
 finally:
     return ret;
@@ -415,7 +1975,7 @@ selector_status
 selector_set_interest(fd_selector s, int fd, fd_interest i) {
     selector_status ret = SELECTOR_SUCCESS;
 
-    if(NULL == s || INVALID_FD(fd)) {
+    if(NULL == s || INVALID_FD(fd) || (size_t)fd >= s->fd_size) {
         ret = SELECTOR_IARGS;
         goto finally;
     }
@@ -425,7 +1985,98 @@ selector_set_interest(fd_selector s, int fd, fd_interest i) {
         goto finally;
     }
     item->interest = i;
-    items_update_fdset_for_fd(s, item);
+    ret = items_update_fdset_for_fd(s, item);
+finally:
+    return ret;
+}
+
+selector_status
+selector_set_priority(fd_selector s, int fd, bool priority) {
+    selector_status ret = SELECTOR_SUCCESS;
+
+    if(NULL == s || INVALID_FD(fd) || (size_t)fd >= s->fd_size) {
+        ret = SELECTOR_IARGS;
+        goto finally;
+    }
+    struct item *item = s->fds + fd;
+    if(!ITEM_USED(item)) {
+        ret = SELECTOR_IARGS;
+        goto finally;
+    }
+    item->priority = priority;
+finally:
+    return ret;
+}
+
+selector_status
+selector_accept(fd_selector s, const int fd) {
+    selector_status ret = SELECTOR_SUCCESS;
+
+    if(NULL == s || INVALID_FD(fd) || (size_t)fd >= s->fd_size
+       || !ITEM_USED(s->fds + fd)) {
+        ret = SELECTOR_IARGS;
+        goto finally;
+    }
+#ifdef SELECTOR_USE_URING
+    if(SELECTOR_ENGINE_URING == s->engine) {
+        struct item *item = s->fds + fd;
+        item->accept = true;
+        if(0 == item->accept_ud) {
+            ret = uring_accept_arm(s, item);
+        }
+        goto finally;
+    }
+#endif
+    ret = SELECTOR_IARGS;
+finally:
+    return ret;
+}
+
+selector_status
+selector_relay(fd_selector s, const int a, const int b) {
+    selector_status ret = SELECTOR_SUCCESS;
+
+    if(NULL == s || a == b
+       || INVALID_FD(a) || (size_t)a >= s->fd_size || !ITEM_USED(s->fds + a)
+       || INVALID_FD(b) || (size_t)b >= s->fd_size || !ITEM_USED(s->fds + b)) {
+        ret = SELECTOR_IARGS;
+        goto finally;
+    }
+#ifdef SELECTOR_USE_URING
+    if(SELECTOR_ENGINE_URING == s->engine) {
+        if(NULL != s->fds[a].relay || NULL != s->fds[b].relay) {
+            ret = SELECTOR_FDINUSE;
+            goto finally;
+        }
+        struct uring_relay *relay = calloc(1, sizeof(*relay));
+        if(NULL == relay) {
+            ret = SELECTOR_ENOMEM;
+            goto finally;
+        }
+        for(unsigned i = 0; i < N(relay->dir); i++) {
+            struct uring_dir *d = relay->dir + i;
+            d->relay = relay;
+            d->from  = i == 0 ? a : b;
+            d->to    = i == 0 ? b : a;
+        }
+        relay->next = s->relays;
+        if(NULL != s->relays) {
+            s->relays->prev = relay;
+        }
+        s->relays = relay;
+        s->fds[a].relay = relay;
+        s->fds[b].relay = relay;
+
+        for(unsigned i = 0; i < N(relay->dir) && SELECTOR_SUCCESS == ret; i++) {
+            ret = uring_relay_recv(s, relay->dir + i);
+        }
+        if(SELECTOR_SUCCESS != ret) {
+            uring_relay_detach(s, relay);
+        }
+        goto finally;
+    }
+#endif
+    ret = SELECTOR_IARGS;
 finally:
     return ret;
 }
@@ -444,102 +2095,303 @@ selector_set_interest_key(struct selector_key *key, fd_interest i) {
 }
 
 /**
- * se encarga de manejar los resultados del select.
- * se encuentra separado para facilitar el testing
+ * despacha los eventos listos de un item a su handler, respetando el
+ * interés actual (puede haber cambiado durante la iteración).
  */
 static void
-handle_iteration(fd_selector s) {
-    int n = s->max_fd;
+dispatch(fd_selector s, struct item *item, const bool readable,
+         const bool writable) {
     struct selector_key key = {
-        .s = s,
+        .s    = s,
+        .fd   = item->fd,
+        .data = item->data,
     };
-
-    for (int i = 0; i <= n; i++) {
-        struct item *item = s->fds + i;
-        if(ITEM_USED(item)) {
-            key.fd   = item->fd;
-            key.data = item->data;
-            if(FD_ISSET(item->fd, &s->slave_r)) {
-                if(OP_READ & item->interest) {
-                    if(0 == item->handler->handle_read) {
-                        assert(("OP_READ arrived but no handler. bug!" == 0));
-                    } else {
-                        item->handler->handle_read(&key);
-                    }
-                }
-            }
-            if(FD_ISSET(i, &s->slave_w)) {
-                if(OP_WRITE & item->interest) {
-                    if(0 == item->handler->handle_write) {
-                        assert(("OP_WRITE arrived but no handler. bug!" == 0));
-                    } else {
-                        item->handler->handle_write(&key);
-                    }
-                }
-            }
+    if(readable && (OP_READ & item->interest)) {
+        if(0 == item->handler->handle_read) {
+            assert(("OP_READ arrived but no handler. bug!" == 0));
+        } else {
+            item->handler->handle_read(&key);
+        }
+    }
+    // el handle_read pudo haber desregistrado el fd
+    if(writable && ITEM_USED(item) && (OP_WRITE & item->interest)) {
+        if(0 == item->handler->handle_write) {
+            assert(("OP_WRITE arrived but no handler. bug!" == 0));
+        } else {
+            item->handler->handle_write(&key);
         }
     }
 }
 
+/**
+ * primer índice de la pasada round-robin sobre `n' listos. Rota en cada
+ * iteración, así ningún fd queda siempre al final de la tanda (el kernel
+ * tiende a reportarlos en el mismo orden).
+ */
+static inline size_t
+rr_start(fd_selector s, const size_t n) {
+    return n == 0 ? 0 : s->rr++ % n;
+}
+
+#ifdef SELECTOR_USE_EPOLL
+
+/** despacha un evento si su item sigue vivo y es de la pasada `priority' */
 static void
-handle_block_notifications(fd_selector s) {
-    struct selector_key key = {
-        .s = s,
-    };
-    pthread_mutex_lock(&s->resolution_mutex);
-    struct blocking_job* j = s->resolution_jobs;
-    while (j != NULL) {
+event_dispatch(fd_selector s, const struct epoll_event *ev, const bool priority) {
+    const int      fd  = (int)(uint32_t)ev->data.u64;
+    const uint32_t gen = (uint32_t)(ev->data.u64 >> 32);
 
-        struct item* item = s->fds + j->fd;
-        if (ITEM_USED(item)) {
-            key.fd = item->fd;
-            key.data = item->data;
-            item->handler->handle_block(&key);
+    struct item *item = s->fds + fd;
+    // un handler anterior de esta misma tanda pudo haberlo cerrado
+    if(!ITEM_USED(item) || item->gen != gen || item->priority != priority) {
+        return;
+    }
+    // igual que select(2): un error o hangup despiertan a lectores
+    // y escritores, que se enteran del problema al operar.
+    const uint32_t e = ev->events;
+    dispatch(s, item,
+             0 != (e & (EPOLLIN  | EPOLLRDHUP | EPOLLHUP | EPOLLERR)),
+             0 != (e & (EPOLLOUT | EPOLLHUP   | EPOLLERR)));
+}
+
+/**
+ * despacha los `n' eventos de `events': primero los de los fds prioritarios
+ * y después el resto en round-robin.
+ */
+static void
+events_dispatch(fd_selector s, const size_t n) {
+    for(size_t i = 0; i < n; i++) {
+        event_dispatch(s, s->events + i, true);
+    }
+    const size_t start = rr_start(s, n);
+    for(size_t i = 0; i < n; i++) {
+        event_dispatch(s, s->events + (start + i) % n, false);
+    }
+}
+
+/**
+ * se encarga de manejar los resultados del epoll_pwait.
+ * se encuentra separado para facilitar el testing
+ */
+static void
+epoll_handle_iteration(fd_selector s, const int n) {
+    events_dispatch(s, (size_t)n);
+}
+
+#ifdef SELECTOR_USE_URING
+
+/**
+ * se encarga de manejar las completions del ring.
+ *
+ * Las de los accept y los relays se atienden en el momento, en el orden en
+ * que llegan (el de los bytes de cada dirección). Las de los polls se
+ * cosechan como eventos de epoll en `events' (hasta llenarlo; las que
+ * sobran quedan para la próxima iteración) y se despachan en el mismo orden
+ * que epoll.
+ */
+static void
+uring_handle_iteration(fd_selector s) {
+    struct uring *r = &s->ring;
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    size_t n = 0;
+
+    for(unsigned seen = 0; head != tail && n < N(s->events) && seen < URING_CQ_BATCH; seen++) {
+        const struct io_uring_cqe *cqe = r->cqes + (head & *r->cq_mask);
+        const uint64_t ud    = cqe->user_data;
+        const int32_t  res   = cqe->res;
+        const uint32_t flags = cqe->flags;
+        head++;
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+        if(head == tail) {
+            tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        }
+        if(URING_UD_IGNORE == ud) {
+            continue;
+        }
+        if(ud & URING_UD_RELAY) {
+            uring_relay_complete(s, ud, res, flags);
+            continue;
+        }
+        if(ud & URING_UD_ACCEPT) {
+            uring_accept_complete(s, ud, res, flags);
+            continue;
         }
 
-        struct blocking_job* aux = j;
-        j = j->next;
-        free(aux);
+        const int      fd  = (int)(uint32_t)ud;
+        const uint32_t gen = (uint32_t)(ud >> 32);
+        if(fd < 0 || (size_t)fd >= s->fd_size) {
+            continue;
+        }
+        struct item *item = s->fds + fd;
+        // poll cancelado o de un registro anterior del mismo fd
+        if(!ITEM_USED(item) || item->kinterest == OP_NOOP
+           || (item->gen & URING_GEN_MASK) != gen) {
+            continue;
+        }
+        // one-shot: ya no está armado. Si sigue el interés se rearma al final.
+        item->kinterest = OP_NOOP;
+        if(SELECTOR_SUCCESS != uring_mark_dirty(s, item)) {
+            // sin memoria para agendarlo: lo rearmamos ya
+            uring_poll_add(s, item);
+        }
+        // un error (p.ej. -EBADF) se reporta como select(2): listo para
+        // leer y escribir, y el handler se entera al operar.
+        s->events[n].events   = res < 0 ? (EPOLLERR | EPOLLHUP) : (uint32_t)res;
+        s->events[n].data.u64 = ud;
+        n++;
     }
-    s->resolution_jobs = 0;
-    pthread_mutex_unlock(&s->resolution_mutex);
+    events_dispatch(s, n);
 }
 
+#endif
 
-selector_status
-selector_notify_block(fd_selector  s,
-                 const int    fd) {
-    selector_status ret = SELECTOR_SUCCESS;
+#else
 
-    // TODO(juan): usar un pool
-    struct blocking_job *job = malloc(sizeof(*job));
-    if(job == NULL) {
-        ret = SELECTOR_ENOMEM;
+/**
+ * se encarga de manejar los resultados del select.
+ * se encuentra separado para facilitar el testing
+ *
+ * Primero arma la lista de listos recorriendo solo los fds registrados
+ * (cortando apenas encontró los `n' que reportó select) y después despacha
+ * esa lista: los handlers pueden registrar y desregistrar fds, lo que
+ * reordena `active'.
+ */
+static void
+handle_iteration(fd_selector s, int n) {
+    size_t nready = 0;
+
+    for(size_t i = 0; i < s->active_len && n > 0; i++) {
+        const int fd = s->active[i];
+        const bool r = FD_ISSET(fd, &s->slave_r);
+        const bool w = FD_ISSET(fd, &s->slave_w);
+        if(r || w) {
+            s->ready[nready++] = fd;
+            n -= r + w;
+        }
+    }
+    // primero los prioritarios, después el resto en round-robin
+    const size_t start = rr_start(s, nready);
+    for(int pass = 1; pass >= 0; pass--) {
+        for(size_t i = 0; i < nready; i++) {
+            struct item *item = s->fds + s->ready[(start + i) % nready];
+            // un handler anterior de esta misma tanda pudo haberlo cerrado
+            if(ITEM_USED(item) && item->priority == (pass == 1)) {
+                dispatch(s, item, FD_ISSET(item->fd, &s->slave_r),
+                                  FD_ISSET(item->fd, &s->slave_w));
+            }
+        }
+    }
+}
+
+#endif
+
+#ifdef SELECTOR_USE_EPOLL
+
+static int
+timespec_to_ms(const struct timespec *t) {
+    const long long ms = (long long)t->tv_sec * 1000 + (t->tv_nsec + 999999) / 1000000;
+    return ms > INT_MAX ? INT_MAX : (int)ms;
+}
+
+#ifdef SELECTOR_USE_URING
+
+/**
+ * envía los polls pendientes y espera completions en una única llamada.
+ */
+static selector_status
+uring_select(fd_selector s) {
+    selector_status ret = uring_arm_dirty(s);
+    if(SELECTOR_SUCCESS != ret) {
         goto finally;
     }
-    job->s  = s;
-    job->fd = fd;
+    uring_arm_starved(s);
+
+    struct __kernel_timespec ts = {
+        .tv_sec  = s->slave_t.tv_sec,
+        .tv_nsec = s->slave_t.tv_nsec,
+    };
+    struct io_uring_getevents_arg arg = {
+        .sigmask    = (uint64_t)(uintptr_t)&emptyset,
+        .sigmask_sz = _NSIG / 8,
+        .ts         = (uint64_t)(uintptr_t)&ts,
+    };
+    const unsigned to_submit = uring_flush_sq(&s->ring);
+    if(-1 == uring_enter(&s->ring, to_submit, 1,
+                         IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                         &arg, sizeof(arg))) {
+        switch(errno) {
+            case EAGAIN:
+            case EINTR:
+            case ETIME:
+            case EBUSY:
+                // señal, timeout, o completions pendientes de cosechar
+                break;
+            default:
+                ret = SELECTOR_IO;
+                goto finally;
+        }
+    }
+    uring_handle_iteration(s);
+finally:
+    return ret;
+}
 
-    // encolamos en el selector los resultados
-    pthread_mutex_lock(&s->resolution_mutex);
-    job->next = s->resolution_jobs;
-    s->resolution_jobs = job;
-    pthread_mutex_unlock(&s->resolution_mutex);
+#endif
 
-    // notificamos al hilo principal
-    pthread_kill(s->selector_thread, conf.signal);
+static selector_status
+epoll_select(fd_selector s) {
+    selector_status ret = SELECTOR_SUCCESS;
 
+    int fds = epoll_pwait(s->epfd, s->events, N(s->events),
+                          timespec_to_ms(&s->slave_t), &emptyset);
+    if(-1 == fds) {
+        switch(errno) {
+            case EAGAIN:
+            case EINTR:
+                // si una señal nos interrumpio. ok!
+                break;
+            default:
+                ret = SELECTOR_IO;
+                goto finally;
+        }
+    } else {
+        epoll_handle_iteration(s, fds);
+    }
 finally:
     return ret;
 }
 
+selector_status
+selector_select(fd_selector s) {
+    selector_status ret;
+
+    s->selector_thread = pthread_self();
+    timers_wait(s, &s->slave_t);
+
+#ifdef SELECTOR_USE_URING
+    if(SELECTOR_ENGINE_URING == s->engine) {
+        ret = uring_select(s);
+    } else
+#endif
+    {
+        ret = epoll_select(s);
+    }
+    if(SELECTOR_SUCCESS == ret) {
+        timers_run(s);
+    }
+    return ret;
+}
+
+#else
+
 selector_status
 selector_select(fd_selector s) {
     selector_status ret = SELECTOR_SUCCESS;
 
     memcpy(&s->slave_r, &s->master_r, sizeof(s->slave_r));
     memcpy(&s->slave_w, &s->master_w, sizeof(s->slave_w));
-    memcpy(&s->slave_t, &s->master_t, sizeof(s->slave_t));
+    timers_wait(s, &s->slave_t);
 
     s->selector_thread = pthread_self();
 
@@ -569,15 +2421,17 @@ selector_select(fd_selector s) {
 
         }
     } else {
-        handle_iteration(s);
+        handle_iteration(s, fds);
     }
-    if(ret == SELECTOR_SUCCESS) {
-        handle_block_notifications(s);
+    if(SELECTOR_SUCCESS == ret) {
+        timers_run(s);
     }
 finally:
     return ret;
 }
 
+#endif
+
 int
 selector_fd_set_nio(const int fd) {
     int ret = 0;
@@ -592,3 +2446,168 @@ selector_fd_set_nio(const int fd) {
     return ret;
 }
 
+
+// ============================================================================
+// Pool de trabajos bloqueantes
+// ============================================================================
+
+struct blocking_job {
+    fd_selector  s;
+    int          fd;
+    blocking_fn  fn;
+    void        *arg;
+};
+
+/**
+ * Pool fijo de threads compartido por todos los selectores. La cola es un
+ * ring acotado protegido por un mutex: los workers igual se bloquean
+ * esperando trabajo, y el selector solo toma el lock para encolar.
+ */
+static struct {
+    pthread_mutex_t       mutex;
+    pthread_cond_t        cond;
+    bool                  stop;
+
+    pthread_t            *threads;
+    unsigned              nthreads;
+    unsigned              busy;
+
+    struct blocking_job  *jobs;
+    unsigned              capacity;
+    unsigned              head, len;
+    unsigned              high_water;
+
+    unsigned long long    submitted, rejected, completed;
+} pool = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond  = PTHREAD_COND_INITIALIZER,
+};
+
+static void *
+blocking_worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&pool.mutex);
+    for(;;) {
+        while(!pool.stop && 0 == pool.len) {
+            pthread_cond_wait(&pool.cond, &pool.mutex);
+        }
+        if(pool.stop) {
+            break;
+        }
+        const struct blocking_job job = pool.jobs[pool.head];
+        pool.head = (pool.head + 1) % pool.capacity;
+        pool.len--;
+        pool.busy++;
+        pthread_mutex_unlock(&pool.mutex);
+
+        job.fn(job.arg);
+        selector_notify_block(job.s, job.fd);
+
+        pthread_mutex_lock(&pool.mutex);
+        pool.busy--;
+        pool.completed++;
+    }
+    pthread_mutex_unlock(&pool.mutex);
+    return NULL;
+}
+
+static selector_status
+blocking_pool_start(void) {
+    selector_status ret = SELECTOR_SUCCESS;
+    const unsigned nthreads = conf.blocking_workers ? conf.blocking_workers
+                                                    : BLOCKING_DEFAULT_WORKERS;
+    pool.capacity = conf.blocking_queue ? conf.blocking_queue
+                                        : BLOCKING_DEFAULT_QUEUE;
+    pool.jobs     = calloc(pool.capacity, sizeof(*pool.jobs));
+    pool.threads  = calloc(nthreads, sizeof(*pool.threads));
+    if(NULL == pool.jobs || NULL == pool.threads) {
+        ret = SELECTOR_ENOMEM;
+        goto finally;
+    }
+    pool.stop = false;
+    pool.head = pool.len = pool.busy = pool.high_water = 0;
+
+    // los workers no atienden señales: heredan la máscara al crearse
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for(unsigned i = 0; i < nthreads; i++) {
+        if(0 != pthread_create(pool.threads + i, NULL, blocking_worker, NULL)) {
+            ret = SELECTOR_ENOMEM;
+            break;
+        }
+        pool.nthreads++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+finally:
+    if(SELECTOR_SUCCESS != ret) {
+        blocking_pool_stop();
+    }
+    return ret;
+}
+
+static void
+blocking_pool_stop(void) {
+    pthread_mutex_lock(&pool.mutex);
+    pool.stop = true;
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.mutex);
+
+    for(unsigned i = 0; i < pool.nthreads; i++) {
+        pthread_join(pool.threads[i], NULL);
+    }
+    // los trabajos que quedaron en la cola no se corren
+    free(pool.threads);
+    free(pool.jobs);
+    pool.threads  = NULL;
+    pool.jobs     = NULL;
+    pool.nthreads = 0;
+    pool.capacity = 0;
+    pool.len      = 0;
+}
+
+selector_status
+selector_submit_blocking(fd_selector s, const int fd, blocking_fn fn, void *arg) {
+    selector_status ret = SELECTOR_SUCCESS;
+
+    if(NULL == s || INVALID_FD(fd) || NULL == fn) {
+        return SELECTOR_IARGS;
+    }
+
+    pthread_mutex_lock(&pool.mutex);
+    if(pool.stop || 0 == pool.nthreads || pool.len == pool.capacity) {
+        pool.rejected++;
+        ret = SELECTOR_BUSY;
+    } else {
+        pool.jobs[(pool.head + pool.len) % pool.capacity] = (struct blocking_job) {
+            .s   = s,
+            .fd  = fd,
+            .fn  = fn,
+            .arg = arg,
+        };
+        pool.len++;
+        if(pool.len > pool.high_water) {
+            pool.high_water = pool.len;
+        }
+        pool.submitted++;
+        pthread_cond_signal(&pool.cond);
+    }
+    pthread_mutex_unlock(&pool.mutex);
+
+    return ret;
+}
+
+void
+selector_blocking_stats(struct selector_blocking_stats *stats) {
+    pthread_mutex_lock(&pool.mutex);
+    stats->workers          = pool.nthreads;
+    stats->busy             = pool.busy;
+    stats->queue_capacity   = pool.capacity;
+    stats->queue_depth      = pool.len;
+    stats->queue_high_water = pool.high_water;
+    stats->submitted        = pool.submitted;
+    stats->rejected         = pool.rejected;
+    stats->completed        = pool.completed;
+    pthread_mutex_unlock(&pool.mutex);
+}
@@ -27,6 +27,77 @@ port(const char *s) {
     return (unsigned short)sl;
 }
 
+static unsigned
+threads(const char *s) {
+    char *end = 0;
+    errno = 0;
+    const long sl = strtol(s, &end, 10);
+
+    if (end == s || '\0' != *end || ERANGE == errno
+        || sl < 1 || sl > MAX_THREADS) {
+        fprintf(stderr, "threads should be in the range of 1-%d: %s\n", MAX_THREADS, s);
+        exit(1);
+    }
+    return (unsigned)sl;
+}
+
+static unsigned
+accept_batch(const char *s) {
+    char *end = 0;
+    errno = 0;
+    const long sl = strtol(s, &end, 10);
+
+    if (end == s || '\0' != *end || ERANGE == errno
+        || sl < 1 || sl > MAX_ACCEPT_BATCH) {
+        fprintf(stderr, "accept batch should be in the range of 1-%d: %s\n", MAX_ACCEPT_BATCH, s);
+        exit(1);
+    }
+    return (unsigned)sl;
+}
+
+static unsigned
+relay_memory(const char *s) {
+    char *end = 0;
+    errno = 0;
+    const long sl = strtol(s, &end, 10);
+
+    if (end == s || '\0' != *end || ERANGE == errno
+        || sl < 0 || sl > MAX_RELAY_MEMORY) {
+        fprintf(stderr, "relay buffer memory should be in the range of 0-%d MiB: %s\n", MAX_RELAY_MEMORY, s);
+        exit(1);
+    }
+    return (unsigned)sl;
+}
+
+static unsigned
+conn_slab(const char *s) {
+    char *end = 0;
+    errno = 0;
+    const long sl = strtol(s, &end, 10);
+
+    if (end == s || '\0' != *end || ERANGE == errno
+        || sl < 0 || sl > MAX_CONN_SLAB) {
+        fprintf(stderr, "connection slab should be in the range of 0-%d: %s\n", MAX_CONN_SLAB, s);
+        exit(1);
+    }
+    return (unsigned)sl;
+}
+
+static unsigned
+connect_delay(const char *s) {
+    char *end = 0;
+    errno = 0;
+    const long sl = strtol(s, &end, 10);
+
+    if (end == s || '\0' != *end || ERANGE == errno
+        || sl < MIN_CONNECT_DELAY || sl > MAX_CONNECT_DELAY) {
+        fprintf(stderr, "connection attempt delay should be in the range of %d-%d ms: %s\n",
+                MIN_CONNECT_DELAY, MAX_CONNECT_DELAY, s);
+        exit(1);
+    }
+    return (unsigned)sl;
+}
+
 static void
 user(char *s, struct users *user) {
     char *p = strchr(s, ':');
@@ -53,16 +124,31 @@ usage(const char *progname) {
     fprintf(stderr,
             "Usage: %s [OPTION]...\n"
             "\n"
+            "   -a               Fija cada reactor a un CPU (requiere -t).\n"
+            "   -b <n>           Conexiones aceptadas como máximo por cada aviso del selector (default: 64).\n"
+            "   -c <ms>          Demora entre intentos de conexión en paralelo al origen (default: 250).\n"
+            "   -C <n>           Conexiones preasignadas por reactor; 0 las pide a malloc (default: 1024).\n"
+            "   -D               Acepta conexiones SOCKS recién cuando el cliente mandó datos (TCP_DEFER_ACCEPT).\n"
+            "   -F               TCP Fast Open: datos en el SYN con los clientes y con los orígenes (Linux).\n"
             "   -h               Imprime la ayuda y termina.\n"
+            "   -H               Usa páginas grandes para las conexiones preasignadas.\n"
+            "   -k               Entrega los túneles establecidos al kernel (BPF sockmap, Linux).\n"
             "   -l <SOCKS addr>  Dirección donde servirá el proxy SOCKS (default: 0.0.0.0).\n"
             "   -L <conf  addr>  Dirección donde servirá el servicio de management (default: 127.0.0.1).\n"
+            "   -m <MiB>         Memoria para agrandar los buffers de copia, entre todas las conexiones (default: 256).\n"
             "   -p <SOCKS port>  Puerto entrante conexiones SOCKS (default: 1080).\n"
             "   -P <conf port>   Puerto entrante conexiones configuracion (default: 8080).\n"
             "   -u <name>:<pass> Usuario y contraseña de usuario que puede usar el proxy. Hasta %d.\n"
             "   -N               Desactiva los disectores de credenciales.\n"
+            "   -t <threads>     Cantidad de reactores (event loops) en paralelo (default: 1).\n"
+            "   -T <regla>       Perfil de socket: listener=<perfil>, user:<nombre>=<perfil> o port:<puerto>=<perfil>.\n"
+            "                    Perfiles: default, interactive, bulk. Hasta %d.\n"
+            "   -U               Usa io_uring como motor de I/O, con accept y copia por\n"
+            "                    completitud (si el kernel lo soporta).\n"
             "   -v               Imprime información sobre la versión y termina.\n"
+            "   -z               Copia los datos con splice(2), sin pasar por userspace (Linux).\n"
             "\n",
-            progname, MAX_USERS);
+            progname, MAX_USERS, MAX_TUNING_ARGS);
     exit(1);
 }
 
@@ -79,7 +165,20 @@ parse_args(const int argc, char **argv, struct socks5args *args) {
     args->mng_port = 8080;
 
     args->disectors_enabled = true;
+    args->io_uring = false;
+    args->threads = 1;
+    args->affinity = false;
+    args->connect_delay = 250;
+    args->accept_batch = 64;
+    args->defer_accept = false;
+    args->fast_open = false;
+    args->zero_copy = false;
+    args->kernel_relay = false;
+    args->relay_memory = 256;
+    args->conn_slab = 1024;
+    args->huge_pages = false;
     args->nusers = 0;
+    args->ntuning_rules = 0;
 
     int c;
 
@@ -91,20 +190,47 @@ parse_args(const int argc, char **argv, struct socks5args *args) {
             { 0,         0,                 0,  0  }
         };
 
-        c = getopt_long(argc, argv, "hl:L:Np:P:u:v", long_options, &option_index);
+        c = getopt_long(argc, argv, "ab:c:C:DFhHkl:L:m:Np:P:t:T:u:Uvz", long_options, &option_index);
         if (c == -1)
             break;
 
         switch (c) {
+        case 'a':
+            args->affinity = true;
+            break;
+        case 'b':
+            args->accept_batch = accept_batch(optarg);
+            break;
+        case 'c':
+            args->connect_delay = connect_delay(optarg);
+            break;
+        case 'C':
+            args->conn_slab = conn_slab(optarg);
+            break;
+        case 'D':
+            args->defer_accept = true;
+            break;
+        case 'F':
+            args->fast_open = true;
+            break;
         case 'h':
             usage(argv[0]);
             break;
+        case 'H':
+            args->huge_pages = true;
+            break;
+        case 'k':
+            args->kernel_relay = true;
+            break;
         case 'l':
             args->socks_addr = optarg;
             break;
         case 'L':
             args->mng_addr = optarg;
             break;
+        case 'm':
+            args->relay_memory = relay_memory(optarg);
+            break;
         case 'N':
             args->disectors_enabled = false;
             break;
@@ -114,6 +240,16 @@ parse_args(const int argc, char **argv, struct socks5args *args) {
         case 'P':
             args->mng_port = port(optarg);
             break;
+        case 't':
+            args->threads = threads(optarg);
+            break;
+        case 'T':
+            if (args->ntuning_rules >= MAX_TUNING_ARGS) {
+                fprintf(stderr, "Maximum number of command line tuning rules reached: %d.\n", MAX_TUNING_ARGS);
+                exit(1);
+            }
+            args->tuning_rules[args->ntuning_rules++] = optarg;
+            break;
         case 'u':
             if (args->nusers >= MAX_USERS) {
                 fprintf(stderr, "Maximum number of command line users reached: %d.\n", MAX_USERS);
@@ -123,9 +259,15 @@ parse_args(const int argc, char **argv, struct socks5args *args) {
                 args->nusers++;
             }
             break;
+        case 'U':
+            args->io_uring = true;
+            break;
         case 'v':
             version();
             exit(0);
+        case 'z':
+            args->zero_copy = true;
+            break;
         default:
             fprintf(stderr, "Unknown argument %d.\n", c);
             exit(1);
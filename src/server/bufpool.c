@@ -0,0 +1,129 @@
+/**
+ * bufpool.c - Pool de buffers por clases de tamaño
+ *
+ * Un bloque libre guarda en sus primeros bytes el puntero al siguiente de
+ * su lista, así que las listas no ocupan memoria aparte.
+ */
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include "bufpool.h"
+
+/** log2 de BUFPOOL_MIN_SIZE y de BUFPOOL_MAX_SIZE */
+#define BUFPOOL_MIN_SHIFT 6
+#define BUFPOOL_MAX_SHIFT 18
+#define BUFPOOL_CLASSES   (BUFPOOL_MAX_SHIFT - BUFPOOL_MIN_SHIFT + 1)
+
+_Static_assert(BUFPOOL_MIN_SIZE == 1 << BUFPOOL_MIN_SHIFT, "BUFPOOL_MIN_SHIFT");
+_Static_assert(BUFPOOL_MAX_SIZE == 1 << BUFPOOL_MAX_SHIFT, "BUFPOOL_MAX_SHIFT");
+
+struct free_block {
+    struct free_block *next;
+};
+
+struct free_list {
+    struct free_block *head;
+    unsigned           n;
+};
+
+static _Thread_local struct free_list free_lists[BUFPOOL_CLASSES];
+
+static atomic_size_t in_use = 0;
+static atomic_size_t cached = 0;
+
+/**
+ * Clase de un pedido de `size' bytes, o -1 si no entra en ninguna.
+ */
+static int
+size_class(size_t size) {
+    int c = 0;
+    size_t class_size = BUFPOOL_MIN_SIZE;
+
+    while (class_size < size) {
+        if (++c == BUFPOOL_CLASSES) {
+            return -1;
+        }
+        class_size <<= 1;
+    }
+    return c;
+}
+
+static size_t
+class_size(int c) {
+    return (size_t)BUFPOOL_MIN_SIZE << c;
+}
+
+uint8_t *
+bufpool_get(size_t size) {
+    const int c = size_class(size);
+    uint8_t *data;
+
+    if (c < 0) {
+        data = malloc(size);
+        if (data != NULL) {
+            atomic_fetch_add(&in_use, size);
+        }
+        return data;
+    }
+
+    struct free_list *list = free_lists + c;
+    if (list->head != NULL) {
+        data = (uint8_t *)list->head;
+        list->head = list->head->next;
+        list->n--;
+        atomic_fetch_sub(&cached, class_size(c));
+    } else {
+        data = malloc(class_size(c));
+        if (data == NULL) {
+            return NULL;
+        }
+    }
+    atomic_fetch_add(&in_use, class_size(c));
+    return data;
+}
+
+void
+bufpool_put(uint8_t *data, size_t size) {
+    const int c = size_class(size);
+
+    if (data == NULL) {
+        return;
+    }
+    if (c < 0) {
+        atomic_fetch_sub(&in_use, size);
+        free(data);
+        return;
+    }
+
+    struct free_list *list = free_lists + c;
+    atomic_fetch_sub(&in_use, class_size(c));
+    if ((list->n + 1) * class_size(c) > BUFPOOL_CACHE_BYTES) {
+        free(data);
+        return;
+    }
+    struct free_block *block = (struct free_block *)data;
+    block->next = list->head;
+    list->head = block;
+    list->n++;
+    atomic_fetch_add(&cached, class_size(c));
+}
+
+void
+bufpool_thread_destroy(void) {
+    for (int c = 0; c < BUFPOOL_CLASSES; c++) {
+        struct free_block *next;
+        for (struct free_block *b = free_lists[c].head; b != NULL; b = next) {
+            next = b->next;
+            free(b);
+        }
+        atomic_fetch_sub(&cached, free_lists[c].n * class_size(c));
+        free_lists[c].head = NULL;
+        free_lists[c].n = 0;
+    }
+}
+
+void
+bufpool_get_stats(struct bufpool_stats *stats) {
+    stats->in_use = atomic_load(&in_use);
+    stats->cached = atomic_load(&cached);
+}
@@ -0,0 +1,421 @@
+/**
+ * dnscache.c - Cache de resoluciones DNS compartido por todos los reactores
+ *
+ * Cada shard es una tabla de hash con encadenamiento más una lista
+ * doblemente enlazada en orden de uso (LRU), protegidas por un mutex propio.
+ * El shard se elige con el hash del nombre, así que dos reactores solo
+ * compiten cuando buscan nombres del mismo shard.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "dnscache.h"
+
+/** cantidad de shards (potencia de 2) */
+#define DNSCACHE_SHARDS        16
+/** buckets de la tabla de hash de cada shard (potencia de 2) */
+#define DNSCACHE_BUCKETS       256
+/** entradas máximas por shard */
+#define DNSCACHE_SHARD_ENTRIES 512
+/** cada cuánto se vuelve a pedir el refresco de una entrada vencida (ms) */
+#define DNSCACHE_REFRESH_RETRY 5000
+
+union dns_sockaddr {
+    struct sockaddr     sa;
+    struct sockaddr_in  in;
+    struct sockaddr_in6 in6;
+};
+
+struct dns_entry {
+    /** siguiente en el bucket */
+    struct dns_entry   *hnext;
+    /** vecinos en la lista LRU (más reciente al frente) */
+    struct dns_entry   *lprev, *lnext;
+    uint32_t            hash;
+
+    /** vigencia, fin de la ventana stale, y próximo pedido de refresco (ms) */
+    uint64_t            expires, stale_until, refresh_at;
+    bool                negative;
+
+    unsigned            naddrs;
+    union dns_sockaddr  addrs[DNSCACHE_MAX_ADDRS];
+
+    char                host[];
+};
+
+struct dns_shard {
+    pthread_mutex_t     mutex;
+    struct dns_entry   *buckets[DNSCACHE_BUCKETS];
+    struct dns_entry   *lru_head, *lru_tail;
+    unsigned            count;
+};
+
+/** nodo de las listas addrinfo propias: todos en un único bloque */
+struct dns_ai {
+    struct addrinfo     ai;
+    union dns_sockaddr  addr;
+};
+
+static struct dns_shard shards[DNSCACHE_SHARDS];
+
+static struct {
+    _Atomic uint64_t hits;
+    _Atomic uint64_t stale_hits;
+    _Atomic uint64_t negative_hits;
+    _Atomic uint64_t misses;
+    _Atomic uint64_t evictions;
+    _Atomic uint64_t entries;
+} stats;
+
+static uint64_t
+now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/**
+ * Normaliza el nombre a minúsculas en `out' y calcula su hash (FNV-1a).
+ * Retorna false si el nombre es demasiado largo.
+ */
+static bool
+normalize(const char *host, char out[256], uint32_t *hash) {
+    size_t len;
+    for (len = 0; host[len] != '\0'; len++) {
+        if (len == 255) {
+            return false;
+        }
+        out[len] = (char)tolower((unsigned char)host[len]);
+    }
+    // "example.com." y "example.com" son el mismo nombre
+    if (len > 0 && out[len - 1] == '.') {
+        len--;
+    }
+    out[len] = '\0';
+
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)out[i]) * 16777619u;
+    }
+    *hash = h;
+    return true;
+}
+
+static inline struct dns_shard *
+shard_for(uint32_t hash) {
+    return shards + (hash & (DNSCACHE_SHARDS - 1));
+}
+
+static inline struct dns_entry **
+bucket_for(struct dns_shard *sh, uint32_t hash) {
+    return sh->buckets + ((hash >> 4) & (DNSCACHE_BUCKETS - 1));
+}
+
+static struct dns_entry *
+shard_find(struct dns_shard *sh, const char *host, uint32_t hash) {
+    for (struct dns_entry *e = *bucket_for(sh, hash); e != NULL; e = e->hnext) {
+        if (e->hash == hash && strcmp(e->host, host) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void
+lru_unlink(struct dns_shard *sh, struct dns_entry *e) {
+    if (e->lprev != NULL) {
+        e->lprev->lnext = e->lnext;
+    } else {
+        sh->lru_head = e->lnext;
+    }
+    if (e->lnext != NULL) {
+        e->lnext->lprev = e->lprev;
+    } else {
+        sh->lru_tail = e->lprev;
+    }
+    e->lprev = e->lnext = NULL;
+}
+
+static void
+lru_push_front(struct dns_shard *sh, struct dns_entry *e) {
+    e->lprev = NULL;
+    e->lnext = sh->lru_head;
+    if (sh->lru_head != NULL) {
+        sh->lru_head->lprev = e;
+    }
+    sh->lru_head = e;
+    if (sh->lru_tail == NULL) {
+        sh->lru_tail = e;
+    }
+}
+
+static void
+shard_remove(struct dns_shard *sh, struct dns_entry *e) {
+    struct dns_entry **p = bucket_for(sh, e->hash);
+    while (*p != e) {
+        p = &(*p)->hnext;
+    }
+    *p = e->hnext;
+    lru_unlink(sh, e);
+    sh->count--;
+    atomic_fetch_sub(&stats.entries, 1);
+    free(e);
+}
+
+/**
+ * Obtiene la entrada de `host' para escribirla, creándola (y desalojando la
+ * menos usada si el shard está lleno) si no existe. Con el lock tomado.
+ */
+static struct dns_entry *
+shard_upsert(struct dns_shard *sh, const char *host, uint32_t hash) {
+    struct dns_entry *e = shard_find(sh, host, hash);
+    if (e != NULL) {
+        lru_unlink(sh, e);
+        lru_push_front(sh, e);
+        return e;
+    }
+
+    if (sh->count >= DNSCACHE_SHARD_ENTRIES && sh->lru_tail != NULL) {
+        shard_remove(sh, sh->lru_tail);
+        atomic_fetch_add(&stats.evictions, 1);
+    }
+
+    const size_t len = strlen(host);
+    e = calloc(1, sizeof(*e) + len + 1);
+    if (e == NULL) {
+        return NULL;
+    }
+    memcpy(e->host, host, len + 1);
+    e->hash = hash;
+
+    struct dns_entry **b = bucket_for(sh, hash);
+    e->hnext = *b;
+    *b = e;
+    lru_push_front(sh, e);
+    sh->count++;
+    atomic_fetch_add(&stats.entries, 1);
+    return e;
+}
+
+/**
+ * Arma una lista addrinfo de `n' direcciones en un único bloque.
+ */
+static struct addrinfo *
+build_addrinfo(const union dns_sockaddr *addrs, unsigned n, uint16_t port,
+               bool keep_port) {
+    if (n == 0) {
+        return NULL;
+    }
+    struct dns_ai *nodes = calloc(n, sizeof(*nodes));
+    if (nodes == NULL) {
+        return NULL;
+    }
+    for (unsigned i = 0; i < n; i++) {
+        struct addrinfo *ai = &nodes[i].ai;
+        nodes[i].addr = addrs[i];
+        ai->ai_family   = addrs[i].sa.sa_family;
+        ai->ai_socktype = SOCK_STREAM;
+        ai->ai_protocol = IPPROTO_TCP;
+        ai->ai_addr     = &nodes[i].addr.sa;
+        if (ai->ai_family == AF_INET6) {
+            ai->ai_addrlen = sizeof(struct sockaddr_in6);
+            if (!keep_port) {
+                nodes[i].addr.in6.sin6_port = htons(port);
+            }
+        } else {
+            ai->ai_addrlen = sizeof(struct sockaddr_in);
+            if (!keep_port) {
+                nodes[i].addr.in.sin_port = htons(port);
+            }
+        }
+        ai->ai_next = i + 1 < n ? &nodes[i + 1].ai : NULL;
+    }
+    return &nodes[0].ai;
+}
+
+/**
+ * Copia hasta DNSCACHE_MAX_ADDRS direcciones IPv4/IPv6 de `ai' en `addrs'.
+ */
+static unsigned
+collect_addrs(const struct addrinfo *ai, union dns_sockaddr *addrs) {
+    unsigned n = 0;
+    for (; ai != NULL && n < DNSCACHE_MAX_ADDRS; ai = ai->ai_next) {
+        if (ai->ai_family == AF_INET && ai->ai_addrlen >= sizeof(struct sockaddr_in)) {
+            memset(addrs + n, 0, sizeof(addrs[n]));
+            memcpy(&addrs[n].in, ai->ai_addr, sizeof(struct sockaddr_in));
+            n++;
+        } else if (ai->ai_family == AF_INET6 && ai->ai_addrlen >= sizeof(struct sockaddr_in6)) {
+            memset(addrs + n, 0, sizeof(addrs[n]));
+            memcpy(&addrs[n].in6, ai->ai_addr, sizeof(struct sockaddr_in6));
+            n++;
+        }
+    }
+    return n;
+}
+
+void
+dnscache_init(void) {
+    for (unsigned i = 0; i < DNSCACHE_SHARDS; i++) {
+        memset(&shards[i], 0, sizeof(shards[i]));
+        pthread_mutex_init(&shards[i].mutex, NULL);
+    }
+    atomic_init(&stats.hits, 0);
+    atomic_init(&stats.stale_hits, 0);
+    atomic_init(&stats.negative_hits, 0);
+    atomic_init(&stats.misses, 0);
+    atomic_init(&stats.evictions, 0);
+    atomic_init(&stats.entries, 0);
+}
+
+void
+dnscache_destroy(void) {
+    for (unsigned i = 0; i < DNSCACHE_SHARDS; i++) {
+        struct dns_shard *sh = &shards[i];
+        pthread_mutex_lock(&sh->mutex);
+        while (sh->lru_head != NULL) {
+            shard_remove(sh, sh->lru_head);
+        }
+        pthread_mutex_unlock(&sh->mutex);
+        pthread_mutex_destroy(&sh->mutex);
+    }
+}
+
+dnscache_result
+dnscache_lookup(const char *host, uint16_t port, struct addrinfo **res,
+                bool *refresh) {
+    char name[256];
+    uint32_t hash;
+    dnscache_result ret = DNSCACHE_MISS;
+
+    *res = NULL;
+    *refresh = false;
+    if (!normalize(host, name, &hash)) {
+        atomic_fetch_add(&stats.misses, 1);
+        return DNSCACHE_MISS;
+    }
+
+    struct dns_shard *sh = shard_for(hash);
+    const uint64_t now = now_ms();
+
+    pthread_mutex_lock(&sh->mutex);
+    struct dns_entry *e = shard_find(sh, name, hash);
+    if (e != NULL && now >= e->stale_until) {
+        // vencida y fuera de la ventana stale
+        shard_remove(sh, e);
+        e = NULL;
+    }
+    if (e != NULL) {
+        lru_unlink(sh, e);
+        lru_push_front(sh, e);
+        if (e->negative) {
+            ret = DNSCACHE_NEGATIVE;
+        } else {
+            *res = build_addrinfo(e->addrs, e->naddrs, port, false);
+            ret = *res != NULL ? DNSCACHE_HIT : DNSCACHE_MISS;
+            if (ret == DNSCACHE_HIT && now >= e->expires) {
+                atomic_fetch_add(&stats.stale_hits, 1);
+                if (now >= e->refresh_at) {
+                    e->refresh_at = now + DNSCACHE_REFRESH_RETRY;
+                    *refresh = true;
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&sh->mutex);
+
+    switch (ret) {
+        case DNSCACHE_HIT:
+            atomic_fetch_add(&stats.hits, 1);
+            break;
+        case DNSCACHE_NEGATIVE:
+            atomic_fetch_add(&stats.negative_hits, 1);
+            break;
+        default:
+            atomic_fetch_add(&stats.misses, 1);
+            break;
+    }
+    return ret;
+}
+
+void
+dnscache_store(const char *host, const struct addrinfo *ai, unsigned ttl) {
+    char name[256];
+    uint32_t hash;
+    union dns_sockaddr addrs[DNSCACHE_MAX_ADDRS];
+
+    // TTL 0: la respuesta vale solo para esta consulta (RFC 1035 §3.2.1) y
+    // tampoco se sirve vencida
+    const unsigned n = collect_addrs(ai, addrs);
+    if (ttl == 0 || n == 0 || !normalize(host, name, &hash)) {
+        return;
+    }
+
+    struct dns_shard *sh = shard_for(hash);
+    const uint64_t now = now_ms();
+
+    pthread_mutex_lock(&sh->mutex);
+    struct dns_entry *e = shard_upsert(sh, name, hash);
+    if (e != NULL) {
+        e->negative    = false;
+        e->naddrs      = n;
+        memcpy(e->addrs, addrs, n * sizeof(addrs[0]));
+        e->expires     = now + (uint64_t)ttl * 1000;
+        e->stale_until = e->expires + (uint64_t)DNSCACHE_STALE_TTL * 1000;
+        e->refresh_at  = e->expires;
+    }
+    pthread_mutex_unlock(&sh->mutex);
+}
+
+void
+dnscache_store_negative(const char *host, unsigned ttl) {
+    char name[256];
+    uint32_t hash;
+
+    if (ttl == 0 || !normalize(host, name, &hash)) {
+        return;
+    }
+
+    struct dns_shard *sh = shard_for(hash);
+    const uint64_t now = now_ms();
+
+    pthread_mutex_lock(&sh->mutex);
+    struct dns_entry *e = shard_upsert(sh, name, hash);
+    if (e != NULL) {
+        e->negative    = true;
+        e->naddrs      = 0;
+        e->expires     = now + (uint64_t)ttl * 1000;
+        e->stale_until = e->expires;  // un NXDOMAIN vencido no se sirve
+        e->refresh_at  = e->expires;
+    }
+    pthread_mutex_unlock(&sh->mutex);
+}
+
+struct addrinfo *
+dnscache_addrinfo_dup(const struct addrinfo *ai) {
+    union dns_sockaddr addrs[DNSCACHE_MAX_ADDRS];
+    const unsigned n = collect_addrs(ai, addrs);
+    return build_addrinfo(addrs, n, 0, true);
+}
+
+void
+dnscache_freeaddrinfo(struct addrinfo *ai) {
+    // el primer nodo es el comienzo del bloque
+    free(ai);
+}
+
+void
+dnscache_get_stats(struct dnscache_stats *out) {
+    out->hits          = atomic_load(&stats.hits);
+    out->stale_hits    = atomic_load(&stats.stale_hits);
+    out->negative_hits = atomic_load(&stats.negative_hits);
+    out->misses        = atomic_load(&stats.misses);
+    out->evictions     = atomic_load(&stats.evictions);
+    out->entries       = atomic_load(&stats.entries);
+}
@@ -0,0 +1,145 @@
+/**
+ * intern.c - Strings compartidos entre conexiones
+ *
+ * Cada shard es una tabla de hash con encadenamiento protegida por un mutex.
+ * El string vive al final de su entrada, así que `intern_put' recupera la
+ * entrada a partir del puntero que entregó `intern_get'.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "intern.h"
+
+/** cantidad de shards (potencia de 2) */
+#define INTERN_SHARDS  16
+/** buckets de la tabla de hash de cada shard (potencia de 2) */
+#define INTERN_BUCKETS 256
+
+struct intern_entry {
+    struct intern_entry *next;
+    uint32_t             hash;
+    unsigned             refs;
+    size_t               len;
+    char                 str[];
+};
+
+struct intern_shard {
+    pthread_mutex_t      mutex;
+    struct intern_entry *buckets[INTERN_BUCKETS];
+};
+
+static struct intern_shard shards[INTERN_SHARDS];
+
+static atomic_size_t entries = 0;
+
+/** FNV-1a */
+static uint32_t
+intern_hash(const char *s, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static struct intern_shard *
+shard_of(uint32_t hash) {
+    return shards + (hash & (INTERN_SHARDS - 1));
+}
+
+static struct intern_entry **
+bucket_of(struct intern_shard *shard, uint32_t hash) {
+    return shard->buckets + ((hash >> 4) & (INTERN_BUCKETS - 1));
+}
+
+void
+intern_init(void) {
+    for (unsigned i = 0; i < INTERN_SHARDS; i++) {
+        memset(&shards[i], 0, sizeof(shards[i]));
+        pthread_mutex_init(&shards[i].mutex, NULL);
+    }
+    atomic_init(&entries, 0);
+}
+
+void
+intern_destroy(void) {
+    for (unsigned i = 0; i < INTERN_SHARDS; i++) {
+        struct intern_shard *sh = &shards[i];
+        pthread_mutex_lock(&sh->mutex);
+        for (unsigned b = 0; b < INTERN_BUCKETS; b++) {
+            struct intern_entry *next;
+            for (struct intern_entry *e = sh->buckets[b]; e != NULL; e = next) {
+                next = e->next;
+                free(e);
+            }
+            sh->buckets[b] = NULL;
+        }
+        pthread_mutex_unlock(&sh->mutex);
+        pthread_mutex_destroy(&sh->mutex);
+    }
+}
+
+const char *
+intern_get_n(const char *s, size_t len) {
+    const uint32_t hash = intern_hash(s, len);
+    struct intern_shard *shard = shard_of(hash);
+    struct intern_entry **bucket = bucket_of(shard, hash);
+    struct intern_entry *e;
+
+    pthread_mutex_lock(&shard->mutex);
+    for (e = *bucket; e != NULL; e = e->next) {
+        if (e->hash == hash && e->len == len && memcmp(e->str, s, len) == 0) {
+            e->refs++;
+            goto finally;
+        }
+    }
+    e = malloc(sizeof(*e) + len + 1);
+    if (e != NULL) {
+        e->hash = hash;
+        e->refs = 1;
+        e->len  = len;
+        memcpy(e->str, s, len);
+        e->str[len] = '\0';
+        e->next = *bucket;
+        *bucket = e;
+        atomic_fetch_add(&entries, 1);
+    }
+finally:
+    pthread_mutex_unlock(&shard->mutex);
+    return e == NULL ? NULL : e->str;
+}
+
+const char *
+intern_get(const char *s) {
+    return intern_get_n(s, strlen(s));
+}
+
+void
+intern_put(const char *s) {
+    if (s == NULL) {
+        return;
+    }
+    struct intern_entry *e = (struct intern_entry *)(s - offsetof(struct intern_entry, str));
+    struct intern_shard *shard = shard_of(e->hash);
+
+    pthread_mutex_lock(&shard->mutex);
+    if (--e->refs == 0) {
+        struct intern_entry **p = bucket_of(shard, e->hash);
+        while (*p != e) {
+            p = &(*p)->next;
+        }
+        *p = e->next;
+        free(e);
+        atomic_fetch_sub(&entries, 1);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+size_t
+intern_entries(void) {
+    return atomic_load(&entries);
+}
@@ -8,9 +8,12 @@
  *   - RFC 1929: Username/Password Authentication for SOCKS V5
  *
  * Arquitectura:
- *   - Single-threaded event loop usando selector.c
+ *   - Uno o más reactores (event loops usando selector.c), cada uno en su
+ *     propio thread con su propio socket pasivo SOCKS (SO_REUSEPORT)
  *   - I/O totalmente no bloqueante
- *   - Resolución DNS en thread worker separado
+ *   - Resolución DNS con un resolvedor stub no bloqueante en cada reactor
+ *     (getaddrinfo en el pool de trabajos bloqueantes del selector si
+ *     resolv.conf no tiene servidores)
  *
  * Este archivo:
  *   1. Parsea argumentos de línea de comandos
@@ -18,15 +21,22 @@
  *   3. Crea sockets pasivos (SOCKS y gestión)
  *   4. Registra en el selector y ejecuta el event loop
  */
+#ifdef __linux__
+#define _GNU_SOURCE     // pthread_setaffinity_np
+#endif
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <limits.h>
 #include <errno.h>
 #include <signal.h>
+#include <stdatomic.h>
 
+#include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -39,9 +49,56 @@
 #include "metrics.h"
 #include "users.h"
 #include "logger.h"
+#include "dnscache.h"
+#include "resolver.h"
+#include "sockmap.h"
+#include "intern.h"
+#include "tuning.h"
 
-// Flag global para terminar el servidor limpiamente
-static bool done = false;
+// Segundos que el kernel retiene una conexión sin datos con TCP_DEFER_ACCEPT
+// (el mismo plazo que tiene el handshake SOCKS)
+#define DEFER_ACCEPT_SECONDS 10
+
+// Conexiones con datos en el SYN pendientes de aceptar, por socket pasivo
+#define FAST_OPEN_QUEUE 256
+
+// Flag global para terminar el servidor limpiamente (lo leen todos los reactores)
+static atomic_bool done = false;
+
+/**
+ * Un reactor: event loop independiente con su selector y su socket pasivo
+ * SOCKS. Las conexiones aceptadas viven y mueren en el reactor que las
+ * aceptó, así que ningún selector se comparte entre threads. El kernel
+ * reparte las conexiones entrantes entre los sockets con SO_REUSEPORT.
+ *
+ * El reactor 0 corre en el thread principal y atiende además el socket
+ * de gestión.
+ */
+struct reactor {
+    pthread_t    thread;
+    unsigned     id;
+    /** CPU al que se fija el reactor, -1 si no se fija */
+    int          cpu;
+    bool         io_uring;
+    int          socks_server;
+    fd_selector  selector;
+};
+
+static pthread_t main_thread;
+
+/**
+ * Se abre cuando el pool de trabajos bloqueantes ya se detuvo: hasta ese
+ * momento un worker todavía puede notificar a cualquier selector, así que
+ * ningún reactor destruye el suyo antes.
+ */
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    bool            open;
+} teardown_gate = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond  = PTHREAD_COND_INITIALIZER,
+};
 
 /**
  * Handler de señales SIGTERM/SIGINT para shutdown limpio.
@@ -59,10 +116,13 @@ sigterm_handler(const int signal) {
  * @param addr Dirección IP a escuchar (ej: "0.0.0.0", "127.0.0.1")
  * @param port Puerto a escuchar
  * @param ipv6 true para IPv6, false para IPv4
+ * @param reuseport true para compartir el puerto entre varios sockets
+ *                  (uno por reactor)
  * @return file descriptor del socket o -1 en error
  */
 static int
-create_passive_socket(const char *addr, unsigned short port, bool ipv6) {
+create_passive_socket(const char *addr, unsigned short port, bool ipv6,
+                      bool reuseport) {
     int server;
     
     if (ipv6) {
@@ -85,6 +145,11 @@ create_passive_socket(const char *addr, unsigned short port, bool ipv6) {
         // Configurar opciones del socket
         setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
         setsockopt(server, IPPROTO_IPV6, IPV6_V6ONLY, &(int){0}, sizeof(int));
+        if (reuseport && setsockopt(server, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) < 0) {
+            LOG_ERROR("Unable to set SO_REUSEPORT: %s", strerror(errno));
+            close(server);
+            return -1;
+        }
         
         if (bind(server, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
             LOG_ERROR("Unable to bind IPv6 socket to [%s]:%d: %s", addr, port, strerror(errno));
@@ -110,6 +175,11 @@ create_passive_socket(const char *addr, unsigned short port, bool ipv6) {
         
         // Configurar opciones del socket
         setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
+        if (reuseport && setsockopt(server, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) < 0) {
+            LOG_ERROR("Unable to set SO_REUSEPORT: %s", strerror(errno));
+            close(server);
+            return -1;
+        }
         
         if (bind(server, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
             LOG_ERROR("Unable to bind IPv4 socket to %s:%d: %s", addr, port, strerror(errno));
@@ -135,6 +205,60 @@ create_passive_socket(const char *addr, unsigned short port, bool ipv6) {
     return server;
 }
 
+/**
+ * Pide al kernel que no entregue una conexión hasta que el cliente mande
+ * datos (el HELLO), así el primer aviso ya trae algo para leer. Donde no
+ * existe TCP_DEFER_ACCEPT solo se avisa.
+ */
+static void
+set_defer_accept(int server) {
+#ifdef TCP_DEFER_ACCEPT
+    if (setsockopt(server, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                   &(int){DEFER_ACCEPT_SECONDS}, sizeof(int)) < 0) {
+        LOG_WARN("Unable to set TCP_DEFER_ACCEPT: %s", strerror(errno));
+    }
+#else
+    (void)server;
+    LOG_WARN("TCP_DEFER_ACCEPT is not supported on this platform");
+#endif
+}
+
+/**
+ * Acepta datos en el SYN (TCP Fast Open) de los clientes que ya tienen
+ * cookie: el HELLO llega con la conexión, sin esperar un RTT. Donde no
+ * existe TCP_FASTOPEN solo se avisa.
+ */
+static void
+set_fast_open(int server) {
+#ifdef TCP_FASTOPEN
+    if (setsockopt(server, IPPROTO_TCP, TCP_FASTOPEN,
+                   &(int){FAST_OPEN_QUEUE}, sizeof(int)) < 0) {
+        LOG_WARN("Unable to set TCP_FASTOPEN: %s", strerror(errno));
+    }
+#else
+    (void)server;
+    LOG_WARN("TCP_FASTOPEN is not supported on this platform");
+#endif
+}
+
+/**
+ * Lleva el límite blando de file descriptors al límite duro.
+ * Cada conexión proxeada consume dos fds, y el default (1024 en la mayoría
+ * de las distribuciones) es mucho menor a lo que soporta el selector.
+ */
+static void
+raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) < 0) {
+            LOG_WARN("Unable to raise file descriptor limit: %s", strerror(errno));
+            return;
+        }
+    }
+    LOG_DEBUG("File descriptor limit: %lu", (unsigned long)rl.rlim_cur);
+}
+
 /**
  * Determina si una dirección es IPv6
  */
@@ -143,6 +267,126 @@ is_ipv6_address(const char *addr) {
     return strchr(addr, ':') != NULL;
 }
 
+// Handler para los sockets pasivos de SOCKS5 (compartido por los reactores)
+static const struct fd_handler socks5_handler = {
+    .handle_read   = socksv5_passive_accept,
+    .handle_write  = NULL,
+    .handle_close  = NULL,
+    .handle_accept = socksv5_accept,
+};
+
+/**
+ * Fija el thread actual al CPU asignado al reactor, si tiene uno.
+ */
+static void
+reactor_pin(const struct reactor *r) {
+#ifdef __linux__
+    if (r->cpu < 0) {
+        return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(r->cpu, &set);
+    const int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+        LOG_WARN("Unable to pin reactor %u to CPU %d: %s", r->id, r->cpu, strerror(err));
+    }
+#else
+    (void) r;
+#endif
+}
+
+/**
+ * Crea el selector del reactor y registra su socket pasivo SOCKS, con
+ * prioridad para que los accept no esperen detrás de las copias.
+ *
+ * Debe llamarse desde el thread que va a correr el reactor: el pool de
+ * conexiones de socks5nio es por thread.
+ */
+static selector_status
+reactor_setup(struct reactor *r) {
+    r->selector = selector_new(1024);  // Capacidad inicial para 1024 fds
+    if (r->selector == NULL) {
+        return SELECTOR_ENOMEM;
+    }
+    socksv5_pool_init();
+    if (r->io_uring && selector_get_engine(r->selector) != SELECTOR_ENGINE_URING) {
+        LOG_WARN("Reactor %u: io_uring not available (%s), falling back to the default I/O engine",
+                 r->id, strerror(errno));
+    }
+    // con io_uring el kernel acepta solo (accept multishot)
+    const bool uring = selector_get_engine(r->selector) == SELECTOR_ENGINE_URING;
+    selector_status ss = selector_register(r->selector, r->socks_server, &socks5_handler,
+                                           uring ? OP_NOOP : OP_READ, NULL);
+    if (ss == SELECTOR_SUCCESS) {
+        ss = selector_set_priority(r->selector, r->socks_server, true);
+    }
+    if (ss == SELECTOR_SUCCESS && uring) {
+        ss = selector_accept(r->selector, r->socks_server);
+    }
+    return ss;
+}
+
+/**
+ * Event loop de un reactor: corre hasta que se pida terminar o falle el
+ * selector.
+ */
+static selector_status
+reactor_loop(struct reactor *r) {
+    selector_status ss = SELECTOR_SUCCESS;
+    while (!done && ss == SELECTOR_SUCCESS) {
+        ss = selector_select(r->selector);
+    }
+    return ss;
+}
+
+/**
+ * Destruye el selector del reactor (cerrando las conexiones que queden) y
+ * libera los pools del thread, después de que se detenga el pool de trabajos
+ * bloqueantes.
+ *
+ * Debe llamarse desde el thread del reactor: las conexiones y las consultas
+ * DNS devuelven su memoria a los pools de ese thread al cerrarse.
+ */
+static void
+reactor_teardown(struct reactor *r) {
+    pthread_mutex_lock(&teardown_gate.mutex);
+    while (!teardown_gate.open) {
+        pthread_cond_wait(&teardown_gate.cond, &teardown_gate.mutex);
+    }
+    pthread_mutex_unlock(&teardown_gate.mutex);
+
+    selector_destroy(r->selector);
+    r->selector = NULL;
+    socksv5_pool_destroy();
+}
+
+/**
+ * Punto de entrada de los reactores secundarios (id > 0).
+ */
+static void *
+reactor_thread(void *arg) {
+    struct reactor *r = arg;
+
+    reactor_pin(r);
+    selector_status ss = reactor_setup(r);
+    if (ss == SELECTOR_SUCCESS) {
+        ss = reactor_loop(r);
+    }
+    if (ss != SELECTOR_SUCCESS) {
+        // el kernel le seguiría repartiendo conexiones a este socket pasivo,
+        // así que un reactor caído baja todo el servidor
+        LOG_ERROR("Reactor %u failed: %s", r->id,
+                  ss == SELECTOR_IO ? strerror(errno) : selector_error(ss));
+        done = true;
+    }
+    // despierta al thread principal por si la señal de shutdown nos llegó a nosotros
+    pthread_kill(main_thread, SIGALRM);
+
+    reactor_teardown(r);
+    return NULL;
+}
+
 int
 main(const int argc, char **argv) {
     // Parsear argumentos de línea de comandos
@@ -152,7 +396,22 @@ main(const int argc, char **argv) {
     // Inicializar subsistemas
     logger_init(LOG_INFO, NULL);  // Log a stderr por defecto
     metrics_init();
+    dnscache_init();
+    intern_init();
+    resolver_init();
+    if (args.kernel_relay) {
+        sockmap_init();
+    }
     users_init();
+    tuning_init();
+    raise_fd_limit();
+    socksv5_set_connect_delay(args.connect_delay);
+    socksv5_set_accept_batch(args.accept_batch);
+    socksv5_set_zero_copy(args.zero_copy);
+    socksv5_set_fast_open(args.fast_open);
+    socksv5_set_relay_memory_cap((size_t)args.relay_memory * 1024 * 1024);
+    socksv5_set_slab(args.conn_slab, args.huge_pages);
+    socksv5_set_dissectors(args.disectors_enabled);
     
     // Cargar usuarios de línea de comandos
     for (int i = 0; i < args.nusers; i++) {
@@ -163,6 +422,12 @@ main(const int argc, char **argv) {
         }
     }
     
+    for (int i = 0; i < args.ntuning_rules; i++) {
+        if (!tuning_rule_set(args.tuning_rules[i])) {
+            LOG_ERROR("Invalid tuning rule: %s", args.tuning_rules[i]);
+        }
+    }
+    
     // Si no hay usuarios, agregar uno por defecto para testing
     if (users_count() == 0) {
         LOG_WARN("No users configured, adding default user admin:admin");
@@ -173,28 +438,56 @@ main(const int argc, char **argv) {
     close(STDIN_FILENO);
     
     // Variables para cleanup
-    const char *err_msg   = NULL;
-    selector_status ss    = SELECTOR_SUCCESS;
-    fd_selector selector  = NULL;
-    int socks_server      = -1;
-    int mgmt_server       = -1;
-    int ret               = 0;
+    const char *err_msg       = NULL;
+    selector_status ss        = SELECTOR_SUCCESS;
+    struct reactor *reactors  = NULL;
+    unsigned nreactors        = args.threads;
+    unsigned started          = 0;
+    int mgmt_server           = -1;
+    int ret                   = 0;
     
-    // Crear socket pasivo para SOCKS5
-    bool socks_ipv6 = is_ipv6_address(args.socks_addr);
-    socks_server = create_passive_socket(args.socks_addr, args.socks_port, socks_ipv6);
-    if (socks_server < 0) {
-        err_msg = "unable to create SOCKS5 socket";
+    reactors = calloc(nreactors, sizeof(*reactors));
+    if (reactors == NULL) {
+        err_msg = "unable to allocate reactors";
         ret = 1;
+        nreactors = 0;
         goto finally;
     }
-    LOG_INFO("SOCKS5 server listening on %s%s%s:%d",
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus < 1) {
+        ncpus = 1;
+    }
+    for (unsigned i = 0; i < nreactors; i++) {
+        reactors[i].id           = i;
+        reactors[i].cpu          = args.affinity ? (int)(i % ncpus) : -1;
+        reactors[i].io_uring     = args.io_uring;
+        reactors[i].socks_server = -1;
+    }
+    
+    // Crear un socket pasivo para SOCKS5 por reactor
+    bool socks_ipv6 = is_ipv6_address(args.socks_addr);
+    for (unsigned i = 0; i < nreactors; i++) {
+        reactors[i].socks_server = create_passive_socket(args.socks_addr, args.socks_port,
+                                                         socks_ipv6, nreactors > 1);
+        if (reactors[i].socks_server < 0) {
+            err_msg = "unable to create SOCKS5 socket";
+            ret = 1;
+            goto finally;
+        }
+        if (args.defer_accept) {
+            set_defer_accept(reactors[i].socks_server);
+        }
+        if (args.fast_open) {
+            set_fast_open(reactors[i].socks_server);
+        }
+    }
+    LOG_INFO("SOCKS5 server listening on %s%s%s:%d (%u reactor%s)",
              socks_ipv6 ? "[" : "", args.socks_addr, socks_ipv6 ? "]" : "",
-             args.socks_port);
+             args.socks_port, nreactors, nreactors == 1 ? "" : "s");
     
     // Crear socket pasivo para gestión
     bool mgmt_ipv6 = is_ipv6_address(args.mng_addr);
-    mgmt_server = create_passive_socket(args.mng_addr, args.mng_port, mgmt_ipv6);
+    mgmt_server = create_passive_socket(args.mng_addr, args.mng_port, mgmt_ipv6, false);
     if (mgmt_server < 0) {
         err_msg = "unable to create management socket";
         ret = 1;
@@ -209,13 +502,14 @@ main(const int argc, char **argv) {
     signal(SIGINT,  sigterm_handler);
     signal(SIGPIPE, SIG_IGN);  // Ignorar SIGPIPE (write en socket cerrado)
     
-    // Inicializar el selector
+    // Inicializar el selector (bloquea SIGALRM; los threads heredan la máscara)
     const struct selector_init selector_conf = {
         .signal = SIGALRM,
         .select_timeout = {
             .tv_sec  = 10,
             .tv_nsec = 0,
         },
+        .engine = args.io_uring ? SELECTOR_ENGINE_URING : SELECTOR_ENGINE_DEFAULT,
     };
     
     if (selector_init(&selector_conf) != SELECTOR_SUCCESS) {
@@ -224,26 +518,20 @@ main(const int argc, char **argv) {
         goto finally;
     }
     
-    selector = selector_new(1024);  // Capacidad inicial para 1024 fds
-    if (selector == NULL) {
-        err_msg = "unable to create selector";
-        ret = 1;
-        goto finally;
-    }
-    
-    // Handler para el socket pasivo de SOCKS5
-    const struct fd_handler socks5_handler = {
-        .handle_read  = socksv5_passive_accept,
-        .handle_write = NULL,
-        .handle_close = NULL,
-    };
-    
-    ss = selector_register(selector, socks_server, &socks5_handler, OP_READ, NULL);
+    // El reactor 0 corre en este thread
+    main_thread = pthread_self();
+    reactors[0].thread = main_thread;
+    reactor_pin(&reactors[0]);
+    ss = reactor_setup(&reactors[0]);
     if (ss != SELECTOR_SUCCESS) {
         err_msg = "unable to register SOCKS5 socket";
         ret = 1;
         goto finally;
     }
+    started = 1;
+    if (args.io_uring && selector_get_engine(reactors[0].selector) == SELECTOR_ENGINE_URING) {
+        LOG_INFO("Using io_uring I/O engine");
+    }
     
     // Handler para el socket pasivo de gestión
     const struct fd_handler mgmt_handler = {
@@ -252,31 +540,66 @@ main(const int argc, char **argv) {
         .handle_close = NULL,
     };
     
-    ss = selector_register(selector, mgmt_server, &mgmt_handler, OP_READ, NULL);
+    ss = selector_register(reactors[0].selector, mgmt_server, &mgmt_handler, OP_READ, NULL);
+    if (ss == SELECTOR_SUCCESS) {
+        ss = selector_set_priority(reactors[0].selector, mgmt_server, true);
+    }
     if (ss != SELECTOR_SUCCESS) {
         err_msg = "unable to register management socket";
         ret = 1;
         goto finally;
     }
     
-    LOG_INFO("Server started successfully. Waiting for connections...");
-    
-    // ====== EVENT LOOP PRINCIPAL ======
-    while (!done) {
-        err_msg = NULL;
-        ss = selector_select(selector);
-        if (ss != SELECTOR_SUCCESS) {
-            err_msg = "selector_select failed";
+    // Lanzar el resto de los reactores
+    for (unsigned i = 1; i < nreactors; i++) {
+        const int err = pthread_create(&reactors[i].thread, NULL, reactor_thread, reactors + i);
+        if (err != 0) {
+            errno = err;
+            LOG_ERROR("Unable to start reactor %u: %s", i, strerror(err));
+            err_msg = "unable to start reactors";
             ret = 1;
             goto finally;
         }
+        started++;
     }
     
-    // Llegamos aquí por SIGTERM/SIGINT
+    LOG_INFO("Server started successfully. Waiting for connections...");
+    
+    // ====== EVENT LOOP PRINCIPAL ======
+    ss = reactor_loop(&reactors[0]);
+    if (ss != SELECTOR_SUCCESS) {
+        err_msg = "selector_select failed";
+        ret = 1;
+        goto finally;
+    }
+    
+    // Llegamos aquí por SIGTERM/SIGINT (o porque cayó otro reactor)
     err_msg = "shutting down";
     ret = 0;
     
 finally:
+    // Detener los reactores secundarios: SIGALRM interrumpe su select
+    done = true;
+    for (unsigned i = 1; i < started; i++) {
+        pthread_kill(reactors[i].thread, SIGALRM);
+    }
+    
+    // primero el pool de trabajos bloqueantes (los getaddrinfo del
+    // resolvedor): después nadie más notifica a los selectores y cada
+    // reactor puede destruir el suyo
+    selector_close();
+    pthread_mutex_lock(&teardown_gate.mutex);
+    teardown_gate.open = true;
+    pthread_cond_broadcast(&teardown_gate.cond);
+    pthread_mutex_unlock(&teardown_gate.mutex);
+    
+    if (nreactors > 0) {
+        reactor_teardown(&reactors[0]);
+    }
+    for (unsigned i = 1; i < started; i++) {
+        pthread_join(reactors[i].thread, NULL);
+    }
+    
     // Cleanup
     if (ss != SELECTOR_SUCCESS) {
         LOG_ERROR("%s: %s", 
@@ -287,22 +610,24 @@ finally:
         LOG_INFO("%s", err_msg);
     }
     
-    if (selector != NULL) {
-        selector_destroy(selector);
-    }
-    selector_close();
-    
-    socksv5_pool_destroy();
+    socksv5_slabs_destroy();
     mgmt_pool_destroy();
     
-    if (socks_server >= 0) {
-        close(socks_server);
+    for (unsigned i = 0; i < nreactors; i++) {
+        if (reactors[i].socks_server >= 0) {
+            close(reactors[i].socks_server);
+        }
     }
+    free(reactors);
     if (mgmt_server >= 0) {
         close(mgmt_server);
     }
     
     users_destroy();
+    resolver_destroy();
+    sockmap_destroy();
+    dnscache_destroy();
+    intern_destroy();
     logger_close();
     
     return ret;
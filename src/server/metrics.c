@@ -19,6 +19,9 @@ metrics_init(void) {
     atomic_init(&metrics.failed_connections, 0);
     atomic_init(&metrics.bytes_sent, 0);
     atomic_init(&metrics.bytes_received, 0);
+    atomic_init(&metrics.fast_open_accepted, 0);
+    atomic_init(&metrics.fast_open_connects, 0);
+    atomic_init(&metrics.fast_open_fallbacks, 0);
 }
 
 struct server_metrics *
@@ -64,3 +67,17 @@ metrics_add_bytes_received(uint64_t bytes) {
     atomic_fetch_add(&metrics.bytes_transferred, bytes);
 }
 
+void
+metrics_fast_open_accepted(void) {
+    atomic_fetch_add(&metrics.fast_open_accepted, 1);
+}
+
+void
+metrics_fast_open_connect(bool syn_data) {
+    if (syn_data) {
+        atomic_fetch_add(&metrics.fast_open_connects, 1);
+    } else {
+        atomic_fetch_add(&metrics.fast_open_fallbacks, 1);
+    }
+}
+
@@ -37,7 +37,11 @@
 #include "metrics.h"
 #include "users.h"
 #include "logger.h"
+#include "dnscache.h"
+#include "resolver.h"
+#include "socks5nio.h"
 #include "netutils.h"
+#include "tuning.h"
 
 #define BUFFER_SIZE 4096
 
@@ -72,9 +76,10 @@ struct mgmt_conn {
     struct state_machine stm;
     bool authenticated;
     
-    // Buffer de línea para parsing
+    // Línea para parsing: `line_buffer' escribe sobre `line' y deja lugar
+    // para el '\0'
     char line[BUFFER_SIZE];
-    size_t line_len;
+    buffer line_buffer;
     
     // Pool
     struct mgmt_conn *next;
@@ -156,6 +161,7 @@ mgmt_new(int fd) {
     
     buffer_init(&m->read_buffer, BUFFER_SIZE, m->raw_read);
     buffer_init(&m->write_buffer, BUFFER_SIZE, m->raw_write);
+    buffer_init(&m->line_buffer, sizeof(m->line) - 1, (uint8_t *)m->line);
     
     m->stm.initial   = MGMT_AUTH;
     m->stm.max_state = MGMT_ERROR;
@@ -227,9 +233,7 @@ mgmt_passive_accept(struct selector_key *key) {
     // Preparar banner en el buffer ANTES de registrar
     const char *banner = "+OK SOCKS5 Management Server v1.0\r\n"
                          "+OK Use AUTH <user> <pass> to authenticate\r\n";
-    for (size_t i = 0; banner[i]; i++) {
-        buffer_write(&state->write_buffer, banner[i]);
-    }
+    buffer_write_n(&state->write_buffer, banner, strlen(banner));
     
     // Registrar con OP_WRITE para enviar el banner primero
     if (SELECTOR_SUCCESS != selector_register(key->s, client, &mgmt_handler,
@@ -251,12 +255,8 @@ fail:
 
 static void
 send_response(struct mgmt_conn *m, const char *response) {
-    size_t len = strlen(response);
     buffer_reset(&m->write_buffer);
-    
-    for (size_t i = 0; i < len && buffer_can_write(&m->write_buffer); i++) {
-        buffer_write(&m->write_buffer, response[i]);
-    }
+    buffer_write_n(&m->write_buffer, response, strlen(response));
 }
 
 static void
@@ -279,28 +279,35 @@ send_err(struct mgmt_conn *m, const char *msg) {
 
 static bool
 read_line(struct mgmt_conn *m) {
-    while (buffer_can_read(&m->read_buffer)) {
-        uint8_t c = buffer_read(&m->read_buffer);
-        
-        if (c == '\n') {
-            // Eliminar \r si existe
-            if (m->line_len > 0 && m->line[m->line_len - 1] == '\r') {
-                m->line_len--;
-            }
-            m->line[m->line_len] = '\0';
-            return true;
-        }
-        
-        if (m->line_len < sizeof(m->line) - 1) {
-            m->line[m->line_len++] = c;
+    size_t available;
+    const uint8_t *ptr = buffer_read_ptr(&m->read_buffer, &available);
+    const uint8_t *eol = memchr(ptr, '\n', available);
+    size_t n = eol == NULL ? available : (size_t)(eol - ptr);
+    
+    // Lo que no entra en la línea se descarta
+    size_t room;
+    buffer_write_ptr(&m->line_buffer, &room);
+    const size_t copy = n < room ? n : room;
+    memcpy(buffer_reserve(&m->line_buffer, copy), ptr, copy);
+    buffer_write_adv(&m->line_buffer, copy);
+    buffer_read_adv(&m->read_buffer, eol == NULL ? n : n + 1);
+    
+    if (eol != NULL) {
+        size_t len;
+        buffer_read_ptr(&m->line_buffer, &len);
+        // Eliminar \r si existe
+        if (len > 0 && m->line[len - 1] == '\r') {
+            len--;
         }
+        m->line[len] = '\0';
+        return true;
     }
     return false;
 }
 
 static void
 reset_line(struct mgmt_conn *m) {
-    m->line_len = 0;
+    buffer_reset(&m->line_buffer);
     m->line[0] = '\0';
 }
 
@@ -426,10 +433,16 @@ list_users_callback(const char *username, void *ctx) {
     struct mgmt_conn *m = ctx;
     char line[300];
     snprintf(line, sizeof(line), "+OK USER %s\r\n", username);
-    
-    for (size_t i = 0; line[i] && buffer_can_write(&m->write_buffer); i++) {
-        buffer_write(&m->write_buffer, line[i]);
-    }
+    buffer_write_n(&m->write_buffer, line, strlen(line));
+}
+
+// Callback para listar perfiles de socket
+static void
+list_tuning_callback(const char *text, void *ctx) {
+    struct mgmt_conn *m = ctx;
+    char line[400];
+    snprintf(line, sizeof(line), "+OK %s\r\n", text);
+    buffer_write_n(&m->write_buffer, line, strlen(line));
 }
 
 static unsigned
@@ -476,6 +489,9 @@ mgmt_cmd_read(struct selector_key *key) {
             "+OK   USERS                 - List proxy users\r\n"
             "+OK   ADDUSER <user> <pass> - Add a proxy user\r\n"
             "+OK   DELUSER <user>        - Delete a proxy user\r\n"
+            "+OK   PROFILES              - List socket tuning profiles and rules\r\n"
+            "+OK   PROFILE <name> <k=v>  - Create or change a tuning profile\r\n"
+            "+OK   TUNE <rule>           - Set listener=, user:<u>= or port:<p>= profile\r\n"
             "+OK   HELP                  - Show this help\r\n"
             "+OK   QUIT                  - Close connection\r\n"
             "+OK End of help\r\n";
@@ -487,7 +503,17 @@ mgmt_cmd_read(struct selector_key *key) {
     
     if (strcasecmp(cmd, "STATS") == 0) {
         struct server_metrics *met = metrics_get();
-        char stats[1024];
+        struct selector_blocking_stats bst;
+        selector_blocking_stats(&bst);
+        struct dnscache_stats dst;
+        dnscache_get_stats(&dst);
+        struct resolver_stats rst;
+        resolver_get_stats(&rst);
+        struct socksv5_relay_stats rls;
+        socksv5_relay_stats(&rls);
+        struct socksv5_slab_stats sls;
+        socksv5_slab_stats(&sls);
+        char stats[2048];
         snprintf(stats, sizeof(stats),
             "+OK Statistics:\r\n"
             "+OK   Total connections:    %lu\r\n"
@@ -497,6 +523,17 @@ mgmt_cmd_read(struct selector_key *key) {
             "+OK   Bytes received:       %lu\r\n"
             "+OK   Successful conns:     %lu\r\n"
             "+OK   Failed conns:         %lu\r\n"
+            "+OK   Fast Open:            %lu accepted, %lu connects, %lu fallbacks\r\n"
+            "+OK   Blocking workers:     %u (%u busy)\r\n"
+            "+OK   Blocking queue:       %u/%u (max %u)\r\n"
+            "+OK   Blocking jobs:        %llu submitted, %llu rejected, %llu completed\r\n"
+            "+OK   DNS cache hits:       %llu (%llu stale, %llu negative)\r\n"
+            "+OK   DNS cache misses:     %llu\r\n"
+            "+OK   DNS cache entries:    %llu (%llu evicted)\r\n"
+            "+OK   DNS lookups:          %llu (%llu coalesced)\r\n"
+            "+OK   Relay buffers:        %zu KiB in use, %zu KiB pooled\r\n"
+            "+OK   Grown relay buffers:  %zu KiB (cap %zu KiB)\r\n"
+            "+OK   Connection slab:      %zu/%zu (max %zu, %llu overflow)\r\n"
             "+OK End of statistics\r\n",
             (unsigned long)atomic_load(&met->total_connections),
             (unsigned long)atomic_load(&met->current_connections),
@@ -504,7 +541,21 @@ mgmt_cmd_read(struct selector_key *key) {
             (unsigned long)atomic_load(&met->bytes_sent),
             (unsigned long)atomic_load(&met->bytes_received),
             (unsigned long)atomic_load(&met->successful_connections),
-            (unsigned long)atomic_load(&met->failed_connections));
+            (unsigned long)atomic_load(&met->failed_connections),
+            (unsigned long)atomic_load(&met->fast_open_accepted),
+            (unsigned long)atomic_load(&met->fast_open_connects),
+            (unsigned long)atomic_load(&met->fast_open_fallbacks),
+            bst.workers, bst.busy,
+            bst.queue_depth, bst.queue_capacity, bst.queue_high_water,
+            bst.submitted, bst.rejected, bst.completed,
+            (unsigned long long)dst.hits, (unsigned long long)dst.stale_hits,
+            (unsigned long long)dst.negative_hits,
+            (unsigned long long)dst.misses,
+            (unsigned long long)dst.entries, (unsigned long long)dst.evictions,
+            (unsigned long long)rst.lookups, (unsigned long long)rst.coalesced,
+            rls.in_use / 1024, rls.cached / 1024,
+            rls.memory / 1024, rls.memory_cap / 1024,
+            sls.in_use, sls.capacity, sls.high_water, (unsigned long long)sls.overflow);
         send_response(m, stats);
         reset_line(m);
         selector_set_interest_key(key, OP_WRITE);
@@ -514,14 +565,10 @@ mgmt_cmd_read(struct selector_key *key) {
     if (strcasecmp(cmd, "USERS") == 0) {
         buffer_reset(&m->write_buffer);
         const char *header = "+OK User list:\r\n";
-        for (size_t i = 0; header[i]; i++) {
-            buffer_write(&m->write_buffer, header[i]);
-        }
+        buffer_write_n(&m->write_buffer, header, strlen(header));
         users_foreach(list_users_callback, m);
         const char *footer = "+OK End of user list\r\n";
-        for (size_t i = 0; footer[i] && buffer_can_write(&m->write_buffer); i++) {
-            buffer_write(&m->write_buffer, footer[i]);
-        }
+        buffer_write_n(&m->write_buffer, footer, strlen(footer));
         reset_line(m);
         selector_set_interest_key(key, OP_WRITE);
         return MGMT_CMD;
@@ -561,6 +608,53 @@ mgmt_cmd_read(struct selector_key *key) {
         return MGMT_CMD;
     }
     
+    if (strcasecmp(cmd, "PROFILES") == 0) {
+        buffer_reset(&m->write_buffer);
+        const char *header = "+OK Tuning profiles:\r\n";
+        buffer_write_n(&m->write_buffer, header, strlen(header));
+        tuning_foreach(list_tuning_callback, m);
+        const char *footer = "+OK End of tuning profiles\r\n";
+        buffer_write_n(&m->write_buffer, footer, strlen(footer));
+        reset_line(m);
+        selector_set_interest_key(key, OP_WRITE);
+        return MGMT_CMD;
+    }
+    
+    if (strcasecmp(cmd, "PROFILE") == 0) {
+        char name[TUNING_NAME_LEN + 1];
+        int options = 0;
+        if (sscanf(m->line, "%*s %15s %n", name, &options) == 1 && options > 0) {
+            if (tuning_profile_set(name, m->line + options)) {
+                LOG_INFO("Admin set tuning profile %s: %s", name, m->line + options);
+                send_ok(m, "Profile updated");
+            } else {
+                send_err(m, "Invalid profile options");
+            }
+        } else {
+            send_err(m, "Usage: PROFILE <name> [nodelay|sndbuf|rcvbuf|lowat|keepalive|user_timeout|congestion|weight=<value>]...");
+        }
+        reset_line(m);
+        selector_set_interest_key(key, OP_WRITE);
+        return MGMT_CMD;
+    }
+    
+    if (strcasecmp(cmd, "TUNE") == 0) {
+        char rule[300];
+        if (sscanf(m->line, "%*s %299s", rule) == 1) {
+            if (tuning_rule_set(rule)) {
+                LOG_INFO("Admin set tuning rule: %s", rule);
+                send_ok(m, "Rule updated");
+            } else {
+                send_err(m, "Invalid rule or unknown profile");
+            }
+        } else {
+            send_err(m, "Usage: TUNE listener=<profile> | user:<user>=<profile> | port:<port>=<profile>");
+        }
+        reset_line(m);
+        selector_set_interest_key(key, OP_WRITE);
+        return MGMT_CMD;
+    }
+    
     send_err(m, "Unknown command. Type HELP for available commands.");
     reset_line(m);
     selector_set_interest_key(key, OP_WRITE);
@@ -631,10 +725,12 @@ static void
 mgmt_done(struct selector_key *key) {
     struct mgmt_conn *m = ATTACHMENT(key);
     
-    if (m->fd >= 0) {
-        selector_unregister_fd(key->s, m->fd);
-        close(m->fd);
+    // El unregister libera `m' (handle_close), no tocarlo después
+    const int fd = m->fd;
+    if (fd >= 0) {
         m->fd = -1;
+        selector_unregister_fd(key->s, fd);
+        close(fd);
     }
 }
 
@@ -0,0 +1,1224 @@
+/**
+ * resolver.c - Resolvedor DNS stub no bloqueante
+ *
+ * Cada consulta abre su propio socket UDP conectado al servidor de turno
+ * (así el kernel elige un puerto de origen al azar y descarta respuestas de
+ * otras direcciones) y manda juntas las preguntas A y AAAA. Si una respuesta
+ * llega truncada se repiten las preguntas pendientes por TCP contra el mismo
+ * servidor. Al vencer el timer del socket se pasa al próximo servidor, en el
+ * orden de resolv(5): todos los servidores por cada intento.
+ *
+ * Los nombres con menos de `ndots' puntos se prueban primero con los
+ * dominios de búsqueda; el resto, primero tal cual.
+ *
+ * Si resolv.conf no tiene ningún servidor utilizable las consultas van a
+ * getaddrinfo(3) en el pool de trabajos bloqueantes del selector, para que
+ * sigan valiendo las demás fuentes de NSS (nsswitch.conf).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "resolver.h"
+#include "dnscache.h"
+#include "logger.h"
+
+#define RESOLVER_MAX_SERVERS  3
+#define RESOLVER_MAX_SEARCH   6
+/** puerto de los servidores; los tests lo cambian al compilar */
+#ifndef RESOLVER_PORT
+#define RESOLVER_PORT         53
+#endif
+/** buckets de la tabla de consultas en vuelo (potencia de 2) */
+#define RESOLVER_INFLIGHT_BUCKETS 64
+
+/** tamaño máximo de una respuesta UDP sin EDNS (RFC 1035) es 512; aceptamos más */
+#define RESOLVER_UDP_BUFFER   4096
+/** un mensaje TCP más su prefijo de longitud */
+#define RESOLVER_TCP_BUFFER   (2 + 65535)
+/** una pregunta: cabecera + nombre + tipo y clase */
+#define RESOLVER_QUERY_MAX    (12 + 256 + 4)
+/** vigencia en el cache de lo que resuelve getaddrinfo, que no informa TTL */
+#define RESOLVER_SYSTEM_TTL   60
+
+#define DNS_TYPE_A     1
+#define DNS_TYPE_CNAME 5
+#define DNS_TYPE_AAAA  28
+#define DNS_CLASS_IN   1
+
+#define DNS_RCODE_NOERROR  0
+#define DNS_RCODE_NXDOMAIN 3
+
+/** índices de las dos preguntas de cada consulta */
+enum { Q_A, Q_AAAA, Q_COUNT };
+
+static const uint16_t qtypes[Q_COUNT] = { DNS_TYPE_A, DNS_TYPE_AAAA };
+
+union resolver_addr {
+    struct sockaddr     sa;
+    struct sockaddr_in  in;
+    struct sockaddr_in6 in6;
+};
+
+struct hosts_entry {
+    char                *name;
+    union resolver_addr  addr;
+};
+
+static struct {
+    union resolver_addr  servers[RESOLVER_MAX_SERVERS];
+    unsigned             nservers;
+
+    char                 search[RESOLVER_MAX_SEARCH][256];
+    unsigned             nsearch;
+
+    unsigned             ndots;
+    /** segundos por intento */
+    unsigned             timeout;
+    unsigned             attempts;
+
+    struct hosts_entry  *hosts;
+    size_t               nhosts;
+
+    /** no hay servidores: se resuelve con getaddrinfo en el pool */
+    bool                 system;
+
+    uint64_t             seed;
+} conf;
+
+/**
+ * Una llamada a getaddrinfo en el pool de trabajos bloqueantes. Puede
+ * sobrevivir a su consulta (que se libera mientras el trabajo espera en la
+ * cola o corre), así que tiene su propio contador de referencias: una de la
+ * consulta y otra del worker.
+ */
+struct system_job {
+    atomic_uint          refs;
+    /** la consulta ya no espera el resultado: no hace falta resolver */
+    atomic_bool          cancelled;
+    /** el worker terminó y dejó el resultado en `status' y `res' */
+    atomic_bool          done;
+
+    char                 host[256];
+    int                  status;
+    struct addrinfo     *res;
+};
+
+/**
+ * Una resolución en curso. Las conexiones que piden el mismo nombre mientras
+ * está en vuelo se suman como `waiters' en vez de preguntar de nuevo; si no
+ * queda nadie esperando la consulta igual termina (para llenar el cache) y
+ * se libera sola.
+ */
+struct dns_query {
+    fd_selector          s;
+    resolver_status      status;
+
+    char                 host[256];
+    uint32_t             hash;
+    /**
+     * tabla de consultas en vuelo en la que está (la del thread que la
+     * inició), o NULL si no está en ninguna
+     */
+    struct dns_query   **inflight;
+    struct dns_query    *hnext;
+
+    struct resolver_query *waiters;
+
+    /** nombre que se está preguntando: `host' con o sin dominio de búsqueda */
+    char                 name[256];
+    unsigned             candidate, ncandidates;
+
+    /** intentos hechos para el candidato actual (servidores x intentos) */
+    unsigned             tries;
+    int                  fd;
+    bool                 tcp;
+
+    /** getaddrinfo en curso (sin servidores); `fd' solo recibe el aviso */
+    struct system_job   *job;
+
+    uint16_t             id[Q_COUNT];
+    bool                 answered[Q_COUNT];
+
+    union resolver_addr  addrs[Q_COUNT][DNSCACHE_MAX_ADDRS];
+    unsigned             naddrs[Q_COUNT];
+    uint32_t             ttl;
+
+    /** TCP: preguntas a enviar y respuesta parcial */
+    uint8_t              out[2 * (2 + RESOLVER_QUERY_MAX)];
+    size_t               out_len, out_sent;
+    uint8_t             *in;
+    size_t               in_len;
+
+    /** direcciones finales, sin puerto */
+    union resolver_addr  result[DNSCACHE_MAX_ADDRS];
+    unsigned             nresult;
+};
+
+/** una conexión esperando una consulta */
+struct resolver_query {
+    struct dns_query      *query;
+    int                    notify_fd;
+    uint16_t               port;
+    struct resolver_query *next;
+};
+
+/**
+ * Consultas en vuelo de cada thread, por nombre. Cada reactor pregunta por
+ * sus propios sockets, así que la tabla no necesita locks.
+ */
+static _Thread_local struct dns_query *inflight[RESOLVER_INFLIGHT_BUCKETS];
+
+static struct {
+    _Atomic uint64_t lookups;
+    _Atomic uint64_t coalesced;
+} stats;
+
+static void resolver_read(struct selector_key *key);
+static void resolver_write(struct selector_key *key);
+static void resolver_block(struct selector_key *key);
+static void resolver_timeout(struct selector_key *key);
+static void resolver_close(struct selector_key *key);
+
+static const struct fd_handler resolver_handler = {
+    .handle_read    = resolver_read,
+    .handle_write   = resolver_write,
+    .handle_block   = resolver_block,
+    .handle_timeout = resolver_timeout,
+    .handle_close   = resolver_close,
+};
+
+static void query_try(struct dns_query *q);
+static void query_system(struct dns_query *q);
+static void query_finish(struct dns_query *q, resolver_status status);
+static void query_free(struct dns_query *q);
+
+// ============================================================================
+// Configuración
+// ============================================================================
+
+static bool
+parse_addr(const char *str, uint16_t port, union resolver_addr *addr) {
+    memset(addr, 0, sizeof(*addr));
+    if (inet_pton(AF_INET, str, &addr->in.sin_addr) == 1) {
+        addr->in.sin_family = AF_INET;
+        addr->in.sin_port   = htons(port);
+        return true;
+    }
+    if (inet_pton(AF_INET6, str, &addr->in6.sin6_addr) == 1) {
+        addr->in6.sin6_family = AF_INET6;
+        addr->in6.sin6_port   = htons(port);
+        return true;
+    }
+    return false;
+}
+
+static unsigned
+option_value(const char *opt, const char *name, unsigned min, unsigned max,
+             unsigned current) {
+    const size_t len = strlen(name);
+    if (strncmp(opt, name, len) != 0 || opt[len] != ':') {
+        return current;
+    }
+    unsigned long v = strtoul(opt + len + 1, NULL, 10);
+    return v < min ? min : v > max ? max : (unsigned)v;
+}
+
+static void
+load_resolv_conf(void) {
+    FILE *f = fopen(RESOLVER_CONF_PATH, "r");
+    if (f == NULL) {
+        return;
+    }
+    char line[1024];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "#;\n")] = '\0';
+        char *save = NULL;
+        const char *kw = strtok_r(line, " \t\r", &save);
+        if (kw == NULL) {
+            continue;
+        }
+        if (strcmp(kw, "nameserver") == 0) {
+            const char *addr = strtok_r(NULL, " \t\r", &save);
+            if (addr != NULL && conf.nservers < RESOLVER_MAX_SERVERS
+                && parse_addr(addr, RESOLVER_PORT, &conf.servers[conf.nservers])) {
+                conf.nservers++;
+            }
+        } else if (strcmp(kw, "search") == 0 || strcmp(kw, "domain") == 0) {
+            // la última línea search/domain reemplaza a las anteriores
+            conf.nsearch = 0;
+            const char *d;
+            while ((d = strtok_r(NULL, " \t\r", &save)) != NULL
+                   && conf.nsearch < RESOLVER_MAX_SEARCH) {
+                if (strlen(d) < sizeof(conf.search[0]) && strcmp(d, ".") != 0) {
+                    strcpy(conf.search[conf.nsearch++], d);
+                }
+            }
+        } else if (strcmp(kw, "options") == 0) {
+            const char *opt;
+            while ((opt = strtok_r(NULL, " \t\r", &save)) != NULL) {
+                conf.ndots    = option_value(opt, "ndots", 0, 15, conf.ndots);
+                conf.timeout  = option_value(opt, "timeout", 1, 30, conf.timeout);
+                conf.attempts = option_value(opt, "attempts", 1, 5, conf.attempts);
+            }
+        }
+    }
+    fclose(f);
+}
+
+static void
+load_hosts(void) {
+    FILE *f = fopen(RESOLVER_HOSTS_PATH, "r");
+    if (f == NULL) {
+        return;
+    }
+    size_t cap = 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "#\n")] = '\0';
+        char *save = NULL;
+        const char *addr = strtok_r(line, " \t\r", &save);
+        union resolver_addr a;
+        if (addr == NULL || !parse_addr(addr, 0, &a)) {
+            continue;
+        }
+        const char *name;
+        while ((name = strtok_r(NULL, " \t\r", &save)) != NULL) {
+            if (conf.nhosts == cap) {
+                const size_t ncap = cap ? cap * 2 : 16;
+                struct hosts_entry *h = realloc(conf.hosts, ncap * sizeof(*h));
+                if (h == NULL) {
+                    goto done;
+                }
+                conf.hosts = h;
+                cap = ncap;
+            }
+            char *copy = strdup(name);
+            if (copy == NULL) {
+                goto done;
+            }
+            conf.hosts[conf.nhosts].name = copy;
+            conf.hosts[conf.nhosts].addr = a;
+            conf.nhosts++;
+        }
+    }
+done:
+    fclose(f);
+}
+
+static uint64_t
+read_seed(void) {
+    uint64_t seed = 0;
+    FILE *f = fopen("/dev/urandom", "r");
+    if (f != NULL) {
+        if (fread(&seed, sizeof(seed), 1, f) != 1) {
+            seed = 0;
+        }
+        fclose(f);
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return seed ^ ((uint64_t)ts.tv_sec << 32) ^ (uint64_t)ts.tv_nsec ^ (uint64_t)getpid();
+}
+
+void
+resolver_init(void) {
+    memset(&conf, 0, sizeof(conf));
+    conf.ndots    = 1;
+    conf.timeout  = 5;
+    conf.attempts = 2;
+
+    load_resolv_conf();
+    load_hosts();
+    conf.system = conf.nservers == 0;
+    conf.seed = read_seed();
+
+    if (conf.system) {
+        LOG_INFO("DNS resolver: no usable nameserver in %s, resolving with getaddrinfo",
+                 RESOLVER_CONF_PATH);
+    } else {
+        LOG_INFO("DNS resolver: %u nameserver(s), %u search domain(s), %zu hosts entries",
+                 conf.nservers, conf.nsearch, conf.nhosts);
+    }
+}
+
+void
+resolver_destroy(void) {
+    for (size_t i = 0; i < conf.nhosts; i++) {
+        free(conf.hosts[i].name);
+    }
+    free(conf.hosts);
+    conf.hosts  = NULL;
+    conf.nhosts = 0;
+}
+
+/** IDs de consulta impredecibles (splitmix64 por thread) */
+static uint16_t
+random_id(void) {
+    static _Thread_local uint64_t state;
+    if (state == 0) {
+        state = conf.seed ^ (uint64_t)(uintptr_t)&state;
+    }
+    uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return (uint16_t)(z ^ (z >> 31));
+}
+
+// ============================================================================
+// Resolución local
+// ============================================================================
+
+/**
+ * Arma una lista addrinfo temporal sobre `nodes' (sin memoria dinámica) para
+ * pasársela al cache, que copia lo que necesita.
+ */
+static struct addrinfo *
+link_addrinfo(struct addrinfo *nodes, union resolver_addr *addrs, unsigned n,
+              uint16_t port) {
+    for (unsigned i = 0; i < n; i++) {
+        memset(&nodes[i], 0, sizeof(nodes[i]));
+        nodes[i].ai_family   = addrs[i].sa.sa_family;
+        nodes[i].ai_socktype = SOCK_STREAM;
+        nodes[i].ai_protocol = IPPROTO_TCP;
+        nodes[i].ai_addr     = &addrs[i].sa;
+        if (addrs[i].sa.sa_family == AF_INET6) {
+            addrs[i].in6.sin6_port = htons(port);
+            nodes[i].ai_addrlen    = sizeof(struct sockaddr_in6);
+        } else {
+            addrs[i].in.sin_port   = htons(port);
+            nodes[i].ai_addrlen    = sizeof(struct sockaddr_in);
+        }
+        nodes[i].ai_next = i + 1 < n ? &nodes[i + 1] : NULL;
+    }
+    return n > 0 ? &nodes[0] : NULL;
+}
+
+struct addrinfo *
+resolver_lookup_local(const char *host, uint16_t port) {
+    union resolver_addr addrs[DNSCACHE_MAX_ADDRS];
+    struct addrinfo nodes[DNSCACHE_MAX_ADDRS];
+    unsigned n = 0;
+
+    if (parse_addr(host, port, &addrs[0])) {
+        n = 1;
+    } else {
+        size_t len = strlen(host);
+        if (len > 0 && host[len - 1] == '.') {
+            len--;
+        }
+        for (size_t i = 0; i < conf.nhosts && n < DNSCACHE_MAX_ADDRS; i++) {
+            if (strlen(conf.hosts[i].name) == len
+                && strncasecmp(conf.hosts[i].name, host, len) == 0) {
+                addrs[n++] = conf.hosts[i].addr;
+            }
+        }
+    }
+    return dnscache_addrinfo_dup(link_addrinfo(nodes, addrs, n, port));
+}
+
+// ============================================================================
+// Mensajes DNS
+// ============================================================================
+
+static inline uint16_t
+get16(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static inline uint32_t
+get32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline void
+put16(uint8_t *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+/**
+ * Escribe en `buf' una pregunta (con recursión) por `name'.
+ * @return la longitud del mensaje, o 0 si el nombre no es válido
+ */
+static size_t
+build_query(uint8_t *buf, uint16_t id, const char *name, uint16_t qtype) {
+    memset(buf, 0, 12);
+    put16(buf, id);
+    buf[2] = 0x01;           // RD
+    put16(buf + 4, 1);       // QDCOUNT
+
+    size_t off = 12;
+    const char *label = name;
+    while (*label != '\0') {
+        const char *dot = strchr(label, '.');
+        const size_t len = dot ? (size_t)(dot - label) : strlen(label);
+        if (len == 0 || len > 63 || off + 1 + len > 12 + 254) {
+            return 0;
+        }
+        buf[off++] = (uint8_t)len;
+        memcpy(buf + off, label, len);
+        off += len;
+        label += len;
+        if (*label == '.') {
+            label++;
+        }
+    }
+    buf[off++] = 0;
+    put16(buf + off, qtype);
+    put16(buf + off + 2, DNS_CLASS_IN);
+    return off + 4;
+}
+
+/**
+ * Lee un nombre (siguiendo punteros de compresión) en `out'.
+ * @return el offset siguiente al nombre, o 0 si está mal formado
+ */
+static size_t
+read_name(const uint8_t *msg, size_t len, size_t off, char *out, size_t outlen) {
+    size_t next = 0, o = 0;
+    unsigned jumps = 0;
+    while (off < len) {
+        const uint8_t c = msg[off];
+        if (c == 0) {
+            if (out != NULL) {
+                out[o ? o - 1 : 0] = '\0';
+            }
+            return next ? next : off + 1;
+        }
+        if ((c & 0xc0) == 0xc0) {
+            if (off + 1 >= len || ++jumps > 64) {
+                return 0;
+            }
+            if (next == 0) {
+                next = off + 2;
+            }
+            off = (size_t)(c & 0x3f) << 8 | msg[off + 1];
+            continue;
+        }
+        if ((c & 0xc0) != 0 || off + 1 + c > len) {
+            return 0;
+        }
+        if (out != NULL) {
+            if (o + c + 1 >= outlen) {
+                return 0;
+            }
+            memcpy(out + o, msg + off + 1, c);
+            o += c;
+            out[o++] = '.';
+        }
+        off += 1 + c;
+    }
+    return 0;
+}
+
+static void
+add_addr(struct dns_query *q, unsigned type, const uint8_t *rdata) {
+    if (q->naddrs[type] == DNSCACHE_MAX_ADDRS) {
+        return;
+    }
+    union resolver_addr *a = &q->addrs[type][q->naddrs[type]++];
+    memset(a, 0, sizeof(*a));
+    if (type == Q_A) {
+        a->in.sin_family = AF_INET;
+        memcpy(&a->in.sin_addr, rdata, 4);
+    } else {
+        a->in6.sin6_family = AF_INET6;
+        memcpy(&a->in6.sin6_addr, rdata, 16);
+    }
+}
+
+/** qué hacer después de procesar una respuesta */
+typedef enum {
+    RESPONSE_IGNORED,
+    RESPONSE_OK,
+    RESPONSE_TRUNCATED,
+    RESPONSE_SERVER_FAILURE,
+} response_action;
+
+static response_action
+handle_response(struct dns_query *q, const uint8_t *msg, size_t len) {
+    if (len < 12 || !(msg[2] & 0x80)) {
+        return RESPONSE_IGNORED;
+    }
+    const uint16_t id = get16(msg);
+    unsigned type;
+    for (type = 0; type < Q_COUNT; type++) {
+        if (!q->answered[type] && q->id[type] == id) {
+            break;
+        }
+    }
+    if (type == Q_COUNT || get16(msg + 4) != 1) {
+        return RESPONSE_IGNORED;
+    }
+
+    // la pregunta tiene que ser la nuestra
+    char qname[256];
+    size_t off = read_name(msg, len, 12, qname, sizeof(qname));
+    if (off == 0 || off + 4 > len || strcasecmp(qname, q->name) != 0
+        || get16(msg + off) != qtypes[type] || get16(msg + off + 2) != DNS_CLASS_IN) {
+        return RESPONSE_IGNORED;
+    }
+    off += 4;
+
+    if ((msg[2] & 0x02) && !q->tcp) {
+        return RESPONSE_TRUNCATED;
+    }
+
+    const unsigned rcode = msg[3] & 0x0f;
+    if (rcode == DNS_RCODE_NXDOMAIN) {
+        // el nombre no existe: tampoco hace falta la otra pregunta
+        q->answered[Q_A] = q->answered[Q_AAAA] = true;
+        return RESPONSE_OK;
+    }
+    if (rcode != DNS_RCODE_NOERROR) {
+        return RESPONSE_SERVER_FAILURE;
+    }
+
+    const unsigned ancount = get16(msg + 6);
+    for (unsigned i = 0; i < ancount; i++) {
+        off = read_name(msg, len, off, NULL, 0);
+        if (off == 0 || off + 10 > len) {
+            return RESPONSE_SERVER_FAILURE;
+        }
+        const uint16_t rtype  = get16(msg + off);
+        const uint16_t rclass = get16(msg + off + 2);
+        const uint32_t ttl    = get32(msg + off + 4);
+        const uint16_t rdlen  = get16(msg + off + 8);
+        off += 10;
+        if (off + rdlen > len) {
+            return RESPONSE_SERVER_FAILURE;
+        }
+        if (rclass == DNS_CLASS_IN) {
+            const bool is_addr = (rtype == DNS_TYPE_A && rdlen == 4 && type == Q_A)
+                              || (rtype == DNS_TYPE_AAAA && rdlen == 16 && type == Q_AAAA);
+            if (is_addr) {
+                add_addr(q, type, msg + off);
+            }
+            if (is_addr || rtype == DNS_TYPE_CNAME) {
+                if (ttl < q->ttl) {
+                    q->ttl = ttl;
+                }
+            }
+        }
+        off += rdlen;
+    }
+    q->answered[type] = true;
+    return RESPONSE_OK;
+}
+
+// ============================================================================
+// Consultas
+// ============================================================================
+
+/** arma en `q->name' el candidato `i' (ver el comentario del archivo) */
+static bool
+candidate_name(struct dns_query *q, unsigned i) {
+    const size_t len = strlen(q->host);
+    const bool absolute = len > 0 && q->host[len - 1] == '.';
+    unsigned dots = 0;
+    for (size_t j = 0; j < len; j++) {
+        dots += q->host[j] == '.';
+    }
+
+    // el nombre tal cual va primero o último
+    const unsigned as_is = absolute || dots >= conf.ndots ? 0 : conf.nsearch;
+    int n;
+    if (i == as_is) {
+        n = snprintf(q->name, sizeof(q->name), "%.*s", (int)(absolute ? len - 1 : len), q->host);
+    } else {
+        const unsigned d = i < as_is ? i : i - 1;
+        n = snprintf(q->name, sizeof(q->name), "%s.%s", q->host, conf.search[d]);
+    }
+    return n > 0 && (size_t)n < sizeof(q->name);
+}
+
+static void
+query_close_socket(struct dns_query *q) {
+    if (q->fd >= 0) {
+        const int fd = q->fd;
+        // marca que el cierre es nuestro (ver `resolver_close')
+        q->fd = -1;
+        selector_unregister_fd(q->s, fd);
+    }
+    q->tcp = false;
+    q->out_len = q->out_sent = q->in_len = 0;
+}
+
+static const union resolver_addr *
+query_server(const struct dns_query *q) {
+    return &conf.servers[(q->tries - 1) % conf.nservers];
+}
+
+static socklen_t
+addr_len(const union resolver_addr *a) {
+    return a->sa.sa_family == AF_INET6 ? sizeof(a->in6) : sizeof(a->in);
+}
+
+/**
+ * Abre un socket al servidor actual y lo registra. Con TCP la conexión queda
+ * en curso y las preguntas se mandan al poder escribir.
+ */
+static bool
+query_open(struct dns_query *q, bool tcp) {
+    const union resolver_addr *server = query_server(q);
+    int fd = socket(server->sa.sa_family, tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+    if (fd < 0) {
+        return false;
+    }
+    if (selector_fd_set_nio(fd) < 0
+        || (connect(fd, &server->sa, addr_len(server)) < 0 && errno != EINPROGRESS)) {
+        close(fd);
+        return false;
+    }
+    if (selector_register(q->s, fd, &resolver_handler, tcp ? OP_WRITE : OP_READ, q)
+        != SELECTOR_SUCCESS) {
+        close(fd);
+        return false;
+    }
+    q->fd  = fd;
+    q->tcp = tcp;
+    selector_set_timeout(q->s, fd, conf.timeout * 1000);
+    return true;
+}
+
+/** manda por UDP las preguntas sin respuesta */
+static bool
+query_send_udp(struct dns_query *q) {
+    uint8_t buf[RESOLVER_QUERY_MAX];
+    for (unsigned type = 0; type < Q_COUNT; type++) {
+        if (q->answered[type]) {
+            continue;
+        }
+        const size_t len = build_query(buf, q->id[type], q->name, qtypes[type]);
+        if (len == 0 || send(q->fd, buf, len, 0) < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/** pasa a TCP contra el mismo servidor, para las preguntas sin respuesta */
+static bool
+query_start_tcp(struct dns_query *q) {
+    query_close_socket(q);
+    if (q->in == NULL && (q->in = malloc(RESOLVER_TCP_BUFFER)) == NULL) {
+        return false;
+    }
+    for (unsigned type = 0; type < Q_COUNT; type++) {
+        if (q->answered[type]) {
+            continue;
+        }
+        const size_t len = build_query(q->out + q->out_len + 2, q->id[type], q->name,
+                                       qtypes[type]);
+        if (len == 0) {
+            return false;
+        }
+        put16(q->out + q->out_len, (uint16_t)len);
+        q->out_len += 2 + len;
+    }
+    return query_open(q, true);
+}
+
+/**
+ * Próximo intento para el candidato actual, o falla si ya se probaron todos
+ * los servidores las veces configuradas.
+ */
+static void
+query_try(struct dns_query *q) {
+    query_close_socket(q);
+    while (q->tries < conf.nservers * conf.attempts) {
+        q->tries++;
+        for (unsigned type = 0; type < Q_COUNT; type++) {
+            q->id[type] = random_id();
+        }
+        if (query_open(q, false)) {
+            if (query_send_udp(q)) {
+                return;
+            }
+            query_close_socket(q);
+        }
+    }
+    query_finish(q, RESOLVER_FAILED);
+}
+
+/** empieza a preguntar por el candidato `i' */
+static void
+query_candidate(struct dns_query *q, unsigned i) {
+    if (conf.system) {
+        // getaddrinfo aplica los dominios de búsqueda por su cuenta
+        query_system(q);
+        return;
+    }
+    q->candidate = i;
+    q->tries = 0;
+    q->ttl = UINT32_MAX;
+    memset(q->answered, 0, sizeof(q->answered));
+    memset(q->naddrs, 0, sizeof(q->naddrs));
+    if (!candidate_name(q, i)) {
+        query_finish(q, RESOLVER_FAILED);
+        return;
+    }
+    query_try(q);
+}
+
+/** las dos preguntas tienen respuesta: terminar o seguir con otro nombre */
+static void
+query_answered(struct dns_query *q) {
+    if (q->naddrs[Q_A] + q->naddrs[Q_AAAA] > 0) {
+        query_finish(q, RESOLVER_OK);
+    } else if (q->candidate + 1 < q->ncandidates) {
+        query_close_socket(q);
+        query_candidate(q, q->candidate + 1);
+    } else {
+        query_finish(q, RESOLVER_NOTFOUND);
+    }
+}
+
+/**
+ * Procesa una respuesta y avanza la consulta.
+ * @return true si la consulta terminó o cambió de socket (no seguir leyendo)
+ */
+static bool
+query_response(struct dns_query *q, const uint8_t *msg, size_t len) {
+    switch (handle_response(q, msg, len)) {
+        case RESPONSE_IGNORED:
+            return false;
+        case RESPONSE_TRUNCATED:
+            if (!query_start_tcp(q)) {
+                query_try(q);
+            }
+            return true;
+        case RESPONSE_SERVER_FAILURE:
+            query_try(q);
+            return true;
+        case RESPONSE_OK:
+            break;
+    }
+    if (q->answered[Q_A] && q->answered[Q_AAAA]) {
+        query_answered(q);
+        return true;
+    }
+    return false;
+}
+
+// ============================================================================
+// getaddrinfo en el pool de trabajos bloqueantes
+// ============================================================================
+
+static void
+system_job_release(struct system_job *job) {
+    if (atomic_fetch_sub(&job->refs, 1) == 1) {
+        if (job->res != NULL) {
+            freeaddrinfo(job->res);
+        }
+        free(job);
+    }
+}
+
+/** Corre en un worker del pool: puede bloquear */
+static void
+system_lookup(void *arg) {
+    struct system_job *job = arg;
+
+    if (!atomic_load(&job->cancelled)) {
+        const struct addrinfo hints = {
+            .ai_family   = AF_UNSPEC,
+            .ai_socktype = SOCK_STREAM,
+        };
+        job->status = getaddrinfo(job->host, NULL, &hints, &job->res);
+    }
+    atomic_store(&job->done, true);
+    system_job_release(job);
+}
+
+/** la consulta deja de esperar a su trabajo en el pool, si tiene uno */
+static void
+query_release_job(struct dns_query *q) {
+    if (q->job != NULL) {
+        atomic_store(&q->job->cancelled, true);
+        system_job_release(q->job);
+        q->job = NULL;
+    }
+}
+
+/**
+ * Resuelve `q->host' con getaddrinfo en el pool de trabajos bloqueantes. El
+ * pool avisa al terminar con un fd registrado en el selector, así que la
+ * consulta abre un socket que no se usa para otra cosa.
+ */
+static void
+query_system(struct dns_query *q) {
+    struct system_job *job = calloc(1, sizeof(*job));
+    if (job == NULL) {
+        goto fail;
+    }
+    atomic_init(&job->refs, 2);
+    atomic_init(&job->cancelled, false);
+    atomic_init(&job->done, false);
+    memcpy(job->host, q->host, sizeof(job->host));
+
+    const int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        free(job);
+        goto fail;
+    }
+    if (selector_fd_set_nio(fd) < 0
+        || selector_register(q->s, fd, &resolver_handler, OP_NOOP, q) != SELECTOR_SUCCESS) {
+        close(fd);
+        free(job);
+        goto fail;
+    }
+    q->fd  = fd;
+    q->job = job;
+    if (selector_submit_blocking(q->s, fd, system_lookup, job) != SELECTOR_SUCCESS) {
+        // el worker nunca la va a soltar
+        system_job_release(job);
+        goto fail;
+    }
+    return;
+
+fail:
+    query_finish(q, RESOLVER_FAILED);
+}
+
+/** pasa a la consulta el resultado de getaddrinfo */
+static void
+query_system_done(struct dns_query *q) {
+    const struct system_job *job = q->job;
+    resolver_status status = RESOLVER_FAILED;
+
+    if (job->status == 0) {
+        for (const struct addrinfo *ai = job->res; ai != NULL; ai = ai->ai_next) {
+            const unsigned type = ai->ai_family == AF_INET6 ? Q_AAAA : Q_A;
+            if ((ai->ai_family == AF_INET || ai->ai_family == AF_INET6)
+                && q->naddrs[type] < DNSCACHE_MAX_ADDRS) {
+                memcpy(&q->addrs[type][q->naddrs[type]++], ai->ai_addr, ai->ai_addrlen);
+            }
+        }
+        q->ttl = RESOLVER_SYSTEM_TTL;
+        status = q->naddrs[Q_A] + q->naddrs[Q_AAAA] > 0 ? RESOLVER_OK : RESOLVER_NOTFOUND;
+    } else if (job->status == EAI_NONAME
+#ifdef EAI_NODATA
+               || job->status == EAI_NODATA
+#endif
+               ) {
+        status = RESOLVER_NOTFOUND;
+    } else {
+        LOG_WARN("DNS resolution failed for %s: %s", q->host, gai_strerror(job->status));
+    }
+    query_release_job(q);
+    query_finish(q, status);
+}
+
+// ============================================================================
+// Consultas en vuelo
+// ============================================================================
+
+static uint32_t
+host_hash(const char *host) {
+    uint32_t h = 2166136261u;
+    for (; *host != '\0'; host++) {
+        h = (h ^ (uint8_t)tolower((unsigned char)*host)) * 16777619u;
+    }
+    return h;
+}
+
+static struct dns_query *
+inflight_find(const char *host, uint32_t hash) {
+    for (struct dns_query *q = inflight[hash & (RESOLVER_INFLIGHT_BUCKETS - 1)];
+         q != NULL; q = q->hnext) {
+        if (q->hash == hash && strcasecmp(q->host, host) == 0) {
+            return q;
+        }
+    }
+    return NULL;
+}
+
+static void
+inflight_add(struct dns_query *q) {
+    struct dns_query **b = &inflight[q->hash & (RESOLVER_INFLIGHT_BUCKETS - 1)];
+    q->hnext = *b;
+    *b = q;
+    q->inflight = inflight;
+}
+
+/**
+ * Saca la consulta de la tabla en la que se agregó, aunque se cierre desde
+ * otro thread que el que la inició (por ejemplo, al destruir su selector).
+ */
+static void
+inflight_remove(struct dns_query *q) {
+    if (q->inflight == NULL) {
+        return;
+    }
+    struct dns_query **p = &q->inflight[q->hash & (RESOLVER_INFLIGHT_BUCKETS - 1)];
+    while (*p != q) {
+        p = &(*p)->hnext;
+    }
+    *p = q->hnext;
+    q->inflight = NULL;
+}
+
+/**
+ * Guarda el resultado en el cache y avisa a todos los que esperan. Si no
+ * queda nadie, la consulta se libera acá mismo.
+ */
+static void
+query_finish(struct dns_query *q, resolver_status status) {
+    query_close_socket(q);
+    inflight_remove(q);
+    q->status = status;
+
+    if (status == RESOLVER_OK) {
+        // hasta la mitad de cada familia si hay de las dos
+        unsigned n4 = q->naddrs[Q_A], n6 = q->naddrs[Q_AAAA];
+        const unsigned half = DNSCACHE_MAX_ADDRS / 2;
+        if (n4 + n6 > DNSCACHE_MAX_ADDRS) {
+            n4 = n4 < half ? n4 : (n6 < half ? DNSCACHE_MAX_ADDRS - n6 : half);
+            n6 = DNSCACHE_MAX_ADDRS - n4;
+        }
+        memcpy(q->result, q->addrs[Q_A], n4 * sizeof(q->result[0]));
+        memcpy(q->result + n4, q->addrs[Q_AAAA], n6 * sizeof(q->result[0]));
+        q->nresult = n4 + n6;
+
+        union resolver_addr addrs[DNSCACHE_MAX_ADDRS];
+        struct addrinfo nodes[DNSCACHE_MAX_ADDRS];
+        memcpy(addrs, q->result, q->nresult * sizeof(addrs[0]));
+        // TTL 0 se respeta: el cache no guarda la respuesta
+        const uint32_t ttl = q->ttl > 86400 ? 86400 : q->ttl;
+        dnscache_store(q->host, link_addrinfo(nodes, addrs, q->nresult, 0), ttl);
+    } else if (status == RESOLVER_NOTFOUND) {
+        dnscache_store_negative(q->host, DNSCACHE_NEGATIVE_TTL);
+    }
+
+    if (q->waiters == NULL) {
+        query_free(q);
+        return;
+    }
+    for (struct resolver_query *w = q->waiters; w != NULL; w = w->next) {
+        selector_notify_block(q->s, w->notify_fd);
+    }
+}
+
+// ============================================================================
+// Handlers
+// ============================================================================
+
+static void
+resolver_read(struct selector_key *key) {
+    struct dns_query *q = key->data;
+
+    if (!q->tcp) {
+        uint8_t buf[RESOLVER_UDP_BUFFER];
+        for (;;) {
+            const ssize_t n = recv(key->fd, buf, sizeof(buf), 0);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return;
+                }
+                // ECONNREFUSED: no hay nadie escuchando en ese servidor
+                query_try(q);
+                return;
+            }
+            if (query_response(q, buf, (size_t)n)) {
+                return;
+            }
+        }
+    }
+
+    const ssize_t n = recv(key->fd, q->in + q->in_len, RESOLVER_TCP_BUFFER - q->in_len, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+    if (n <= 0) {
+        query_try(q);
+        return;
+    }
+    q->in_len += (size_t)n;
+    while (q->in_len >= 2 && q->in_len >= 2 + (size_t)get16(q->in)) {
+        const size_t len = get16(q->in);
+        if (query_response(q, q->in + 2, len)) {
+            return;
+        }
+        memmove(q->in, q->in + 2 + len, q->in_len - 2 - len);
+        q->in_len -= 2 + len;
+    }
+}
+
+static void
+resolver_write(struct selector_key *key) {
+    struct dns_query *q = key->data;
+
+    const ssize_t n = send(key->fd, q->out + q->out_sent, q->out_len - q->out_sent, MSG_NOSIGNAL);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            query_try(q);
+        }
+        return;
+    }
+    q->out_sent += (size_t)n;
+    if (q->out_sent == q->out_len) {
+        selector_set_interest_key(key, OP_READ);
+    }
+}
+
+static void
+resolver_block(struct selector_key *key) {
+    struct dns_query *q = key->data;
+    // un aviso viejo dirigido a otra consulta que usó este fd
+    if (q->job != NULL && atomic_load(&q->job->done)) {
+        query_system_done(q);
+    }
+}
+
+static void
+resolver_timeout(struct selector_key *key) {
+    struct dns_query *q = key->data;
+    LOG_DEBUG("DNS query for %s timed out", q->name);
+    query_try(q);
+}
+
+static void
+resolver_close(struct selector_key *key) {
+    struct dns_query *q = key->data;
+    close(key->fd);
+    if (q->fd == key->fd) {
+        // desregistrado desde afuera (al destruir el selector): la consulta
+        // queda muerta y se libera con el último que la espera
+        q->fd = -1;
+        inflight_remove(q);
+        if (q->waiters == NULL) {
+            query_free(q);
+        }
+    }
+}
+
+// ============================================================================
+// API
+// ============================================================================
+
+static struct dns_query *
+query_new(fd_selector s, const char *host, uint32_t hash) {
+    struct dns_query *q = calloc(1, sizeof(*q));
+    if (q == NULL) {
+        return NULL;
+    }
+    q->s      = s;
+    q->status = RESOLVER_PENDING;
+    q->fd     = -1;
+    q->hash   = hash;
+    strncpy(q->host, host, sizeof(q->host) - 1);
+
+    const size_t len = strlen(q->host);
+    q->ncandidates = len > 0 && q->host[len - 1] == '.' ? 1 : 1 + conf.nsearch;
+    return q;
+}
+
+static void
+query_free(struct dns_query *q) {
+    query_close_socket(q);
+    inflight_remove(q);
+    query_release_job(q);
+    free(q->in);
+    free(q);
+}
+
+struct resolver_query *
+resolver_query_start(fd_selector s, int notify_fd, const char *host, uint16_t port) {
+    struct resolver_query *w = calloc(1, sizeof(*w));
+    if (w == NULL) {
+        return NULL;
+    }
+    w->notify_fd = notify_fd;
+    w->port      = port;
+
+    const uint32_t hash = host_hash(host);
+    struct dns_query *q = inflight_find(host, hash);
+    if (q != NULL) {
+        atomic_fetch_add(&stats.coalesced, 1);
+        w->query   = q;
+        w->next    = q->waiters;
+        q->waiters = w;
+        return w;
+    }
+
+    q = query_new(s, host, hash);
+    if (q == NULL) {
+        free(w);
+        return NULL;
+    }
+    atomic_fetch_add(&stats.lookups, 1);
+    w->query   = q;
+    q->waiters = w;
+    inflight_add(q);
+    // un fallo inmediato igual se notifica, como cualquier otro resultado
+    query_candidate(q, 0);
+    return w;
+}
+
+void
+resolver_refresh(fd_selector s, const char *host) {
+    const uint32_t hash = host_hash(host);
+    if (inflight_find(host, hash) != NULL) {
+        return;
+    }
+    struct dns_query *q = query_new(s, host, hash);
+    if (q != NULL) {
+        atomic_fetch_add(&stats.lookups, 1);
+        inflight_add(q);
+        query_candidate(q, 0);
+    }
+}
+
+resolver_status
+resolver_query_status(const struct resolver_query *w) {
+    return w->query->status;
+}
+
+struct addrinfo *
+resolver_query_take(struct resolver_query *w) {
+    const struct dns_query *q = w->query;
+    if (q->status != RESOLVER_OK) {
+        return NULL;
+    }
+    union resolver_addr addrs[DNSCACHE_MAX_ADDRS];
+    struct addrinfo nodes[DNSCACHE_MAX_ADDRS];
+    memcpy(addrs, q->result, q->nresult * sizeof(addrs[0]));
+    return dnscache_addrinfo_dup(link_addrinfo(nodes, addrs, q->nresult, w->port));
+}
+
+void
+resolver_query_free(struct resolver_query *w) {
+    if (w == NULL) {
+        return;
+    }
+    struct dns_query *q = w->query;
+    struct resolver_query **p = &q->waiters;
+    while (*p != w) {
+        p = &(*p)->next;
+    }
+    *p = w->next;
+    free(w);
+
+    // una consulta en curso sigue sola hasta terminar y llenar el cache
+    if (q->waiters == NULL && (q->status != RESOLVER_PENDING || q->fd < 0)) {
+        query_free(q);
+    }
+}
+
+void
+resolver_get_stats(struct resolver_stats *out) {
+    out->lookups   = atomic_load(&stats.lookups);
+    out->coalesced = atomic_load(&stats.coalesced);
+}
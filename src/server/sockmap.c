@@ -0,0 +1,250 @@
+/**
+ * sockmap.c - Relay en el kernel con BPF sockmap
+ *
+ * Sin libbpf: los dos programas son unas pocas instrucciones armadas a mano
+ * y se cargan con la syscall bpf(2), como hace el selector con io_uring.
+ *
+ * El mapa es un SOCKHASH indexado por el cookie del socket *par*: el socket
+ * del origen se guarda con el cookie del cliente y viceversa. Así el
+ * programa de veredicto solo tiene que pedir el cookie del socket por el
+ * que llegó el segmento y redirigirlo a la salida del que encuentre.
+ *
+ *   r6 = r1                          ; contexto (__sk_buff)
+ *   r0 = bpf_get_socket_cookie(r1)
+ *   *(u64 *)(r10 - 8) = r0
+ *   return bpf_sk_redirect_hash(r6, &sockhash, r10 - 8, 0)
+ *
+ * Los kernels sin BPF_SK_SKB_VERDICT (anteriores a 5.13) necesitan además un
+ * parser de stream, que devuelve el segmento entero como un mensaje.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "sockmap.h"
+#include "logger.h"
+
+#ifdef __linux__
+
+#include <unistd.h>
+#include <stddef.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/tcp.h>
+
+#ifndef SO_COOKIE
+#define SO_COOKIE 57
+#endif
+
+#define INSN(c, d, s, o, i) \
+    ((struct bpf_insn) { .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+
+static int map_fd     = -1;
+static int verdict_fd = -1;
+static int parser_fd  = -1;
+
+static long
+sys_bpf(int cmd, union bpf_attr *attr) {
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int
+prog_load(const struct bpf_insn *insns, unsigned n) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_SK_SKB;
+    attr.insns     = (uint64_t)(uintptr_t)insns;
+    attr.insn_cnt  = n;
+    attr.license   = (uint64_t)(uintptr_t)"Dual MIT/GPL";
+    return (int)sys_bpf(BPF_PROG_LOAD, &attr);
+}
+
+static bool
+prog_attach(int prog, enum bpf_attach_type type) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.target_fd     = map_fd;
+    attr.attach_bpf_fd = prog;
+    attr.attach_type   = type;
+    return sys_bpf(BPF_PROG_ATTACH, &attr) == 0;
+}
+
+static bool
+socket_cookie(int fd, uint64_t *cookie) {
+    socklen_t len = sizeof(*cookie);
+    return getsockopt(fd, SOL_SOCKET, SO_COOKIE, cookie, &len) == 0;
+}
+
+static bool
+map_update(uint64_t key, int fd) {
+    union bpf_attr attr;
+    uint32_t value = (uint32_t)fd;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = map_fd;
+    attr.key    = (uint64_t)(uintptr_t)&key;
+    attr.value  = (uint64_t)(uintptr_t)&value;
+    attr.flags  = BPF_NOEXIST;
+    return sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) == 0;
+}
+
+static void
+map_delete(uint64_t key) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = map_fd;
+    attr.key    = (uint64_t)(uintptr_t)&key;
+    sys_bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+bool
+sockmap_init(void) {
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type    = BPF_MAP_TYPE_SOCKHASH;
+    attr.key_size    = sizeof(uint64_t);
+    attr.value_size  = sizeof(uint32_t);
+    attr.max_entries = SOCKMAP_MAX_ENTRIES;
+    map_fd = (int)sys_bpf(BPF_MAP_CREATE, &attr);
+    if (map_fd < 0) {
+        LOG_WARN("Kernel relay unavailable (sockmap): %s", strerror(errno));
+        return false;
+    }
+
+    const struct bpf_insn verdict[] = {
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+        INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_get_socket_cookie),
+        INSN(BPF_STX | BPF_MEM | BPF_DW, BPF_REG_10, BPF_REG_0, -8, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0),
+        INSN(BPF_LD | BPF_IMM | BPF_DW, BPF_REG_2, BPF_PSEUDO_MAP_FD, 0, map_fd),
+        INSN(0, 0, 0, 0, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0),
+        INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -8),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0),
+        INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_redirect_hash),
+        INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    };
+    verdict_fd = prog_load(verdict, sizeof(verdict) / sizeof(verdict[0]));
+    if (verdict_fd < 0) {
+        LOG_WARN("Kernel relay unavailable (verdict program): %s", strerror(errno));
+        sockmap_destroy();
+        return false;
+    }
+
+    if (!prog_attach(verdict_fd, BPF_SK_SKB_VERDICT)) {
+        const struct bpf_insn parser[] = {
+            INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_0, BPF_REG_1, offsetof(struct __sk_buff, len), 0),
+            INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+        };
+        parser_fd = prog_load(parser, sizeof(parser) / sizeof(parser[0]));
+        if (parser_fd < 0 || !prog_attach(parser_fd, BPF_SK_SKB_STREAM_PARSER)
+            || !prog_attach(verdict_fd, BPF_SK_SKB_STREAM_VERDICT)) {
+            LOG_WARN("Kernel relay unavailable (attach): %s", strerror(errno));
+            sockmap_destroy();
+            return false;
+        }
+    }
+
+    LOG_INFO("Kernel relay (BPF sockmap) enabled");
+    return true;
+}
+
+void
+sockmap_destroy(void) {
+    int *fds[] = { &verdict_fd, &parser_fd, &map_fd };
+    for (unsigned i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        if (*fds[i] >= 0) {
+            close(*fds[i]);
+            *fds[i] = -1;
+        }
+    }
+}
+
+bool
+sockmap_enabled(void) {
+    return map_fd >= 0;
+}
+
+bool
+sockmap_pair(int a, int b) {
+    uint64_t cookie_a, cookie_b;
+
+    if (map_fd < 0 || !socket_cookie(a, &cookie_a) || !socket_cookie(b, &cookie_b)) {
+        return false;
+    }
+    if (!map_update(cookie_a, b)) {
+        LOG_DEBUG("sockmap update failed: %s", strerror(errno));
+        return false;
+    }
+    if (!map_update(cookie_b, a)) {
+        LOG_DEBUG("sockmap update failed: %s", strerror(errno));
+        map_delete(cookie_a);
+        return false;
+    }
+    return true;
+}
+
+bool
+sockmap_bytes_received(int fd, uint64_t *bytes) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+
+    memset(&info, 0, sizeof(info));
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0
+        || len < offsetof(struct tcp_info, tcpi_bytes_received) + sizeof(info.tcpi_bytes_received)) {
+        return false;
+    }
+    *bytes = info.tcpi_bytes_received;
+
+    // el FIN del otro extremo ocupa un número de secuencia y el kernel lo
+    // suma como si fuera un byte
+    switch (info.tcpi_state) {
+        case BPF_TCP_CLOSE_WAIT:
+        case BPF_TCP_LAST_ACK:
+        case BPF_TCP_CLOSING:
+        case BPF_TCP_TIME_WAIT:
+            if (*bytes > 0) {
+                (*bytes)--;
+            }
+            break;
+        default:
+            break;
+    }
+    return true;
+}
+
+#else
+
+bool
+sockmap_init(void) {
+    LOG_WARN("Kernel relay (BPF sockmap) is not supported on this platform");
+    return false;
+}
+
+void
+sockmap_destroy(void) {
+}
+
+bool
+sockmap_enabled(void) {
+    return false;
+}
+
+bool
+sockmap_pair(int a, int b) {
+    (void)a;
+    (void)b;
+    return false;
+}
+
+bool
+sockmap_bytes_received(int fd, uint64_t *bytes) {
+    (void)fd;
+    (void)bytes;
+    return false;
+}
+
+#endif
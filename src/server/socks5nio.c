@@ -8,7 +8,8 @@
  * Arquitectura:
  *   - Máquina de estados finitos usando stm.c
  *   - I/O no bloqueante usando selector.c
- *   - Resolución DNS asíncrona en thread worker
+ *   - Resolución DNS no bloqueante con el resolvedor stub (resolver.c), en
+ *     el mismo selector
  *
  * Estados de la FSM:
  *   HELLO_READ    -> Lee el mensaje de saludo del cliente
@@ -23,6 +24,9 @@
  *   DONE          -> Conexión terminada exitosamente
  *   ERROR         -> Error, cerrar conexión
  */
+#ifdef __linux__
+#define _GNU_SOURCE     // accept4
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -30,14 +34,20 @@
 #include <errno.h>
 #include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <stdatomic.h>
 
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "buffer.h"
+#include "ring.h"
 #include "stm.h"
 #include "selector.h"
 #include "socks5nio.h"
@@ -45,11 +55,69 @@
 #include "users.h"
 #include "metrics.h"
 #include "logger.h"
+#include "dnscache.h"
+#include "resolver.h"
+#include "sockmap.h"
+#include "bufpool.h"
+#include "tuning.h"
+#include "intern.h"
 
 #define N(x) (sizeof(x)/sizeof((x)[0]))
 
-// Tamaño de buffers de I/O
+#define CACHE_LINE 64
+
+// Estructuras de conexión preasignadas por reactor, y tamaño de las páginas
+// grandes para el slab
+#define CONN_SLAB_CAPACITY   1024
+#define HUGE_PAGE_SIZE       (2 * 1024 * 1024)
+
+// Tamaño de buffers de I/O: el de la copia, y los del handshake (el mensaje
+// más largo es el AUTH, de 513 bytes; la respuesta más larga, la del
+// REQUEST, de 10)
 #define BUFFER_SIZE 4096
+#define HANDSHAKE_READ_SIZE  1024
+#define HANDSHAKE_WRITE_SIZE 64
+
+// Buffers adaptables de la copia: cada dirección duplica su buffer después
+// de llenarlo RELAY_GROW_STREAK lecturas seguidas, hasta su tope, y vuelve
+// al inicial si pasa un tick (RELAY_SHRINK_MS) sin llenarse
+#define RELAY_UPLOAD_MAX     (64 * 1024)
+#define RELAY_DOWNLOAD_MAX   (256 * 1024)
+#define RELAY_GROW_STREAK    2
+#define RELAY_SHRINK_MS      2000
+#define RELAY_MEMORY_CAP     (256 * 1024 * 1024)
+
+// Presupuesto de cada conexión por vuelta del reactor: lecturas y bytes que
+// puede copiar al atender un aviso, multiplicados por su peso (perfil de
+// tuning). Lo que queda lo vuelve a avisar el selector en la vuelta
+// siguiente, después de atender al resto
+#define COPY_TURN_READS      4
+#define COPY_TURN_BYTES      (64 * 1024)
+
+// Plazos (ms): handshake completo, resolución DNS, conexión al origen (todos
+// los intentos), e inactividad durante la copia
+#define HANDSHAKE_TIMEOUT_MS (10 * 1000)
+#define RESOLVE_TIMEOUT_MS   (10 * 1000)
+#define CONNECT_TIMEOUT_MS   (10 * 1000)
+#define IDLE_TIMEOUT_MS      (5 * 60 * 1000)
+
+// Happy Eyeballs (RFC 8305): demora por defecto entre intentos de conexión
+// en paralelo, y máximo de intentos simultáneos
+#define CONNECT_DELAY_MS     250
+#define CONNECT_MAX_ATTEMPTS 8
+
+// Conexiones aceptadas por defecto en cada aviso del socket pasivo
+#define ACCEPT_BATCH         64
+
+// Pipes libres que guarda cada reactor para el relay con splice
+#define PIPE_POOL_MAX        64
+
+// Puerto de POP3, el protocolo cuyas credenciales miran los disectores
+#define POP3_PORT            110
+
+// Período (ms) con el que se cosechan los contadores de un túnel que copia
+// el kernel (sockmap)
+#define SOCKMAP_HARVEST_MS   1000
 
 // ============================================================================
 // Constantes del protocolo SOCKS5 (RFC 1928)
@@ -152,77 +220,194 @@ struct request_st {
 };
 
 // Estado COPY (streaming bidireccional)
+/**
+ * Pipe del kernel por el que pasan los bytes de una dirección en el relay
+ * con splice (socket -> pipe -> socket, sin copiarlos a userspace).
+ */
+struct relay_pipe {
+    int fds[2];
+    /** capacidad del pipe */
+    size_t size;
+    /** bytes que están en el pipe esperando salir */
+    size_t pending;
+};
+
 struct copy_st {
-    buffer *rb, *wb;
+    ring *rb, *wb;
     fd_interest interests;
     
     // Para la otra dirección
     struct copy_st *other;
     
+    // Modo splice: lo que hay que escribir en este fd espera en `pipe'
+    // (después de lo que haya quedado en `wb')
+    struct relay_pipe pipe;
+    
     // Control de flujo
     bool shutdown_read;
     bool shutdown_write;
 };
 
+/**
+ * Tamaño adaptable de una dirección de la copia.
+ */
+struct relay_sizing {
+    /** tamaño del próximo bloque que se pida */
+    size_t size;
+    /** tope de la dirección */
+    size_t max;
+    /** lecturas seguidas que llenaron el buffer */
+    unsigned streak;
+    /** se llenó desde el último tick */
+    bool filled;
+};
+
 // ============================================================================
 // Estructura principal de conexión SOCKS5
 // ============================================================================
 
+/**
+ * Parte fría de la conexión: lo que solo se usa durante el handshake. Se
+ * pide aparte y se devuelve al pasar a COPY.
+ */
+struct socks5_handshake {
+    // Estados
+    union {
+        struct hello_st   hello;
+        struct auth_st    auth;
+        struct request_st request;
+    } client;
+    
+    // Resolución DNS
+    struct resolver_query *resolve_query;  // Resolución en curso (o NULL)
+    struct addrinfo *origin_resolution;
+    struct addrinfo *origin_resolution_current;  // Próxima dirección a probar
+    
+    // Intentos de conexión en carrera; el ganador pasa a origin_fd
+    int connect_fds[CONNECT_MAX_ATTEMPTS];
+    struct addrinfo *connect_ai[CONNECT_MAX_ATTEMPTS];
+    // con Fast Open: si se pidió, y cuántos bytes del cliente salieron en el SYN
+    bool connect_fast_open[CONNECT_MAX_ATTEMPTS];
+    size_t connect_sent[CONNECT_MAX_ATTEMPTS];
+    unsigned connect_n;
+    // errno del último intento que falló (0 si ninguno), para la respuesta
+    int connect_error;
+    
+    // Perfil de opciones de socket: el aplicado al cliente al aceptar, y el
+    // elegido para la conexión al conectar al origen
+    int tuning_id;
+    struct tuning_profile tuning;
+    
+    // Lista libre, y si salió del slab (si no, de malloc)
+    struct socks5_handshake *next;
+    bool slab;
+};
+
+/**
+ * Conexión SOCKS5. Adelante, alineado a la línea de cache, lo que toca cada
+ * evento de la copia; atrás lo que se usa al abrir y cerrar.
+ */
 struct socks5 {
     // File descriptors
-    int client_fd;    // Socket del cliente SOCKS
-    int origin_fd;    // Socket al servidor de origen
-    
-    // Información del cliente
-    struct sockaddr_storage client_addr;
-    socklen_t client_addr_len;
-    
-    // Información de autenticación
-    char username[256];
-    
-    // Información del destino
-    char target_host[256];
-    uint16_t target_port;
-    
-    // Buffers de I/O
-    uint8_t raw_buff_read[BUFFER_SIZE];
-    uint8_t raw_buff_write[BUFFER_SIZE];
-    buffer read_buffer;
-    buffer write_buffer;
+    _Alignas(CACHE_LINE) int client_fd;  // Socket del cliente SOCKS
+    int origin_fd;                       // Socket al servidor de origen
     
     // Máquina de estados
     struct state_machine stm;
     
-    // Estados
+    // Buffers de I/O: lineales en el handshake (los parsers leen cada
+    // mensaje contiguo) y anillos en la copia, que usan siempre la capacidad
+    // entera sin compactar. Los bloques salen del pool y en la copia se
+    // devuelven apenas se vacían (sin bloque, `data' es NULL)
     union {
-        struct hello_st   hello;
-        struct auth_st    auth;
-        struct request_st request;
-        struct copy_st    copy;
-    } client;
+        struct {
+            buffer read_buffer;
+            buffer write_buffer;
+        };
+        struct {
+            ring read_ring;   // cliente -> origen
+            ring write_ring;  // origen -> cliente
+        };
+    };
     
+    // Copia, una por dirección
+    struct copy_st client_copy;
     struct copy_st origin_copy;
     
-    // Resolución DNS
-    struct addrinfo *origin_resolution;
-    struct addrinfo *origin_resolution_current;
+    // Tamaño de `read_ring' y `write_ring' en la copia; el timer del origen marca los ticks para achicar
+    struct relay_sizing upload;
+    struct relay_sizing download;
+    bool relay_tick;
+    
+    // La copia usa splice (los pipes están en `client_copy' y `origin_copy')
+    bool splice;
+    
+    // La copia la hace el kernel (sockmap); últimos tcpi_bytes_received
+    // cosechados de cada socket
+    bool sockmap;
+    
+    // La copia la hace el selector por completitud (io_uring), y si alguna
+    // dirección falló
+    bool relay;
+    bool relay_failed;
+    
+    // Peso en el presupuesto de la copia (ver COPY_TURN_READS)
+    uint8_t weight;
+    uint64_t sockmap_client_bytes;
+    uint64_t sockmap_origin_bytes;
     
     // Métricas de la conexión
     uint64_t bytes_sent;
     uint64_t bytes_recv;
     
-    // Pool para reutilización
+    // Handshake en curso, o NULL desde COPY
+    struct socks5_handshake *hs;
+    
+    // Usuario autenticado y destino, compartidos con `intern_get' (o NULL)
+    const char *username;
+    const char *target_host;
+    uint16_t target_port;
+    
+    // Información del cliente
+    struct sockaddr_storage client_addr;
+    socklen_t client_addr_len;
+    
+    // Lista libre, y si salió del slab (si no, de malloc)
     struct socks5 *next;
+    bool slab;
     unsigned references;
 };
 
 // ============================================================================
-// Pool de conexiones para reutilización
+// Slab de conexiones
 // ============================================================================
 
-static unsigned pool_size = 0;
-static const unsigned max_pool = 50;
-static struct socks5 *pool = NULL;
+// Cada reactor reserva al arrancar un bloque con `slab_capacity' estructuras
+// socks5 y otras tantas de handshake, con las páginas ya cargadas, y las
+// reparte desde sus listas libres. Una conexión vive siempre en el reactor
+// (thread) que la aceptó, así que las listas no se sincronizan. Si se
+// agotan se sigue con malloc.
+static size_t slab_capacity = CONN_SLAB_CAPACITY;
+static bool slab_huge_pages = false;
+
+static _Thread_local struct socks5 *pool = NULL;
+static _Thread_local struct socks5_handshake *hs_pool = NULL;
+
+/** encabezado de cada bloque, al principio del mapeo */
+struct conn_slab {
+    struct conn_slab *next;
+    size_t len;
+};
+
+// Los bloques de todos los reactores se liberan recién al final: el thread
+// principal cierra las conexiones que quedaron al destruir los selectores
+static pthread_mutex_t slabs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct conn_slab *slabs = NULL;
+
+static atomic_size_t slab_total = 0;
+static atomic_size_t slab_in_use = 0;
+static atomic_size_t slab_high_water = 0;
+static atomic_uint_fast64_t slab_overflow = 0;
 
 // ============================================================================
 // Declaraciones forward
@@ -231,13 +416,17 @@ static struct socks5 *pool = NULL;
 static void socksv5_read(struct selector_key *key);
 static void socksv5_write(struct selector_key *key);
 static void socksv5_block(struct selector_key *key);
+static void socksv5_timeout(struct selector_key *key);
+static void socksv5_relay(struct selector_key *key, ssize_t n);
 static void socksv5_close(struct selector_key *key);
 
 static const struct fd_handler socks5_handler = {
-    .handle_read   = socksv5_read,
-    .handle_write  = socksv5_write,
-    .handle_close  = socksv5_close,
-    .handle_block  = socksv5_block,
+    .handle_read    = socksv5_read,
+    .handle_write   = socksv5_write,
+    .handle_close   = socksv5_close,
+    .handle_block   = socksv5_block,
+    .handle_timeout = socksv5_timeout,
+    .handle_relay   = socksv5_relay,
 };
 
 // Forward declarations para estados
@@ -253,13 +442,16 @@ static void request_read_init(unsigned state, struct selector_key *key);
 static unsigned request_read(struct selector_key *key);
 static void request_resolving_init(unsigned state, struct selector_key *key);
 static unsigned request_resolving_done(struct selector_key *key);
+static unsigned request_resolving_timeout(struct selector_key *key);
 static void request_connecting_init(unsigned state, struct selector_key *key);
 static unsigned request_connecting(struct selector_key *key);
+static unsigned request_connecting_timeout(struct selector_key *key);
 static unsigned request_write(struct selector_key *key);
 
 static void copy_init(unsigned state, struct selector_key *key);
 static unsigned copy_read(struct selector_key *key);
 static unsigned copy_write(struct selector_key *key);
+static unsigned copy_timeout(struct selector_key *key);
 
 // ============================================================================
 // Definición de la tabla de estados
@@ -293,11 +485,13 @@ static const struct state_definition client_statbl[] = {
         .state            = REQUEST_RESOLVING,
         .on_arrival       = request_resolving_init,
         .on_block_ready   = request_resolving_done,
+        .on_timeout       = request_resolving_timeout,
     },
     {
         .state            = REQUEST_CONNECTING,
         .on_arrival       = request_connecting_init,
         .on_write_ready   = request_connecting,
+        .on_timeout       = request_connecting_timeout,
     },
     {
         .state            = REQUEST_WRITE,
@@ -308,6 +502,7 @@ static const struct state_definition client_statbl[] = {
         .on_arrival       = copy_init,
         .on_read_ready    = copy_read,
         .on_write_ready   = copy_write,
+        .on_timeout       = copy_timeout,
     },
     {
         .state            = DONE,
@@ -317,6 +512,26 @@ static const struct state_definition client_statbl[] = {
     },
 };
 
+/**
+ * Plazo de cada estado. El timer vive en el fd del cliente y se rearma solo
+ * al pasar a un estado con otro plazo, así que el de handshake cubre todos
+ * sus estados juntos. En COPY se rearma con cada evento (inactividad).
+ * Los estados sin `on_timeout' cierran la conexión al vencer.
+ */
+static const unsigned state_timeouts[] = {
+    [HELLO_READ]         = HANDSHAKE_TIMEOUT_MS,
+    [HELLO_WRITE]        = HANDSHAKE_TIMEOUT_MS,
+    [AUTH_READ]          = HANDSHAKE_TIMEOUT_MS,
+    [AUTH_WRITE]         = HANDSHAKE_TIMEOUT_MS,
+    [REQUEST_READ]       = HANDSHAKE_TIMEOUT_MS,
+    [REQUEST_RESOLVING]  = RESOLVE_TIMEOUT_MS,
+    [REQUEST_CONNECTING] = CONNECT_TIMEOUT_MS,
+    [REQUEST_WRITE]      = HANDSHAKE_TIMEOUT_MS,
+    [COPY]               = IDLE_TIMEOUT_MS,
+    [DONE]               = 0,
+    [ERROR]              = 0,
+};
+
 // ============================================================================
 // Funciones de gestión de conexiones
 // ============================================================================
@@ -324,32 +539,135 @@ static const struct state_definition client_statbl[] = {
 #define ATTACHMENT(key) ((struct socks5 *)(key)->data)
 
 /**
- * Crea una nueva estructura socks5 (o la obtiene del pool)
+ * Obtiene la parte del handshake (del pool, o nueva). Los estados
+ * inicializan su parte de la unión al entrar, así que no hace falta
+ * blanquearla entera.
+ */
+static struct socks5_handshake *
+socks5_handshake_new(void) {
+    struct socks5_handshake *hs;
+    
+    if (hs_pool != NULL) {
+        hs = hs_pool;
+        hs_pool = hs_pool->next;
+    } else {
+        hs = malloc(sizeof(*hs));
+        if (hs == NULL) {
+            return NULL;
+        }
+        hs->slab = false;
+    }
+    hs->resolve_query = NULL;
+    hs->origin_resolution = NULL;
+    hs->origin_resolution_current = NULL;
+    hs->connect_n = 0;
+    hs->connect_error = 0;
+    return hs;
+}
+
+/**
+ * Libera lo que quede de la resolución y devuelve la parte del handshake al
+ * pool. Los intentos de conexión ya tienen que estar cerrados.
+ */
+static void
+socks5_handshake_free(struct socks5 *s) {
+    struct socks5_handshake *hs = s->hs;
+    
+    if (hs == NULL) {
+        return;
+    }
+    s->hs = NULL;
+    
+    if (hs->resolve_query != NULL) {
+        resolver_query_free(hs->resolve_query);
+    }
+    if (hs->origin_resolution != NULL) {
+        dnscache_freeaddrinfo(hs->origin_resolution);
+    }
+    
+    if (hs->slab) {
+        hs->next = hs_pool;
+        hs_pool = hs;
+    } else {
+        free(hs);
+    }
+}
+
+/**
+ * Anota una estructura más en uso del slab, y el máximo alcanzado.
+ */
+static void
+slab_taken(void) {
+    const size_t in_use = atomic_fetch_add(&slab_in_use, 1) + 1;
+    size_t high = atomic_load(&slab_high_water);
+    while (in_use > high && !atomic_compare_exchange_weak(&slab_high_water, &high, in_use)) {
+        // `high' quedó con el valor actual
+    }
+}
+
+/**
+ * Devuelve una estructura socks5 al slab (o a malloc).
+ */
+static void
+socks5_release(struct socks5 *s) {
+    if (s->slab) {
+        atomic_fetch_sub(&slab_in_use, 1);
+        s->next = pool;
+        pool = s;
+    } else {
+        free(s);
+    }
+}
+
+/**
+ * Crea una nueva estructura socks5 (del slab, o con malloc si se agotó)
  */
 static struct socks5 *
 socks5_new(int client_fd) {
     struct socks5 *s;
+    bool slab = pool != NULL;
     
-    if (pool != NULL) {
+    if (slab) {
         s = pool;
         pool = pool->next;
-        pool_size--;
+        slab_taken();
     } else {
-        s = malloc(sizeof(*s));
+        s = aligned_alloc(CACHE_LINE, sizeof(*s));
         if (s == NULL) {
             return NULL;
         }
+        if (slab_capacity > 0) {
+            atomic_fetch_add(&slab_overflow, 1);
+        }
     }
     
     memset(s, 0, sizeof(*s));
+    s->slab = slab;
+    
+    // Buffers y estado del handshake; los buffers de la copia se piden
+    // recién con datos
+    uint8_t *rdata = bufpool_get(HANDSHAKE_READ_SIZE);
+    uint8_t *wdata = bufpool_get(HANDSHAKE_WRITE_SIZE);
+    s->hs = socks5_handshake_new();
+    if (rdata == NULL || wdata == NULL || s->hs == NULL) {
+        bufpool_put(rdata, HANDSHAKE_READ_SIZE);
+        bufpool_put(wdata, HANDSHAKE_WRITE_SIZE);
+        socks5_handshake_free(s);
+        socks5_release(s);
+        return NULL;
+    }
+    buffer_init(&s->read_buffer, HANDSHAKE_READ_SIZE, rdata);
+    buffer_init(&s->write_buffer, HANDSHAKE_WRITE_SIZE, wdata);
     
     s->client_fd = client_fd;
     s->origin_fd = -1;
     s->references = 1;
     
-    // Inicializar buffers
-    buffer_init(&s->read_buffer, BUFFER_SIZE, s->raw_buff_read);
-    buffer_init(&s->write_buffer, BUFFER_SIZE, s->raw_buff_write);
+    s->upload.size    = BUFFER_SIZE;
+    s->upload.max     = RELAY_UPLOAD_MAX;
+    s->download.size  = BUFFER_SIZE;
+    s->download.max   = RELAY_DOWNLOAD_MAX;
+    s->weight         = 1;
     
     // Inicializar máquina de estados
     s->stm.initial   = HELLO_READ;
@@ -362,16 +680,226 @@ socks5_new(int client_fd) {
     return s;
 }
 
+// ============================================================================
+// Buffers de la conexión
+// ============================================================================
+
+/** bytes de buffers agrandados en todo el proceso, y su tope */
+static atomic_size_t relay_memory = 0;
+static size_t relay_memory_cap = RELAY_MEMORY_CAP;
+
+void
+socksv5_set_relay_memory_cap(size_t bytes) {
+    relay_memory_cap = bytes;
+}
+
+void
+socksv5_relay_stats(struct socksv5_relay_stats *stats) {
+    struct bufpool_stats bst;
+    bufpool_get_stats(&bst);
+    stats->in_use     = bst.in_use;
+    stats->cached     = bst.cached;
+    stats->memory     = atomic_load(&relay_memory);
+    stats->memory_cap = relay_memory_cap;
+}
+
+/**
+ * Cuenta un bloque de `size' bytes contra el tope de los agrandados (los de
+ * hasta BUFFER_SIZE no cuentan).
+ *
+ * @return false si no entra
+ */
+static bool
+relay_reserve(size_t size) {
+    if (size <= BUFFER_SIZE) {
+        return true;
+    }
+    if (atomic_fetch_add(&relay_memory, size) + size > relay_memory_cap) {
+        atomic_fetch_sub(&relay_memory, size);
+        return false;
+    }
+    return true;
+}
+
+static void
+relay_unreserve(size_t size) {
+    if (size > BUFFER_SIZE) {
+        atomic_fetch_sub(&relay_memory, size);
+    }
+}
+
+/**
+ * Le da a `r' (sin bloque) un bloque del pool de `size' bytes, o de
+ * BUFFER_SIZE si el agrandado no entra en el tope.
+ *
+ * @return false si no hay memoria
+ */
+static bool
+relay_acquire(ring *r, size_t size) {
+    if (!relay_reserve(size)) {
+        size = BUFFER_SIZE;
+    }
+    uint8_t *data = bufpool_get(size);
+    if (data == NULL) {
+        relay_unreserve(size);
+        return false;
+    }
+    ring_init(r, size, data);
+    return true;
+}
+
+/**
+ * Devuelve al pool el bloque de `r', si tiene.
+ */
+static void
+relay_release(ring *r) {
+    if (r->data != NULL) {
+        bufpool_put(r->data, r->size);
+        relay_unreserve(r->size);
+        memset(r, 0, sizeof(*r));
+    }
+}
+
+/**
+ * Pasa `r' a un bloque de `size' bytes, conservando lo que falta leer (que
+ * tiene que entrar).
+ *
+ * @return false si no hay memoria o el bloque no entra en el tope
+ */
+static bool
+relay_resize(ring *r, size_t size) {
+    if (!relay_reserve(size)) {
+        return false;
+    }
+    uint8_t *data = bufpool_get(size);
+    if (data == NULL) {
+        relay_unreserve(size);
+        return false;
+    }
+    
+    struct iovec iov[2];
+    const int cnt = ring_read_iov(r, iov);
+    size_t n = 0;
+    for (int i = 0; i < cnt; i++) {
+        memcpy(data + n, iov[i].iov_base, iov[i].iov_len);
+        n += iov[i].iov_len;
+    }
+    
+    bufpool_put(r->data, r->size);
+    relay_unreserve(r->size);
+    ring_init(r, size, data);
+    ring_write_adv(r, n);
+    return true;
+}
+
+/**
+ * Hay lugar para leer hacia `r': tiene lugar libre, o no tiene bloque y se
+ * le da uno al leer.
+ */
+static bool
+relay_can_fill(ring *r) {
+    return r->data == NULL || ring_can_write(r);
+}
+
+/**
+ * Devuelve al pool el bloque de un buffer del handshake.
+ */
+static void
+handshake_buffer_release(buffer *b) {
+    bufpool_put(b->data, b->limit - b->data);
+}
+
+// ============================================================================
+// Pipes para el relay con splice
+// ============================================================================
+
+/** usar splice en la copia */
+static bool zero_copy = false;
+/** los disectores quieren ver el payload */
+static bool dissectors = true;
+
+void
+socksv5_set_zero_copy(bool enabled) {
+    // con select(2) los 4 fds de pipes por conexión agotarían FD_SETSIZE
+#if defined(__linux__) && !defined(SELECTOR_USE_SELECT)
+    zero_copy = enabled;
+#else
+    if (enabled) {
+        LOG_WARN("splice relay is not supported on this build, using buffered relay");
+    }
+#endif
+}
+
+void
+socksv5_set_dissectors(bool enabled) {
+    dissectors = enabled;
+}
+
+// Pipes vacíos de conexiones anteriores, listos para reusar: crear un pipe
+// son dos fds y una llamada al sistema por dirección
+static _Thread_local struct relay_pipe pipe_pool[PIPE_POOL_MAX];
+static _Thread_local unsigned pipe_pool_n = 0;
+
+/**
+ * Saca un pipe del pool, o crea uno si está vacío.
+ *
+ * @return false si no se pudo crear
+ */
+static bool
+relay_pipe_get(struct relay_pipe *p) {
+    if (pipe_pool_n > 0) {
+        *p = pipe_pool[--pipe_pool_n];
+        return true;
+    }
+#ifdef __linux__
+    if (pipe2(p->fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        return false;
+    }
+    int size = fcntl(p->fds[1], F_GETPIPE_SZ);
+    p->size = size > 0 ? (size_t)size : 4096;
+    p->pending = 0;
+    return true;
+#else
+    (void)p;
+    return false;
+#endif
+}
+
 /**
- * Destruye una estructura socks5
+ * Devuelve un pipe al pool. Uno que quedó con datos (la conexión se cortó
+ * antes de vaciarlo) no se puede reusar y se cierra.
  */
 static void
-socks5_destroy_(struct socks5 *s) {
-    if (s->origin_resolution != NULL) {
-        freeaddrinfo(s->origin_resolution);
-        s->origin_resolution = NULL;
+relay_pipe_put(struct relay_pipe *p) {
+    if (p->pending == 0 && pipe_pool_n < PIPE_POOL_MAX) {
+        pipe_pool[pipe_pool_n++] = *p;
+    } else {
+        close(p->fds[0]);
+        close(p->fds[1]);
     }
-    free(s);
+}
+
+/**
+ * Los disectores necesitan ver los bytes de la conexión en userspace, así
+ * que no puede copiarlos el kernel.
+ */
+static bool
+copy_dissected(const struct socks5 *s) {
+    return dissectors && s->target_port == POP3_PORT;
+}
+
+static bool
+copy_use_splice(const struct socks5 *s) {
+    return zero_copy && !copy_dissected(s);
+}
+
+/**
+ * Con io_uring la copia la hace el selector por completitud (ver
+ * `selector_relay'), salvo que haya que ver los bytes.
+ */
+static bool
+copy_use_relay(const struct socks5 *s, fd_selector selector) {
+    return selector_get_engine(selector) == SELECTOR_ENGINE_URING && !copy_dissected(s);
 }
 
 /**
@@ -385,9 +913,9 @@ socks5_destroy(struct socks5 *s) {
     
     if (s->references == 1) {
         // Registrar acceso antes de destruir
-        log_access(s->username[0] ? s->username : NULL,
+        log_access(s->username,
                    (struct sockaddr *)&s->client_addr,
-                   s->target_host[0] ? s->target_host : NULL,
+                   s->target_host,
                    s->target_port,
                    stm_state(&s->stm) == DONE ? "OK" : "ERROR",
                    s->bytes_sent,
@@ -395,82 +923,384 @@ socks5_destroy(struct socks5 *s) {
         
         metrics_connection_closed();
         
-        if (pool_size < max_pool) {
-            s->next = pool;
-            pool = s;
-            pool_size++;
+        // socks5_new() blanquea la estructura: liberar antes de reciclar
+        if (s->hs != NULL) {
+            handshake_buffer_release(&s->read_buffer);
+            handshake_buffer_release(&s->write_buffer);
         } else {
-            socks5_destroy_(s);
+            relay_release(&s->read_ring);
+            relay_release(&s->write_ring);
+        }
+        socks5_handshake_free(s);
+        intern_put(s->username);
+        intern_put(s->target_host);
+        
+        if (s->splice) {
+            relay_pipe_put(&s->client_copy.pipe);
+            relay_pipe_put(&s->origin_copy.pipe);
+            s->splice = false;
         }
+        
+        socks5_release(s);
     } else {
         s->references--;
     }
 }
 
-void
-socksv5_pool_destroy(void) {
-    struct socks5 *next, *s;
-    for (s = pool; s != NULL; s = next) {
-        next = s->next;
-        free(s);
+/**
+ * Mapea `*len' bytes para un bloque del slab, con páginas grandes si se
+ * pidieron (redondeando `*len'), y carga las páginas.
+ */
+static void *
+slab_map(size_t *len) {
+    const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    void *base = MAP_FAILED;
+    
+#ifdef MAP_HUGETLB
+    if (slab_huge_pages) {
+        const size_t huge_len = (*len + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        base = mmap(NULL, huge_len, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+        if (base != MAP_FAILED) {
+            *len = huge_len;
+        } else {
+            LOG_DEBUG("No reserved huge pages for the connection slab: %s", strerror(errno));
+        }
     }
-    pool = NULL;
-    pool_size = 0;
+#endif
+    if (base == MAP_FAILED) {
+        base = mmap(NULL, *len, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (base == MAP_FAILED) {
+            return NULL;
+        }
+#ifdef MADV_HUGEPAGE
+        if (slab_huge_pages) {
+            // sin páginas reservadas, que las junte el kernel (THP)
+            madvise(base, *len, MADV_HUGEPAGE);
+        }
+#endif
+    }
+    
+    // cargar las páginas ahora y no en el primer accept que las toque
+    memset(base, 0, *len);
+    return base;
 }
 
-// ============================================================================
-// Accept de nuevas conexiones
-// ============================================================================
+void
+socksv5_set_slab(size_t capacity, bool huge_pages) {
+    slab_capacity = capacity;
+    slab_huge_pages = huge_pages;
+}
 
 void
-socksv5_passive_accept(struct selector_key *key) {
-    struct sockaddr_storage client_addr;
-    socklen_t client_addr_len = sizeof(client_addr);
-    struct socks5 *state = NULL;
+socksv5_pool_init(void) {
+    const size_t header = (sizeof(struct conn_slab) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
     
-    const int client = accept(key->fd, (struct sockaddr *)&client_addr, &client_addr_len);
-    if (client == -1) {
-        goto fail;
+    if (slab_capacity == 0) {
+        return;
     }
-    
-    if (selector_fd_set_nio(client) == -1) {
-        goto fail;
+    size_t len = header + slab_capacity * (sizeof(struct socks5) + sizeof(struct socks5_handshake));
+    struct conn_slab *slab = slab_map(&len);
+    if (slab == NULL) {
+        LOG_WARN("Unable to allocate the connection slab: %s", strerror(errno));
+        return;
     }
+    slab->len = len;
     
-    state = socks5_new(client);
-    if (state == NULL) {
-        goto fail;
+    struct socks5 *records = (struct socks5 *)((uint8_t *)slab + header);
+    struct socks5_handshake *handshakes = (struct socks5_handshake *)(records + slab_capacity);
+    for (size_t i = slab_capacity; i-- > 0; ) {
+        records[i].next = pool;
+        pool = records + i;
+        handshakes[i].slab = true;
+        handshakes[i].next = hs_pool;
+        hs_pool = handshakes + i;
     }
     
-    memcpy(&state->client_addr, &client_addr, client_addr_len);
-    state->client_addr_len = client_addr_len;
-    
-    char client_str[SOCKADDR_TO_HUMAN_MIN];
-    sockaddr_to_human(client_str, sizeof(client_str), (struct sockaddr *)&client_addr);
-    LOG_DEBUG("New connection from %s", client_str);
+    pthread_mutex_lock(&slabs_mutex);
+    slab->next = slabs;
+    slabs = slab;
+    pthread_mutex_unlock(&slabs_mutex);
+    atomic_fetch_add(&slab_total, slab_capacity);
+}
+
+void
+socksv5_slab_stats(struct socksv5_slab_stats *stats) {
+    stats->capacity   = atomic_load(&slab_total);
+    stats->in_use     = atomic_load(&slab_in_use);
+    stats->high_water = atomic_load(&slab_high_water);
+    stats->overflow   = atomic_load(&slab_overflow);
+}
+
+void
+socksv5_slabs_destroy(void) {
+    pthread_mutex_lock(&slabs_mutex);
+    struct conn_slab *next;
+    for (struct conn_slab *slab = slabs; slab != NULL; slab = next) {
+        next = slab->next;
+        munmap(slab, slab->len);
+    }
+    slabs = NULL;
+    pthread_mutex_unlock(&slabs_mutex);
+    atomic_store(&slab_total, 0);
+}
+
+void
+socksv5_pool_destroy(void) {
+    // las estructuras libres son del slab, que se libera aparte
+    pool = NULL;
+    hs_pool = NULL;
     
-    if (SELECTOR_SUCCESS != selector_register(key->s, client, &socks5_handler,
-                                               OP_READ, state)) {
-        goto fail;
+    for (unsigned i = 0; i < pipe_pool_n; i++) {
+        close(pipe_pool[i].fds[0]);
+        close(pipe_pool[i].fds[1]);
     }
-    return;
+    pipe_pool_n = 0;
     
-fail:
-    if (client != -1) {
-        close(client);
-    }
-    socks5_destroy(state);
+    bufpool_thread_destroy();
 }
 
 // ============================================================================
-// Estado HELLO (RFC 1928 Section 3)
+// Accept de nuevas conexiones
+// ============================================================================
+
+/** TCP Fast Open: datos en el SYN del cliente y hacia los orígenes */
+static bool fast_open = false;
+
+void
+socksv5_set_fast_open(bool enabled) {
+#ifdef TCP_FASTOPEN_CONNECT
+    fast_open = enabled;
+#else
+    if (enabled) {
+        LOG_WARN("TCP_FASTOPEN_CONNECT is not supported on this platform");
+    }
+#endif
+}
+
+/**
+ * @return true si el SYN de `fd' llevó datos y el otro extremo los aceptó
+ */
+static bool
+fast_open_syn_data(int fd) {
+#ifdef TCPI_OPT_SYN_DATA
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    
+    return getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0
+        && (info.tcpi_options & TCPI_OPT_SYN_DATA) != 0;
+#else
+    (void)fd;
+    return false;
+#endif
+}
+
+/**
+ * Conexiones que se aceptan como máximo cada vez que el socket pasivo está
+ * listo. Se configura una vez antes de arrancar los reactores.
+ */
+static unsigned accept_batch = ACCEPT_BATCH;
+
+void
+socksv5_set_accept_batch(unsigned n) {
+    accept_batch = n;
+}
+
+/**
+ * Arma el estado de una conexión recién aceptada (ya no bloqueante) y la
+ * registra en el selector del socket pasivo `key'. Si no puede, la cierra.
+ */
+static void
+socksv5_accepted(struct selector_key *key, int client,
+                 const struct sockaddr_storage *client_addr, socklen_t client_addr_len) {
+    struct socks5 *state = socks5_new(client);
+    if (state == NULL) {
+        goto fail;
+    }
+    
+    memcpy(&state->client_addr, client_addr, client_addr_len);
+    state->client_addr_len = client_addr_len;
+    state->hs->tuning_id = tuning_for_listener(&state->hs->tuning);
+    tuning_apply(client, &state->hs->tuning);
+    if (fast_open && fast_open_syn_data(client)) {
+        metrics_fast_open_accepted();
+    }
+    
+    char client_str[SOCKADDR_TO_HUMAN_MIN];
+    sockaddr_to_human(client_str, sizeof(client_str), (const struct sockaddr *)client_addr);
+    LOG_DEBUG("New connection from %s", client_str);
+    
+    if (SELECTOR_SUCCESS != selector_register(key->s, client, &socks5_handler,
+                                               OP_READ, state)) {
+        goto fail;
+    }
+    selector_set_timeout(key->s, client, state_timeouts[HELLO_READ]);
+    
+    // I/O optimista: el HELLO suele estar ya en el socket
+    struct selector_key client_key = {
+        .s    = key->s,
+        .fd   = client,
+        .data = state,
+    };
+    socksv5_read(&client_key);
+    return;
+    
+fail:
+    close(client);
+    socks5_destroy(state);
+}
+
+/**
+ * Acepta una conexión y le arma su estado.
+ *
+ * @return false si no hay más conexiones pendientes (o no se pueden aceptar
+ *         por ahora, por ejemplo por falta de fds)
+ */
+static bool
+socksv5_accept_one(struct selector_key *key) {
+    struct sockaddr_storage client_addr;
+    socklen_t client_addr_len = sizeof(client_addr);
+    
+#ifdef __linux__
+    const int client = accept4(key->fd, (struct sockaddr *)&client_addr, &client_addr_len,
+                               SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    const int client = accept(key->fd, (struct sockaddr *)&client_addr, &client_addr_len);
+#endif
+    if (client == -1) {
+        // el cliente abortó antes de que lo aceptáramos: seguir con el resto
+        return errno == ECONNABORTED || errno == EINTR;
+    }
+    
+#ifndef __linux__
+    if (selector_fd_set_nio(client) == -1) {
+        close(client);
+        return true;
+    }
+#endif
+    
+    socksv5_accepted(key, client, &client_addr, client_addr_len);
+    return true;
+}
+
+void
+socksv5_accept(struct selector_key *key, int fd) {
+    struct sockaddr_storage client_addr;
+    socklen_t client_addr_len = sizeof(client_addr);
+    
+    // el accept multishot no trae la dirección del cliente
+    if (getpeername(fd, (struct sockaddr *)&client_addr, &client_addr_len) == -1) {
+        close(fd);
+        return;
+    }
+    socksv5_accepted(key, fd, &client_addr, client_addr_len);
+}
+
+/**
+ * Acepta hasta `accept_batch' conexiones por aviso, para vaciar la cola del
+ * kernel en una ráfaga sin pasar por el selector una vez por conexión.
+ */
+void
+socksv5_passive_accept(struct selector_key *key) {
+    for (unsigned i = 0; i < accept_batch; i++) {
+        if (!socksv5_accept_one(key)) {
+            break;
+        }
+    }
+}
+
+// ============================================================================
+// Estado HELLO (RFC 1928 Section 3)
 // ============================================================================
 
+/*
+ * Los clientes pueden mandar HELLO, AUTH, REQUEST y los primeros bytes de la
+ * conexión en un solo segmento, sin esperar cada respuesta. El buffer de
+ * lectura se comparte entre los estados y nunca se vacía al cambiar de
+ * estado: cada `*_parse' consume solo su mensaje, y lo que sobra lo procesa
+ * el estado siguiente, que lee apenas se mandó la respuesta (ver
+ * `socksv5_optimistic'). Lo que queda después del REQUEST se reenvía al
+ * origen al entrar en COPY.
+ */
+
+/**
+ * Lee del cliente lo que haya, sin esperar, al final de `b'.
+ *
+ * @return false si el cliente cerró la conexión o hubo un error
+ */
+static bool
+handshake_recv(struct selector_key *key, buffer *b) {
+    size_t count;
+    uint8_t *ptr;
+    ssize_t n;
+    
+    buffer_compact(b);
+    ptr = buffer_write_ptr(b, &count);
+    if (count == 0) {
+        // lleno: ningún mensaje del handshake ocupa tanto, ya está entero
+        return true;
+    }
+    
+    n = recv(key->fd, ptr, count, 0);
+    if (n > 0) {
+        buffer_write_adv(b, n);
+        return true;
+    }
+    return n < 0 && errno == EAGAIN;
+}
+
+/**
+ * Lectura de un estado del handshake: primero se intenta `parse' con lo que
+ * ya está en el buffer, y solo si le falta el mensaje se lee del cliente.
+ * Así un mensaje que llegó pipelineado se procesa aunque el cliente ya haya
+ * cerrado su lado (el recv daría 0); el cierre es un error solo si el
+ * mensaje quedó incompleto.
+ *
+ * @param state el estado de lectura, que `parse' retorna si le falta el mensaje
+ */
+static unsigned
+handshake_read(struct selector_key *key, buffer *b,
+               unsigned (*parse)(struct selector_key *key), unsigned state) {
+    const unsigned st = parse(key);
+    if (st != state) {
+        return st;
+    }
+    if (!handshake_recv(key, b)) {
+        return ERROR;
+    }
+    return parse(key);
+}
+
+/**
+ * Manda al cliente lo que quede en `b'. Solo si el socket no acepta todo se
+ * registra el interés de escritura, para terminar cuando el selector avise.
+ *
+ * @return false si hubo un error
+ */
+static bool
+handshake_send(struct selector_key *key, int fd, buffer *b) {
+    size_t count;
+    uint8_t *ptr;
+    ssize_t n;
+    
+    ptr = buffer_read_ptr(b, &count);
+    n = send(fd, ptr, count, MSG_NOSIGNAL);
+    if (n > 0) {
+        buffer_read_adv(b, n);
+    } else if (n == 0 || errno != EAGAIN) {
+        return false;
+    }
+    
+    if (buffer_can_read(b)) {
+        return SELECTOR_SUCCESS == selector_set_interest(key->s, fd, OP_WRITE);
+    }
+    return true;
+}
+
 static void
 hello_read_init(unsigned state, struct selector_key *key) {
     (void)state;
     struct socks5 *s = ATTACHMENT(key);
-    struct hello_st *d = &s->client.hello;
+    struct hello_st *d = &s->hs->client.hello;
     
     d->rb = &s->read_buffer;
     d->wb = &s->write_buffer;
@@ -487,70 +1317,47 @@ hello_read_init(unsigned state, struct selector_key *key) {
  *   +----+----------+----------+
  */
 static unsigned
-hello_read(struct selector_key *key) {
+hello_parse(struct selector_key *key) {
     struct socks5 *s = ATTACHMENT(key);
-    struct hello_st *d = &s->client.hello;
-    uint8_t *ptr;
-    size_t count;
-    ssize_t n;
-    
-    ptr = buffer_write_ptr(d->rb, &count);
-    n = recv(key->fd, ptr, count, 0);
+    struct hello_st *d = &s->hs->client.hello;
     
-    if (n <= 0) {
+    const uint8_t *ptr = buffer_peek(d->rb, 1);
+    if (ptr != NULL && ptr[0] != SOCKS_VERSION) {
+        LOG_WARN("Invalid SOCKS version: %d", ptr[0]);
         return ERROR;
     }
     
-    buffer_write_adv(d->rb, n);
-    
-    // Intentar parsear el mensaje
-    if (!buffer_can_read(d->rb)) {
-        return HELLO_READ;
-    }
-    
-    // Leer versión
-    uint8_t version = buffer_read(d->rb);
-    if (version != SOCKS_VERSION) {
-        LOG_WARN("Invalid SOCKS version: %d", version);
-        return ERROR;
-    }
-    
-    // Leer número de métodos
-    if (!buffer_can_read(d->rb)) {
+    // No se consume nada hasta tener el mensaje entero: el buffer se compacta
+    // al vaciarse, así que no se puede volver atrás
+    ptr = buffer_peek(d->rb, 2);
+    if (ptr == NULL || (ptr = buffer_peek(d->rb, 2 + (size_t)ptr[1])) == NULL) {
         return HELLO_READ;
     }
-    d->methods_count = buffer_read(d->rb);
     
-    // Leer métodos
-    size_t available;
-    buffer_read_ptr(d->rb, &available);
-    if (available < d->methods_count) {
-        // Necesitamos más datos
-        return HELLO_READ;
-    }
+    d->methods_count = ptr[1];
     
     // Buscar método de autenticación soportado
     // Requerimos USERNAME/PASSWORD según RFC 1929
-    d->selected_method = SOCKS_AUTH_NO_ACCEPTABLE;
-    for (uint8_t i = 0; i < d->methods_count; i++) {
-        uint8_t method = buffer_read(d->rb);
-        if (method == SOCKS_AUTH_USERNAME_PASSWORD) {
-            d->selected_method = SOCKS_AUTH_USERNAME_PASSWORD;
-        }
-    }
+    d->selected_method = memchr(ptr + 2, SOCKS_AUTH_USERNAME_PASSWORD, d->methods_count) != NULL
+                       ? SOCKS_AUTH_USERNAME_PASSWORD : SOCKS_AUTH_NO_ACCEPTABLE;
+    buffer_read_adv(d->rb, 2 + d->methods_count);
     
     // Preparar respuesta
+    const uint8_t reply[] = { SOCKS_VERSION, d->selected_method };
     buffer_reset(d->wb);
-    buffer_write(d->wb, SOCKS_VERSION);
-    buffer_write(d->wb, d->selected_method);
-    
-    if (SELECTOR_SUCCESS != selector_set_interest_key(key, OP_WRITE)) {
-        return ERROR;
-    }
+    buffer_write_n(d->wb, reply, sizeof(reply));
     
     return HELLO_WRITE;
 }
 
+static unsigned
+hello_read(struct selector_key *key) {
+    struct socks5 *s = ATTACHMENT(key);
+    struct hello_st *d = &s->hs->client.hello;
+    
+    return handshake_read(key, d->rb, hello_parse, HELLO_READ);
+}
+
 /**
  * Escribe respuesta HELLO:
  *   +----+--------+
@@ -562,21 +1369,12 @@ hello_read(struct selector_key *key) {
 static unsigned
 hello_write(struct selector_key *key) {
     struct socks5 *s = ATTACHMENT(key);
-    struct hello_st *d = &s->client.hello;
-    
-    uint8_t *ptr;
-    size_t count;
-    ssize_t n;
-    
-    ptr = buffer_read_ptr(d->wb, &count);
-    n = send(key->fd, ptr, count, MSG_NOSIGNAL);
+    struct hello_st *d = &s->hs->client.hello;
     
-    if (n <= 0) {
+    if (!handshake_send(key, key->fd, d->wb)) {
         return ERROR;
     }
     
-    buffer_read_adv(d->wb, n);
-    
     if (buffer_can_read(d->wb)) {
         return HELLO_WRITE;
     }
@@ -602,11 +1400,10 @@ static void
 auth_read_init(unsigned state, struct selector_key *key) {
     (void)state;
     struct socks5 *s = ATTACHMENT(key);
-    struct auth_st *d = &s->client.auth;
+    struct auth_st *d = &s->hs->client.auth;
     
     d->rb = &s->read_buffer;
     d->wb = &s->write_buffer;
-    buffer_reset(d->rb);
     d->ulen = 0;
     d->plen = 0;
     d->status = SOCKS_AUTH_FAILURE;
@@ -621,73 +1418,37 @@ auth_read_init(unsigned state, struct selector_key *key) {
  *   +----+------+----------+------+----------+
  */
 static unsigned
-auth_read(struct selector_key *key) {
+auth_parse(struct selector_key *key) {
     struct socks5 *s = ATTACHMENT(key);
-    struct auth_st *d = &s->client.auth;
-    uint8_t *ptr;
-    size_t count;
-    ssize_t n;
-    
-    ptr = buffer_write_ptr(d->rb, &count);
-    n = recv(key->fd, ptr, count, 0);
-    
-    if (n <= 0) {
-        return ERROR;
-    }
+    struct auth_st *d = &s->hs->client.auth;
     
-    buffer_write_adv(d->rb, n);
-    
-    // Parsear mensaje
-    size_t available;
-    buffer_read_ptr(d->rb, &available);
-    
-    if (available < 2) {
+    // Esperar el mensaje entero (ULEN y PLEN dicen cuánto falta)
+    const uint8_t *ptr = buffer_peek(d->rb, 2);
+    if (ptr == NULL || (ptr = buffer_peek(d->rb, 3 + (size_t)ptr[1])) == NULL
+        || buffer_peek(d->rb, 3 + (size_t)ptr[1] + ptr[2 + ptr[1]]) == NULL) {
         return AUTH_READ;
     }
     
-    // Guardar posición actual
-    uint8_t *read_start = d->rb->read;
-    
-    uint8_t version = buffer_read(d->rb);
-    if (version != SOCKS_AUTH_VERSION) {
-        LOG_WARN("Invalid auth version: %d", version);
+    if (ptr[0] != SOCKS_AUTH_VERSION) {
+        LOG_WARN("Invalid auth version: %d", ptr[0]);
         return ERROR;
     }
     
-    d->ulen = buffer_read(d->rb);
-    
-    // Verificar que tenemos todo el username
-    buffer_read_ptr(d->rb, &available);
-    if (available < (size_t)(d->ulen + 1)) {  // +1 para PLEN
-        d->rb->read = read_start;  // Restaurar
-        return AUTH_READ;
-    }
+    d->ulen = ptr[1];
+    d->plen = ptr[2 + d->ulen];
     
-    // Leer username
-    for (uint8_t i = 0; i < d->ulen; i++) {
-        d->username[i] = buffer_read(d->rb);
-    }
+    // VER y ULEN, UNAME, PLEN y PASSWD
+    buffer_read_adv(d->rb, 2);
+    buffer_read_n(d->rb, d->username, d->ulen);
     d->username[d->ulen] = '\0';
-    
-    d->plen = buffer_read(d->rb);
-    
-    // Verificar que tenemos todo el password
-    buffer_read_ptr(d->rb, &available);
-    if (available < d->plen) {
-        d->rb->read = read_start;  // Restaurar
-        return AUTH_READ;
-    }
-    
-    // Leer password
-    for (uint8_t i = 0; i < d->plen; i++) {
-        d->password[i] = buffer_read(d->rb);
-    }
+    buffer_read_adv(d->rb, 1);
+    buffer_read_n(d->rb, d->password, d->plen);
     d->password[d->plen] = '\0';
     
     // Verificar credenciales
     if (users_verify(d->username, d->password)) {
         d->status = SOCKS_AUTH_SUCCESS;
-        strncpy(s->username, d->username, sizeof(s->username) - 1);
+        s->username = intern_get(d->username);
         LOG_DEBUG("User %s authenticated successfully", d->username);
     } else {
         d->status = SOCKS_AUTH_FAILURE;
@@ -699,17 +1460,21 @@ auth_read(struct selector_key *key) {
     memset(d->password, 0, sizeof(d->password));
     
     // Preparar respuesta
+    const uint8_t reply[] = { SOCKS_AUTH_VERSION, d->status };
     buffer_reset(d->wb);
-    buffer_write(d->wb, SOCKS_AUTH_VERSION);
-    buffer_write(d->wb, d->status);
-    
-    if (SELECTOR_SUCCESS != selector_set_interest_key(key, OP_WRITE)) {
-        return ERROR;
-    }
+    buffer_write_n(d->wb, reply, sizeof(reply));
     
     return AUTH_WRITE;
 }
 
+static unsigned
+auth_read(struct selector_key *key) {
+    struct socks5 *s = ATTACHMENT(key);
+    struct auth_st *d = &s->hs->client.auth;
+    
+    return handshake_read(key, d->rb, auth_parse, AUTH_READ);
+}
+
 /**
  * Escribe respuesta de autenticación:
  *   +----+--------+
@@ -721,21 +1486,12 @@ auth_read(struct selector_key *key) {
 static unsigned
 auth_write(struct selector_key *key) {
     struct socks5 *s = ATTACHMENT(key);
-    struct auth_st *d = &s->client.auth;
-    
-    uint8_t *ptr;
-    size_t count;
-    ssize_t n;
+    struct auth_st *d = &s->hs->client.auth;
     
-    ptr = buffer_read_ptr(d->wb, &count);
-    n = send(key->fd, ptr, count, MSG_NOSIGNAL);
-    
-    if (n <= 0) {
+    if (!handshake_send(key, key->fd, d->wb)) {
         return ERROR;
     }
     
-    buffer_read_adv(d->wb, n);
-    
     if (buffer_can_read(d->wb)) {
         return AUTH_WRITE;
     }
@@ -760,11 +1516,10 @@ static void
 request_read_init(unsigned state, struct selector_key *key) {
     (void)state;
     struct socks5 *s = ATTACHMENT(key);
-    struct request_st *d = &s->client.request;
+    struct request_st *d = &s->hs->client.request;
     
     d->rb = &s->read_buffer;
     d->wb = &s->write_buffer;
-    buffer_reset(d->rb);
     d->reply = SOCKS_REPLY_SUCCEEDED;
 }
 
@@ -776,43 +1531,72 @@ request_read_init(unsigned state, struct selector_key *key) {
  *   | 1  |  1  | X'00' |  1   | Variable |    2     |
  *   +----+-----+-------+------+----------+----------+
  */
+static size_t
+request_length(buffer *b) {
+    const uint8_t *ptr = buffer_peek(b, 4);
+    if (ptr == NULL) {
+        return 4;
+    }
+    switch (ptr[3]) {
+        case SOCKS_ATYP_IPV4:
+            return 4 + 4 + 2;
+        case SOCKS_ATYP_IPV6:
+            return 4 + 16 + 2;
+        case SOCKS_ATYP_DOMAIN:
+            ptr = buffer_peek(b, 5);
+            return ptr == NULL ? 5 : 5 + (size_t)ptr[4] + 2;
+        default:
+            // se rechaza sin mirar la dirección
+            return 4;
+    }
+}
+
 static unsigned
-request_read(struct selector_key *key) {
+request_parse(struct selector_key *key) {
     struct socks5 *s = ATTACHMENT(key);
-    struct request_st *d = &s->client.request;
-    uint8_t *ptr;
-    size_t count;
-    ssize_t n;
+    struct request_st *d = &s->hs->client.request;
     
-    ptr = buffer_write_ptr(d->rb, &count);
-    n = recv(key->fd, ptr, count, 0);
-    
-    if (n <= 0) {
-        return ERROR;
+    // Esperar el request entero antes de consumir; desde ahí cada campo se
+    // copia y consume en orden
+    const size_t length = request_length(d->rb);
+    if (buffer_peek(d->rb, length) == NULL) {
+        return REQUEST_READ;
     }
     
-    buffer_write_adv(d->rb, n);
+    // VER, CMD, RSV y ATYP
+    uint8_t header[4];
+    buffer_read_n(d->rb, header, sizeof(header));
+    d->cmd = header[1];
+    d->atyp = header[3];
     
-    // Parsear request
-    size_t available;
-    buffer_read_ptr(d->rb, &available);
-    
-    if (available < 4) {
-        return REQUEST_READ;
+    // Dirección y puerto (big endian) según tipo
+    switch (d->atyp) {
+        case SOCKS_ATYP_IPV4:
+            buffer_read_n(d->rb, &d->dest_addr.ipv4, 4);
+            break;
+        case SOCKS_ATYP_IPV6:
+            buffer_read_n(d->rb, d->dest_addr.ipv6.s6_addr, 16);
+            break;
+        case SOCKS_ATYP_DOMAIN:
+            buffer_read_n(d->rb, &d->dest_addr_len, 1);
+            buffer_read_n(d->rb, d->dest_addr.fqdn, d->dest_addr_len);
+            d->dest_addr.fqdn[d->dest_addr_len] = '\0';
+            break;
+        default:
+            // sin dirección ni puerto
+            break;
+    }
+    if (length > sizeof(header)) {
+        uint8_t port[2];
+        buffer_read_n(d->rb, port, sizeof(port));
+        d->dest_port = (uint16_t)(port[0] << 8 | port[1]);
     }
     
-    uint8_t *read_start = d->rb->read;
-    
-    uint8_t version = buffer_read(d->rb);
-    if (version != SOCKS_VERSION) {
+    if (header[0] != SOCKS_VERSION) {
         d->reply = SOCKS_REPLY_GENERAL_FAILURE;
         goto prepare_response;
     }
     
-    d->cmd = buffer_read(d->rb);
-    buffer_read(d->rb);  // RSV
-    d->atyp = buffer_read(d->rb);
-    
     // Solo soportamos CONNECT
     if (d->cmd != SOCKS_CMD_CONNECT) {
         LOG_WARN("Unsupported command: %d", d->cmd);
@@ -820,44 +1604,20 @@ request_read(struct selector_key *key) {
         goto prepare_response;
     }
     
-    // Leer dirección según tipo
-    buffer_read_ptr(d->rb, &available);
-    
+    char literal[INET6_ADDRSTRLEN];
     switch (d->atyp) {
         case SOCKS_ATYP_IPV4:
-            if (available < 4 + 2) {
-                d->rb->read = read_start;
-                return REQUEST_READ;
-            }
-            for (int i = 0; i < 4; i++) {
-                ((uint8_t *)&d->dest_addr.ipv4)[i] = buffer_read(d->rb);
-            }
-            inet_ntop(AF_INET, &d->dest_addr.ipv4, s->target_host, sizeof(s->target_host));
+            inet_ntop(AF_INET, &d->dest_addr.ipv4, literal, sizeof(literal));
+            s->target_host = intern_get(literal);
             break;
             
         case SOCKS_ATYP_IPV6:
-            if (available < 16 + 2) {
-                d->rb->read = read_start;
-                return REQUEST_READ;
-            }
-            for (int i = 0; i < 16; i++) {
-                d->dest_addr.ipv6.s6_addr[i] = buffer_read(d->rb);
-            }
-            inet_ntop(AF_INET6, &d->dest_addr.ipv6, s->target_host, sizeof(s->target_host));
+            inet_ntop(AF_INET6, &d->dest_addr.ipv6, literal, sizeof(literal));
+            s->target_host = intern_get(literal);
             break;
             
         case SOCKS_ATYP_DOMAIN:
-            d->dest_addr_len = buffer_read(d->rb);
-            buffer_read_ptr(d->rb, &available);
-            if (available < (size_t)(d->dest_addr_len + 2)) {
-                d->rb->read = read_start;
-                return REQUEST_READ;
-            }
-            for (uint8_t i = 0; i < d->dest_addr_len; i++) {
-                d->dest_addr.fqdn[i] = buffer_read(d->rb);
-            }
-            d->dest_addr.fqdn[d->dest_addr_len] = '\0';
-            strncpy(s->target_host, d->dest_addr.fqdn, sizeof(s->target_host) - 1);
+            s->target_host = intern_get_n(d->dest_addr.fqdn, d->dest_addr_len);
             break;
             
         default:
@@ -865,18 +1625,50 @@ request_read(struct selector_key *key) {
             d->reply = SOCKS_REPLY_ATYP_NOT_SUPPORTED;
             goto prepare_response;
     }
-    
-    // Leer puerto (big endian)
-    d->dest_port = buffer_read(d->rb) << 8;
-    d->dest_port |= buffer_read(d->rb);
+    if (s->target_host == NULL) {
+        d->reply = SOCKS_REPLY_GENERAL_FAILURE;
+        goto prepare_response;
+    }
     s->target_port = d->dest_port;
     
     LOG_DEBUG("CONNECT request to %s:%d", s->target_host, d->dest_port);
     
-    // Si es FQDN, necesitamos resolver DNS
+    // Si es FQDN, consultar /etc/hosts y el cache antes de resolver
     if (d->atyp == SOCKS_ATYP_DOMAIN) {
-        selector_set_interest_key(key, OP_NOOP);
-        return REQUEST_RESOLVING;
+        bool refresh = false;
+        struct addrinfo *cached = resolver_lookup_local(d->dest_addr.fqdn, d->dest_port);
+        
+        if (cached != NULL) {
+            if (s->hs->origin_resolution != NULL) {
+                dnscache_freeaddrinfo(s->hs->origin_resolution);
+            }
+            s->hs->origin_resolution = cached;
+            s->hs->origin_resolution_current = cached;
+            selector_set_interest_key(key, OP_WRITE);
+            return REQUEST_CONNECTING;
+        }
+        
+        switch (dnscache_lookup(d->dest_addr.fqdn, d->dest_port, &cached, &refresh)) {
+            case DNSCACHE_HIT:
+                LOG_DEBUG("DNS cache hit for %s", d->dest_addr.fqdn);
+                if (s->hs->origin_resolution != NULL) {
+                    dnscache_freeaddrinfo(s->hs->origin_resolution);
+                }
+                s->hs->origin_resolution = cached;
+                s->hs->origin_resolution_current = cached;
+                if (refresh) {
+                    resolver_refresh(key->s, d->dest_addr.fqdn);
+                }
+                selector_set_interest_key(key, OP_WRITE);
+                return REQUEST_CONNECTING;
+            case DNSCACHE_NEGATIVE:
+                LOG_DEBUG("DNS cache: %s does not exist", d->dest_addr.fqdn);
+                d->reply = SOCKS_REPLY_HOST_UNREACHABLE;
+                goto prepare_response;
+            default:
+                selector_set_interest_key(key, OP_NOOP);
+                return REQUEST_RESOLVING;
+        }
     }
     
     // Para IPv4/IPv6, conectar directamente
@@ -884,302 +1676,362 @@ request_read(struct selector_key *key) {
     return REQUEST_CONNECTING;
     
 prepare_response:
-    // Error, preparar respuesta negativa
-    selector_set_interest_key(key, OP_WRITE);
+    // Error, se responde en REQUEST_WRITE
     return REQUEST_WRITE;
 }
 
+static unsigned
+request_read(struct selector_key *key) {
+    struct socks5 *s = ATTACHMENT(key);
+    struct request_st *d = &s->hs->client.request;
+    
+    return handshake_read(key, d->rb, request_parse, REQUEST_READ);
+}
+
 // ============================================================================
 // Resolución DNS asíncrona
 // ============================================================================
 
-struct resolve_args {
-    fd_selector selector;
-    int client_fd;
-    char host[256];
-    uint16_t port;
-    struct socks5 *s;  // Puntero a la estructura para guardar el resultado
-};
-
-static void *
-resolve_thread(void *arg) {
-    struct resolve_args *args = arg;
+static void
+request_resolving_init(unsigned state, struct selector_key *key) {
+    (void)state;
+    struct socks5 *s = ATTACHMENT(key);
+    struct request_st *d = &s->hs->client.request;
     
-    struct addrinfo hints = {
-        .ai_family   = AF_UNSPEC,
-        .ai_socktype = SOCK_STREAM,
-    };
-    
-    char port_str[8];
-    snprintf(port_str, sizeof(port_str), "%d", args->port);
-    
-    struct addrinfo *result = NULL;
-    int status = getaddrinfo(args->host, port_str, &hints, &result);
-    if (status != 0) {
-        LOG_WARN("DNS resolution failed for %s: %s", args->host, gai_strerror(status));
-        result = NULL;
+    // Limpiar resolución anterior si existe
+    if (s->hs->origin_resolution != NULL) {
+        dnscache_freeaddrinfo(s->hs->origin_resolution);
+        s->hs->origin_resolution = NULL;
+        s->hs->origin_resolution_current = NULL;
+    }
+    
+    // las preguntas viajan por sockets de este mismo selector; al terminar
+    // la consulta notifica al cliente (y a los que esperan el mismo nombre)
+    s->hs->resolve_query = resolver_query_start(key->s, key->fd, d->dest_addr.fqdn, d->dest_port);
+    if (s->hs->resolve_query == NULL) {
+        LOG_WARN("Unable to start DNS resolution for %s", d->dest_addr.fqdn);
+        // sin resolución en curso: nos notificamos para responder el error
+        d->reply = SOCKS_REPLY_GENERAL_FAILURE;
+        selector_notify_block(key->s, key->fd);
+        return;
     }
     
-    // Guardar resultado en la estructura socks5 (acceso thread-safe por diseño:
-    // el selector no procesa este fd mientras está en estado BLOCK)
-    args->s->origin_resolution = result;
-    args->s->origin_resolution_current = result;
-    
-    // Notificar al selector que terminamos
-    selector_notify_block(args->selector, args->client_fd);
-    
-    free(args);
-    return NULL;
+    LOG_DEBUG("DNS resolution started for %s", d->dest_addr.fqdn);
 }
 
-static void
-request_resolving_init(unsigned state, struct selector_key *key) {
-    (void)state;
+static unsigned
+request_resolving_done(struct selector_key *key) {
     struct socks5 *s = ATTACHMENT(key);
-    struct request_st *d = &s->client.request;
-    
-    // Limpiar resolución anterior si existe
-    if (s->origin_resolution != NULL) {
-        freeaddrinfo(s->origin_resolution);
-        s->origin_resolution = NULL;
-        s->origin_resolution_current = NULL;
-    }
-    
-    struct resolve_args *args = malloc(sizeof(*args));
-    if (args == NULL) {
-        d->reply = SOCKS_REPLY_GENERAL_FAILURE;
-        return;
+    struct request_st *d = &s->hs->client.request;
+    struct resolver_query *q = s->hs->resolve_query;
+    
+    if (q != NULL) {
+        const resolver_status status = resolver_query_status(q);
+        if (status == RESOLVER_PENDING) {
+            // notificación vieja dirigida a un cliente anterior con este fd
+            return REQUEST_RESOLVING;
+        }
+        if (status == RESOLVER_OK) {
+            s->hs->origin_resolution = resolver_query_take(q);
+            s->hs->origin_resolution_current = s->hs->origin_resolution;
+            if (s->hs->origin_resolution == NULL) {
+                d->reply = SOCKS_REPLY_GENERAL_FAILURE;
+            }
+        } else {
+            LOG_WARN("DNS resolution failed for %s: %s", d->dest_addr.fqdn,
+                     status == RESOLVER_NOTFOUND ? "name not found" : "no answer");
+            d->reply = SOCKS_REPLY_HOST_UNREACHABLE;
+        }
+        resolver_query_free(q);
+        s->hs->resolve_query = NULL;
     }
     
-    args->selector = key->s;
-    args->client_fd = key->fd;
-    strncpy(args->host, d->dest_addr.fqdn, sizeof(args->host) - 1);
-    args->host[sizeof(args->host) - 1] = '\0';
-    args->port = d->dest_port;
-    args->s = s;  // Puntero para que el thread guarde el resultado
-    
-    pthread_t tid;
-    if (pthread_create(&tid, NULL, resolve_thread, args) != 0) {
-        free(args);
-        d->reply = SOCKS_REPLY_GENERAL_FAILURE;
-        return;
+    if (s->hs->origin_resolution == NULL) {
+        selector_set_interest_key(key, OP_WRITE);
+        return REQUEST_WRITE;
     }
-    pthread_detach(tid);
     
-    LOG_DEBUG("DNS resolution started for %s in separate thread (non-blocking)", args->host);
+    selector_set_interest_key(key, OP_WRITE);
+    return REQUEST_CONNECTING;
 }
 
 static unsigned
-request_resolving_done(struct selector_key *key) {
+request_resolving_timeout(struct selector_key *key) {
     struct socks5 *s = ATTACHMENT(key);
-    (void)s;  // Evitar warning de variable no usada
-    
-    // La resolución se guarda en s->origin_resolution por el thread
-    // (simplificación: asumimos que llegó)
-    
-    // En una implementación completa, guardaríamos el resultado
-    // Por ahora, conectamos directamente
     
+    LOG_DEBUG("DNS resolution for %s timed out", s->target_host);
+    if (s->hs->resolve_query != NULL) {
+        resolver_query_free(s->hs->resolve_query);
+        s->hs->resolve_query = NULL;
+    }
+    s->hs->client.request.reply = SOCKS_REPLY_TTL_EXPIRED;
     selector_set_interest_key(key, OP_WRITE);
-    return REQUEST_CONNECTING;
+    return REQUEST_WRITE;
 }
 
 // ============================================================================
-// Conexión al servidor de origen
+// Conexión al servidor de origen (Happy Eyeballs, RFC 8305)
 // ============================================================================
 
 /**
- * Intenta conectar a una dirección del listado de resolución DNS.
- * Si falla, intenta con la siguiente (robustez requerida por consigna punto 4).
- * 
- * @return true si se inició conexión, false si hay que preparar respuesta de error
+ * Demora entre intentos de conexión en paralelo (ms). Se configura una vez
+ * antes de arrancar los reactores.
  */
-static bool
-try_connect_to_origin(struct socks5 *s, struct selector_key *key) {
-    struct request_st *d = &s->client.request;
+static unsigned connect_delay_ms = CONNECT_DELAY_MS;
+
+void
+socksv5_set_connect_delay(unsigned ms) {
+    connect_delay_ms = ms;
+}
+
+/**
+ * Arma la "resolución" de un destino IPv4/IPv6 literal: una lista de una
+ * sola dirección, para conectar por el mismo camino que un FQDN.
+ */
+static struct addrinfo *
+literal_resolution(const struct request_st *d) {
+    struct sockaddr_storage ss;
+    memset(&ss, 0, sizeof(ss));
+    struct addrinfo ai = {
+        .ai_socktype = SOCK_STREAM,
+        .ai_protocol = IPPROTO_TCP,
+        .ai_addr     = (struct sockaddr *)&ss,
+    };
     
-    struct addrinfo *current = s->origin_resolution_current;
-    if (current == NULL) {
-        d->reply = SOCKS_REPLY_HOST_UNREACHABLE;
-        return false;
+    if (d->atyp == SOCKS_ATYP_IPV6) {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&ss;
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port   = htons(d->dest_port);
+        in6->sin6_addr   = d->dest_addr.ipv6;
+        ai.ai_family  = AF_INET6;
+        ai.ai_addrlen = sizeof(*in6);
+    } else {
+        struct sockaddr_in *in = (struct sockaddr_in *)&ss;
+        in->sin_family = AF_INET;
+        in->sin_port   = htons(d->dest_port);
+        in->sin_addr   = d->dest_addr.ipv4;
+        ai.ai_family  = AF_INET;
+        ai.ai_addrlen = sizeof(*in);
+    }
+    return dnscache_addrinfo_dup(&ai);
+}
+
+/**
+ * Reordena la resolución alternando familias (IPv6, IPv4, IPv6, ...), como
+ * pide RFC 8305 §4. Solo cambian los enlaces `ai_next': el primer nodo del
+ * bloque sigue siendo `origin_resolution', que es el que se libera.
+ *
+ * @return el nuevo primer elemento de la lista
+ */
+static struct addrinfo *
+interleave_families(struct addrinfo *list) {
+    struct addrinfo *v6 = NULL, **v6_tail = &v6;
+    struct addrinfo *v4 = NULL, **v4_tail = &v4;
+    
+    for (struct addrinfo *ai = list; ai != NULL; ai = ai->ai_next) {
+        if (ai->ai_family == AF_INET6) {
+            *v6_tail = ai;
+            v6_tail = &ai->ai_next;
+        } else {
+            *v4_tail = ai;
+            v4_tail = &ai->ai_next;
+        }
+    }
+    *v6_tail = NULL;
+    *v4_tail = NULL;
+    
+    struct addrinfo *head = NULL, **tail = &head;
+    bool six = true;
+    while (v6 != NULL || v4 != NULL) {
+        struct addrinfo **from = (six && v6 != NULL) || v4 == NULL ? &v6 : &v4;
+        struct addrinfo *ai = *from;
+        *from = ai->ai_next;
+        *tail = ai;
+        tail = &ai->ai_next;
+        six = !six;
+    }
+    *tail = NULL;
+    return head;
+}
+
+/**
+ * Respuesta al cliente cuando fallaron todos los intentos, según el error
+ * del último. Sin ningún intento (0) no se pudo llegar al host.
+ */
+static uint8_t
+connect_reply(int error) {
+    switch (error) {
+        case ECONNREFUSED:
+            return SOCKS_REPLY_CONNECTION_REFUSED;
+        case ENETUNREACH:
+            return SOCKS_REPLY_NETWORK_UNREACHABLE;
+        case 0:
+        case EHOSTUNREACH:
+        case EHOSTDOWN:
+            return SOCKS_REPLY_HOST_UNREACHABLE;
+        case ETIMEDOUT:
+            return SOCKS_REPLY_TTL_EXPIRED;
+        case EACCES:
+        case EPERM:
+            return SOCKS_REPLY_CONN_NOT_ALLOWED;
+        default:
+            return SOCKS_REPLY_GENERAL_FAILURE;
     }
+}
+
+/**
+ * Cancela el intento `i' de la carrera de conexión.
+ */
+static void
+connect_attempt_close(struct socks5 *s, struct selector_key *key, unsigned i) {
+    const int fd = s->hs->connect_fds[i];
     
-    // Intentar con cada dirección hasta que una funcione
-    while (current != NULL) {
-        int origin_fd = socket(current->ai_family, SOCK_STREAM, IPPROTO_TCP);
-        if (origin_fd < 0) {
-            current = current->ai_next;
-            continue;
+    s->hs->connect_n--;
+    s->hs->connect_fds[i]       = s->hs->connect_fds[s->hs->connect_n];
+    s->hs->connect_ai[i]        = s->hs->connect_ai[s->hs->connect_n];
+    s->hs->connect_fast_open[i] = s->hs->connect_fast_open[s->hs->connect_n];
+    s->hs->connect_sent[i]      = s->hs->connect_sent[s->hs->connect_n];
+    
+    selector_unregister_fd(key->s, fd);
+    close(fd);
+}
+
+static void
+connect_attempts_close_all(struct socks5 *s, struct selector_key *key) {
+    while (s->hs->connect_n > 0) {
+        connect_attempt_close(s, key, s->hs->connect_n - 1);
+    }
+}
+
+/**
+ * Conecta `fd' sin bloquear. Con Fast Open, si el cliente ya mandó datos
+ * detrás del REQUEST y el kernel tiene cookie para el origen, el connect se
+ * difiere y esos datos salen en el SYN con el primer send; sin cookie es un
+ * connect común que además la pide.
+ *
+ * @param alone el intento es el único en curso y no se va a lanzar otro en
+ *              paralelo: solo entonces se usa Fast Open, para que los datos
+ *              del cliente no le lleguen al origen por dos intentos
+ * @param fast queda en true si se pidió Fast Open
+ * @param sent bytes del buffer de lectura que ya quedaron en el socket
+ * @return false si el intento falló en el acto
+ */
+static bool
+connect_start(struct socks5 *s, int fd, const struct addrinfo *ai, bool alone,
+              bool *fast, size_t *sent) {
+    size_t early;
+    const uint8_t *ptr = buffer_read_ptr(&s->read_buffer, &early);
+    
+    *fast = false;
+    *sent = 0;
+#ifdef TCP_FASTOPEN_CONNECT
+    if (fast_open && alone && early > 0) {
+        *fast = setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &(int){1}, sizeof(int)) == 0;
+    }
+#else
+    (void)alone;
+#endif
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+        return errno == EINPROGRESS;
+    }
+    if (*fast) {
+        const ssize_t n = send(fd, ptr, early, MSG_NOSIGNAL);
+        if (n < 0 && errno != EINPROGRESS) {
+            return false;
         }
+        *sent = n > 0 ? (size_t)n : 0;
+    }
+    return true;
+}
+
+/**
+ * Lanza un intento de conexión a la próxima dirección de la resolución, sin
+ * cancelar los que ya están en curso. Las direcciones que fallan en el acto
+ * (por ejemplo ENETUNREACH en una familia sin ruta) se saltean sin esperar.
+ *
+ * Si quedan más direcciones, el intento arma un timer con la demora de
+ * Happy Eyeballs: si no conectó para entonces se lanza el siguiente.
+ *
+ * @return true si quedó un intento nuevo en curso
+ */
+static bool
+connect_attempt_next(struct socks5 *s, struct selector_key *key) {
+    while (s->hs->origin_resolution_current != NULL && s->hs->connect_n < CONNECT_MAX_ATTEMPTS) {
+        struct addrinfo *ai = s->hs->origin_resolution_current;
+        s->hs->origin_resolution_current = ai->ai_next;
         
-        if (selector_fd_set_nio(origin_fd) < 0) {
-            close(origin_fd);
-            current = current->ai_next;
+        int fd = socket(ai->ai_family, SOCK_STREAM, IPPROTO_TCP);
+        if (fd < 0) {
             continue;
         }
+        tuning_apply(fd, &s->hs->tuning);
         
-        // Iniciar conexión no bloqueante
-        int ret = connect(origin_fd, current->ai_addr, current->ai_addrlen);
-        if (ret < 0 && errno != EINPROGRESS) {
+        // sin otros intentos en curso ni más direcciones no habrá otro en
+        // paralelo (si este falla, el próximo arranca solo)
+        const bool alone = s->hs->connect_n == 0 && s->hs->origin_resolution_current == NULL;
+        bool fast;
+        size_t sent;
+        if (selector_fd_set_nio(fd) < 0 || !connect_start(s, fd, ai, alone, &fast, &sent)) {
+            s->hs->connect_error = errno;
             LOG_DEBUG("Connect to address failed: %s, trying next...", strerror(errno));
-            close(origin_fd);
-            current = current->ai_next;
+            close(fd);
+            continue;
+        }
+        if (selector_register(key->s, fd, &socks5_handler, OP_WRITE, s) != SELECTOR_SUCCESS) {
+            LOG_ERROR("Failed to register origin socket");
+            close(fd);
             continue;
         }
-        
-        // Conexión iniciada exitosamente
-        s->origin_fd = origin_fd;
-        memcpy(&d->origin_addr, current->ai_addr, current->ai_addrlen);
-        d->origin_addr_len = current->ai_addrlen;
-        s->origin_resolution_current = current->ai_next;  // Para reintentar si falla
-        
-        // Registrar el fd del origen para escribir (esperar conexión)
         s->references++;
-        selector_register(key->s, origin_fd, &socks5_handler, OP_WRITE, s);
+        s->hs->connect_fds[s->hs->connect_n]       = fd;
+        s->hs->connect_ai[s->hs->connect_n]        = ai;
+        s->hs->connect_fast_open[s->hs->connect_n] = fast;
+        s->hs->connect_sent[s->hs->connect_n]      = sent;
+        s->hs->connect_n++;
         
+        if (s->hs->origin_resolution_current != NULL) {
+            selector_set_timeout(key->s, fd, connect_delay_ms);
+        }
         return true;
     }
-    
-    // No se pudo conectar a ninguna dirección
-    d->reply = SOCKS_REPLY_HOST_UNREACHABLE;
     return false;
 }
 
 /**
  * Inicia la conexión al servidor de origen.
  * 
- * Dos casos:
- * 1. FQDN: Viene desde REQUEST_RESOLVING, ya tiene s->origin_resolution del thread
- * 2. IPv4/IPv6: Conexión directa sin DNS lookup (NO BLOQUEANTE)
+ * Tanto un FQDN (con la resolución de REQUEST_RESOLVING) como una IP
+ * literal conectan igual: se alternan las familias y se lanzan intentos
+ * escalonados hasta que uno conecta.
  */
 static void
 request_connecting_init(unsigned state, struct selector_key *key) {
     (void)state;
     struct socks5 *s = ATTACHMENT(key);
-    struct request_st *d = &s->client.request;
+    struct request_st *d = &s->hs->client.request;
     
-    // CASO 1: Viene de RESOLVING (FQDN) - ya tiene resolución del thread
-    if (s->origin_resolution != NULL) {
-        LOG_DEBUG("Connecting to %s:%d using resolved addresses (from DNS thread)", 
-                  s->target_host, d->dest_port);
-        
-        // Usar try_connect_to_origin que itera sobre las direcciones resueltas
-        if (!try_connect_to_origin(s, key)) {
-            // Error preparado, ir a escribir respuesta
-            selector_set_interest(key->s, s->client_fd, OP_WRITE);
-            return;
-        }
-        
-        // Quitar interés del cliente mientras conectamos
-        selector_set_interest(key->s, s->client_fd, OP_NOOP);
-        return;
-    }
-    
-    // CASO 2: IPv4/IPv6 directo - crear sockaddr sin getaddrinfo (NO BLOQUEANTE)
-    int origin_fd = -1;
-    
-    if (d->atyp == SOCKS_ATYP_IPV4) {
-        // Crear socket IPv4
-        origin_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        if (origin_fd < 0) {
-            LOG_WARN("Failed to create IPv4 socket: %s", strerror(errno));
-            d->reply = SOCKS_REPLY_GENERAL_FAILURE;
-            selector_set_interest(key->s, s->client_fd, OP_WRITE);
-            return;
-        }
-        
-        // Setear no bloqueante ANTES de connect
-        if (selector_fd_set_nio(origin_fd) < 0) {
-            LOG_WARN("Failed to set socket non-blocking: %s", strerror(errno));
-            close(origin_fd);
-            d->reply = SOCKS_REPLY_GENERAL_FAILURE;
-            selector_set_interest(key->s, s->client_fd, OP_WRITE);
-            return;
-        }
-        
-        // Construir sockaddr_in directamente (NO usa getaddrinfo = NO BLOQUEANTE)
-        struct sockaddr_in addr4;
-        memset(&addr4, 0, sizeof(addr4));
-        addr4.sin_family = AF_INET;
-        addr4.sin_port = htons(d->dest_port);
-        memcpy(&addr4.sin_addr, &d->dest_addr.ipv4, sizeof(addr4.sin_addr));
-        
-        // Iniciar conexión no bloqueante
-        int ret = connect(origin_fd, (struct sockaddr *)&addr4, sizeof(addr4));
-        if (ret < 0 && errno != EINPROGRESS) {
-            LOG_DEBUG("Connect to IPv4 failed: %s", strerror(errno));
-            close(origin_fd);
-            d->reply = SOCKS_REPLY_HOST_UNREACHABLE;
-            selector_set_interest(key->s, s->client_fd, OP_WRITE);
-            return;
-        }
-        
-        // Guardar dirección para la respuesta
-        memcpy(&d->origin_addr, &addr4, sizeof(addr4));
-        d->origin_addr_len = sizeof(addr4);
-        
-    } else if (d->atyp == SOCKS_ATYP_IPV6) {
-        // Crear socket IPv6
-        origin_fd = socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
-        if (origin_fd < 0) {
-            LOG_WARN("Failed to create IPv6 socket: %s", strerror(errno));
+    if (s->hs->origin_resolution == NULL) {
+        s->hs->origin_resolution = literal_resolution(d);
+        if (s->hs->origin_resolution == NULL) {
             d->reply = SOCKS_REPLY_GENERAL_FAILURE;
             selector_set_interest(key->s, s->client_fd, OP_WRITE);
             return;
         }
-        
-        // Setear no bloqueante ANTES de connect
-        if (selector_fd_set_nio(origin_fd) < 0) {
-            LOG_WARN("Failed to set socket non-blocking: %s", strerror(errno));
-            close(origin_fd);
-            d->reply = SOCKS_REPLY_GENERAL_FAILURE;
-            selector_set_interest(key->s, s->client_fd, OP_WRITE);
-            return;
-        }
-        
-        // Construir sockaddr_in6 directamente (NO usa getaddrinfo = NO BLOQUEANTE)
-        struct sockaddr_in6 addr6;
-        memset(&addr6, 0, sizeof(addr6));
-        addr6.sin6_family = AF_INET6;
-        addr6.sin6_port = htons(d->dest_port);
-        memcpy(&addr6.sin6_addr, &d->dest_addr.ipv6, sizeof(addr6.sin6_addr));
-        
-        // Iniciar conexión no bloqueante
-        int ret = connect(origin_fd, (struct sockaddr *)&addr6, sizeof(addr6));
-        if (ret < 0 && errno != EINPROGRESS) {
-            LOG_DEBUG("Connect to IPv6 failed: %s", strerror(errno));
-            close(origin_fd);
-            d->reply = SOCKS_REPLY_HOST_UNREACHABLE;
-            selector_set_interest(key->s, s->client_fd, OP_WRITE);
-            return;
-        }
-        
-        // Guardar dirección para la respuesta
-        memcpy(&d->origin_addr, &addr6, sizeof(addr6));
-        d->origin_addr_len = sizeof(addr6);
-        
-    } else {
-        // FQDN sin resolución previa = error (debería haber ido por RESOLVING)
-        LOG_ERROR("FQDN without DNS resolution - this should not happen");
-        d->reply = SOCKS_REPLY_GENERAL_FAILURE;
-        selector_set_interest(key->s, s->client_fd, OP_WRITE);
-        return;
     }
+    s->hs->origin_resolution_current = interleave_families(s->hs->origin_resolution);
     
-    LOG_DEBUG("Connecting to %s:%d (direct IP, non-blocking)", s->target_host, d->dest_port);
-    
-    // Conexión iniciada exitosamente
-    s->origin_fd = origin_fd;
-    s->origin_resolution_current = NULL;  // No hay más direcciones para reintentar
+    // Con el usuario y el puerto ya se sabe el perfil de la conexión; si no
+    // es el del socket pasivo, se corrige también el cliente
+    const int tuning_id = tuning_for_connection(s->username, d->dest_port, &s->hs->tuning);
+    if (tuning_id != s->hs->tuning_id) {
+        s->hs->tuning_id = tuning_id;
+        tuning_apply(s->client_fd, &s->hs->tuning);
+    }
+    s->weight = s->hs->tuning.weight == TUNING_UNSET ? 1 : s->hs->tuning.weight;
     
-    // Registrar el fd del origen para escribir (esperar conexión)
-    s->references++;
-    if (selector_register(key->s, origin_fd, &socks5_handler, OP_WRITE, s) != SELECTOR_SUCCESS) {
-        LOG_ERROR("Failed to register origin socket");
-        close(origin_fd);
-        s->origin_fd = -1;
-        s->references--;
-        d->reply = SOCKS_REPLY_GENERAL_FAILURE;
+    LOG_DEBUG("Connecting to %s:%d", s->target_host, d->dest_port);
+    if (!connect_attempt_next(s, key)) {
+        d->reply = connect_reply(s->hs->connect_error);
         selector_set_interest(key->s, s->client_fd, OP_WRITE);
         return;
     }
@@ -1188,39 +2040,72 @@ request_connecting_init(unsigned state, struct selector_key *key) {
     selector_set_interest(key->s, s->client_fd, OP_NOOP);
 }
 
+/**
+ * Terminó (bien o mal) el connect de uno de los intentos.
+ */
 static unsigned
 request_connecting(struct selector_key *key) {
     struct socks5 *s = ATTACHMENT(key);
-    struct request_st *d = &s->client.request;
+    struct request_st *d = &s->hs->client.request;
+    
+    // el cliente solo escribe acá si no se pudo lanzar ningún intento: la
+    // respuesta de error ya está preparada
+    if (key->fd == s->client_fd) {
+        return REQUEST_WRITE;
+    }
+    
+    unsigned i = 0;
+    while (i < s->hs->connect_n && s->hs->connect_fds[i] != key->fd) {
+        i++;
+    }
+    if (i == s->hs->connect_n) {
+        return REQUEST_CONNECTING;
+    }
     
     // Verificar si la conexión fue exitosa
-    int error;
+    int error = 0;
     socklen_t len = sizeof(error);
     
-    if (getsockopt(s->origin_fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
+    if (getsockopt(key->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
         LOG_DEBUG("Connection to origin failed: %s", strerror(error));
+        s->hs->connect_error = error != 0 ? error : errno;
+        connect_attempt_close(s, key, i);
         
-        // Desregistrar el fd fallido
-        selector_unregister_fd(key->s, s->origin_fd);
-        close(s->origin_fd);
-        s->origin_fd = -1;
-        
-        // ROBUSTEZ: Intentar con la siguiente dirección IP si hay más
-        // (Requerimiento funcional 4 de la consigna)
-        if (s->origin_resolution_current != NULL) {
-            LOG_DEBUG("Trying next address in resolution list...");
-            if (try_connect_to_origin(s, key)) {
-                // Conexión iniciada con otra IP, seguir esperando
-                return REQUEST_CONNECTING;
-            }
+        // ROBUSTEZ: ante un fallo se lanza la próxima dirección sin esperar
+        // la demora (Requerimiento funcional 4 de la consigna)
+        if (connect_attempt_next(s, key) || s->hs->connect_n > 0) {
+            return REQUEST_CONNECTING;
         }
         
-        // No hay más direcciones, reportar error
-        d->reply = SOCKS_REPLY_CONNECTION_REFUSED;
+        // No hay más direcciones, reportar el error del último intento
+        d->reply = connect_reply(s->hs->connect_error);
         selector_set_interest(key->s, s->client_fd, OP_WRITE);
         return REQUEST_WRITE;
     }
     
+    // Ganó este intento: se queda como origen y se cancelan los demás
+    s->origin_fd = key->fd;
+    memcpy(&d->origin_addr, s->hs->connect_ai[i]->ai_addr, s->hs->connect_ai[i]->ai_addrlen);
+    d->origin_addr_len = s->hs->connect_ai[i]->ai_addrlen;
+    
+    // Lo que salió en el SYN ya está en el socket: no se reenvía en COPY
+    if (s->hs->connect_sent[i] > 0) {
+        buffer_read_adv(&s->read_buffer, s->hs->connect_sent[i]);
+        s->bytes_recv += s->hs->connect_sent[i];
+        metrics_add_bytes_received(s->hs->connect_sent[i]);
+    }
+    if (s->hs->connect_fast_open[i]) {
+        metrics_fast_open_connect(fast_open_syn_data(key->fd));
+    }
+    
+    s->hs->connect_n--;
+    s->hs->connect_fds[i]       = s->hs->connect_fds[s->hs->connect_n];
+    s->hs->connect_ai[i]        = s->hs->connect_ai[s->hs->connect_n];
+    s->hs->connect_fast_open[i] = s->hs->connect_fast_open[s->hs->connect_n];
+    s->hs->connect_sent[i]      = s->hs->connect_sent[s->hs->connect_n];
+    selector_cancel_timeout(key->s, key->fd);
+    connect_attempts_close_all(s, key);
+    
     LOG_DEBUG("Connected to origin successfully");
     d->reply = SOCKS_REPLY_SUCCEEDED;
     metrics_connection_success();
@@ -1232,6 +2117,79 @@ request_connecting(struct selector_key *key) {
     return REQUEST_WRITE;
 }
 
+/**
+ * Vence un timer durante la conexión: el de un intento es la demora de
+ * Happy Eyeballs (se lanza el siguiente en paralelo); el del cliente es el
+ * plazo de toda la carrera.
+ */
+static unsigned
+request_connecting_timeout(struct selector_key *key) {
+    struct socks5 *s = ATTACHMENT(key);
+    struct request_st *d = &s->hs->client.request;
+    
+    if (key->fd != s->client_fd) {
+        connect_attempt_next(s, key);
+        return REQUEST_CONNECTING;
+    }
+    
+    LOG_DEBUG("Connection to %s:%d timed out", s->target_host, d->dest_port);
+    connect_attempts_close_all(s, key);
+    
+    d->reply = SOCKS_REPLY_TTL_EXPIRED;
+    selector_set_interest(key->s, s->client_fd, OP_WRITE);
+    return REQUEST_WRITE;
+}
+
+/**
+ * Entrega el túnel al kernel si se puede. Se hace antes de mandar la
+ * respuesta al cliente: hasta recibirla no manda nada, así que todo lo que
+ * llegue desde ahí se redirige en orden. No se entrega si ya hay bytes
+ * esperando (un cliente que mandó datos junto con el handshake, o un origen
+ * que habla primero), porque saldrían después de los que redirija el kernel.
+ */
+static void
+copy_sockmap_attach(struct socks5 *s) {
+    int client_pending = 0, origin_pending = 0;
+    
+    if (!sockmap_enabled() || copy_dissected(s) || buffer_can_read(&s->read_buffer)
+        || ioctl(s->client_fd, FIONREAD, &client_pending) < 0 || client_pending > 0
+        || ioctl(s->origin_fd, FIONREAD, &origin_pending) < 0 || origin_pending > 0) {
+        return;
+    }
+    if (!sockmap_bytes_received(s->client_fd, &s->sockmap_client_bytes)
+        || !sockmap_bytes_received(s->origin_fd, &s->sockmap_origin_bytes)) {
+        return;
+    }
+    s->sockmap = sockmap_pair(s->client_fd, s->origin_fd);
+}
+
+/**
+ * Suma a las métricas lo que el kernel copió desde la última cosecha.
+ *
+ * @return true si hubo tráfico
+ */
+static bool
+copy_sockmap_harvest(struct socks5 *s) {
+    uint64_t bytes;
+    bool active = false;
+    
+    if (s->client_fd >= 0 && sockmap_bytes_received(s->client_fd, &bytes)
+        && bytes > s->sockmap_client_bytes) {
+        s->bytes_recv += bytes - s->sockmap_client_bytes;
+        metrics_add_bytes_received(bytes - s->sockmap_client_bytes);
+        s->sockmap_client_bytes = bytes;
+        active = true;
+    }
+    if (s->origin_fd >= 0 && sockmap_bytes_received(s->origin_fd, &bytes)
+        && bytes > s->sockmap_origin_bytes) {
+        s->bytes_sent += bytes - s->sockmap_origin_bytes;
+        metrics_add_bytes_sent(bytes - s->sockmap_origin_bytes);
+        s->sockmap_origin_bytes = bytes;
+        active = true;
+    }
+    return active;
+}
+
 /**
  * Escribe respuesta del request:
  *   +----+-----+-------+------+----------+----------+
@@ -1243,39 +2201,28 @@ request_connecting(struct selector_key *key) {
 static unsigned
 request_write(struct selector_key *key) {
     struct socks5 *s = ATTACHMENT(key);
-    struct request_st *d = &s->client.request;
+    struct request_st *d = &s->hs->client.request;
     
     // Preparar respuesta si no está lista
     if (!buffer_can_read(d->wb)) {
-        buffer_reset(d->wb);
-        buffer_write(d->wb, SOCKS_VERSION);
-        buffer_write(d->wb, d->reply);
-        buffer_write(d->wb, 0x00);  // RSV
-        
+        if (d->reply == SOCKS_REPLY_SUCCEEDED) {
+            copy_sockmap_attach(s);
+        }
         // BND.ADDR y BND.PORT
         // Usamos 0.0.0.0:0 por simplicidad
-        buffer_write(d->wb, SOCKS_ATYP_IPV4);
-        buffer_write(d->wb, 0x00);
-        buffer_write(d->wb, 0x00);
-        buffer_write(d->wb, 0x00);
-        buffer_write(d->wb, 0x00);
-        buffer_write(d->wb, 0x00);
-        buffer_write(d->wb, 0x00);
+        const uint8_t reply[] = {
+            SOCKS_VERSION, d->reply, 0x00 /* RSV */, SOCKS_ATYP_IPV4,
+            0x00, 0x00, 0x00, 0x00,
+            0x00, 0x00,
+        };
+        buffer_reset(d->wb);
+        buffer_write_n(d->wb, reply, sizeof(reply));
     }
     
-    uint8_t *ptr;
-    size_t count;
-    ssize_t n;
-    
-    ptr = buffer_read_ptr(d->wb, &count);
-    n = send(s->client_fd, ptr, count, MSG_NOSIGNAL);
-    
-    if (n <= 0) {
+    if (!handshake_send(key, s->client_fd, d->wb)) {
         return ERROR;
     }
     
-    buffer_read_adv(d->wb, n);
-    
     if (buffer_can_read(d->wb)) {
         return REQUEST_WRITE;
     }
@@ -1293,36 +2240,81 @@ request_write(struct selector_key *key) {
 // Estado COPY (streaming bidireccional)
 // ============================================================================
 
+static fd_interest
+copy_compute_interests(struct socks5 *s, int fd);
+
 static void
 copy_init(unsigned state, struct selector_key *key) {
     (void)state;
     struct socks5 *s = ATTACHMENT(key);
     
-    // Reiniciar buffers
-    buffer_reset(&s->read_buffer);
-    buffer_reset(&s->write_buffer);
+    // Terminó el handshake
+    socks5_handshake_free(s);
+    
+    // La respuesta del REQUEST ya salió entera; en `read_buffer' puede haber
+    // datos que el cliente mandó junto con el handshake, destinados al origen.
+    // Se quedan en el bloque del handshake, que pasa a ser el anillo de subida
+    buffer handshake_read = s->read_buffer;
+    buffer handshake_write = s->write_buffer;
+    handshake_buffer_release(&handshake_write);
+    memset(&s->write_ring, 0, sizeof(s->write_ring));
+    
+    size_t early;
+    uint8_t *ptr = buffer_read_ptr(&handshake_read, &early);
+    if (early > 0) {
+        s->bytes_recv += early;
+        metrics_add_bytes_received(early);
+        memmove(handshake_read.data, ptr, early);
+        ring_init(&s->read_ring, handshake_read.limit - handshake_read.data, handshake_read.data);
+        ring_write_adv(&s->read_ring, early);
+    } else {
+        handshake_buffer_release(&handshake_read);
+        memset(&s->read_ring, 0, sizeof(s->read_ring));
+    }
     
     // Configurar estructuras de copy
-    struct copy_st *client_copy = &s->client.copy;
+    struct copy_st *client_copy = &s->client_copy;
     struct copy_st *origin_copy = &s->origin_copy;
     
-    client_copy->rb = &s->read_buffer;
-    client_copy->wb = &s->write_buffer;
+    client_copy->rb = &s->read_ring;
+    client_copy->wb = &s->write_ring;
     client_copy->other = origin_copy;
     client_copy->interests = OP_READ;
     client_copy->shutdown_read = false;
     client_copy->shutdown_write = false;
     
-    origin_copy->rb = &s->write_buffer;  // Invertido
-    origin_copy->wb = &s->read_buffer;
+    origin_copy->rb = &s->write_ring;  // Invertido
+    origin_copy->wb = &s->read_ring;
     origin_copy->other = client_copy;
     origin_copy->interests = OP_READ;
     origin_copy->shutdown_read = false;
     origin_copy->shutdown_write = false;
     
-    // Ambos lados listos para leer
-    selector_set_interest(key->s, s->client_fd, OP_READ);
-    selector_set_interest(key->s, s->origin_fd, OP_READ);
+    if (s->sockmap) {
+        // El kernel copia; acá solo llegan los cierres. El timer del origen
+        // marca las cosechas de contadores
+        selector_set_timeout(key->s, s->origin_fd, SOCKMAP_HARVEST_MS);
+    } else if (early == 0 && copy_use_relay(s, key->s)
+               && selector_relay(key->s, s->client_fd, s->origin_fd) == SELECTOR_SUCCESS) {
+        // El selector copia; acá llegan los avances y los cierres (ver
+        // `socksv5_relay'). Lo que el cliente mandó con el handshake tiene
+        // que salir antes, así que en ese caso se copia con buffers
+        s->relay = true;
+    } else if (copy_use_splice(s)) {
+        if (relay_pipe_get(&client_copy->pipe)) {
+            if (relay_pipe_get(&origin_copy->pipe)) {
+                s->splice = true;
+            } else {
+                relay_pipe_put(&client_copy->pipe);
+            }
+        }
+        if (!s->splice) {
+            LOG_DEBUG("Unable to get relay pipes, using buffered copy: %s", strerror(errno));
+        }
+    }
+    
+    selector_set_interest(key->s, s->client_fd, copy_compute_interests(s, s->client_fd));
+    selector_set_interest(key->s, s->origin_fd, copy_compute_interests(s, s->origin_fd));
 }
 
 /**
@@ -1333,55 +2325,307 @@ copy_compute_interests(struct socks5 *s, int fd) {
     fd_interest ret = OP_NOOP;
     
     bool is_client = (fd == s->client_fd);
-    struct copy_st *copy = is_client ? &s->client.copy : &s->origin_copy;
+    struct copy_st *copy = is_client ? &s->client_copy : &s->origin_copy;
+    
+    if (s->relay) {
+        return OP_NOOP;
+    }
+    if (s->splice) {
+        // Leer si el pipe del otro lado tiene lugar; escribir si el nuestro
+        // (o lo que quedó en el buffer) tiene datos
+        if (!copy->shutdown_read && copy->other->pipe.pending < copy->other->pipe.size) {
+            ret |= OP_READ;
+        }
+        if (ring_can_read(copy->wb) || copy->pipe.pending > 0) {
+            ret |= OP_WRITE;
+        }
+        return ret;
+    }
     
     // Podemos leer si el buffer de escritura del otro lado tiene espacio
-    if (!copy->shutdown_read && buffer_can_write(copy->other->wb)) {
+    if (!copy->shutdown_read && relay_can_fill(copy->other->wb)) {
         ret |= OP_READ;
     }
     
     // Podemos escribir si nuestro buffer de escritura tiene datos
-    if (buffer_can_read(copy->wb)) {
+    if (ring_can_read(copy->wb)) {
         ret |= OP_WRITE;
     }
     
     return ret;
 }
 
+/**
+ * Ambos lados cerraron y no quedan bytes por entregar.
+ */
+static bool
+copy_done(struct socks5 *s) {
+    return s->client_copy.shutdown_read && s->origin_copy.shutdown_read
+        && !ring_can_read(&s->read_ring) && !ring_can_read(&s->write_ring)
+        && (!s->splice || (s->client_copy.pipe.pending == 0
+                           && s->origin_copy.pipe.pending == 0));
+}
+
+static struct relay_sizing *
+copy_sizing(struct socks5 *s, ring *r) {
+    return r == &s->read_ring ? &s->upload : &s->download;
+}
+
+/**
+ * Devuelve al pool los buffers que quedaron vacíos.
+ */
+static void
+copy_release_drained(struct socks5 *s) {
+    if (!ring_can_read(&s->read_ring)) {
+        relay_release(&s->read_ring);
+    }
+    if (!ring_can_read(&s->write_ring)) {
+        relay_release(&s->write_ring);
+    }
+}
+
+/**
+ * Lleva la cuenta de las lecturas que llenan el buffer `b' y lo agranda si
+ * la dirección lo viene llenando. Con un buffer agrandado se arma el tick
+ * que lo achica cuando el tráfico baja.
+ */
+static void
+copy_adapt(struct selector_key *key, struct socks5 *s, ring *b, bool full) {
+    struct relay_sizing *rs = copy_sizing(s, b);
+    
+    if (!full) {
+        rs->streak = 0;
+        return;
+    }
+    rs->filled = true;
+    if (++rs->streak < RELAY_GROW_STREAK) {
+        return;
+    }
+    rs->streak = 0;
+    if (rs->size >= rs->max) {
+        return;
+    }
+    const size_t bigger = rs->size * 2 < rs->max ? rs->size * 2 : rs->max;
+    // el bloque puede ser todavía uno grande que el tick no pudo achicar
+    if (bigger > b->size && !relay_resize(b, bigger)) {
+        return;
+    }
+    rs->size = bigger;
+    if (!s->relay_tick) {
+        s->relay_tick = true;
+        selector_set_timeout(key->s, s->origin_fd, RELAY_SHRINK_MS);
+    }
+}
+
+/**
+ * Tick de los buffers agrandados: vuelve a BUFFER_SIZE las direcciones que
+ * no se llenaron desde el tick anterior. Un bloque grande que todavía tiene
+ * datos se cambia ya si lo pendiente entra; si no, vuelve al pool al
+ * vaciarse, como cualquier otro.
+ */
+static void
+copy_relay_tick(struct selector_key *key, struct socks5 *s) {
+    ring *rings[] = { &s->read_ring, &s->write_ring };
+    
+    for (unsigned i = 0; i < N(rings); i++) {
+        struct relay_sizing *rs = copy_sizing(s, rings[i]);
+        if (!rs->filled && rs->size > BUFFER_SIZE) {
+            rs->size = BUFFER_SIZE;
+            if (rings[i]->size > BUFFER_SIZE && ring_readable(rings[i]) <= BUFFER_SIZE) {
+                relay_resize(rings[i], BUFFER_SIZE);
+            }
+        }
+        rs->filled = false;
+    }
+    
+    s->relay_tick = s->upload.size > BUFFER_SIZE || s->download.size > BUFFER_SIZE;
+    if (s->relay_tick) {
+        selector_set_timeout(key->s, s->origin_fd, RELAY_SHRINK_MS);
+    }
+    selector_set_interest(key->s, s->client_fd, copy_compute_interests(s, s->client_fd));
+    selector_set_interest(key->s, s->origin_fd, copy_compute_interests(s, s->origin_fd));
+}
+
+#ifdef __linux__
+/**
+ * Mueve lo que haya en el socket `fd' al pipe `p', sin pasar por userspace.
+ * Devuelve como recv: los bytes movidos, 0 si el socket se cerró, -1 con
+ * errno EAGAIN si no hay datos (o el pipe está lleno).
+ */
+static ssize_t
+copy_splice_in(int fd, struct relay_pipe *p) {
+    if (p->pending >= p->size) {
+        errno = EAGAIN;
+        return -1;
+    }
+    ssize_t n = splice(fd, NULL, p->fds[1], NULL, p->size - p->pending,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0) {
+        p->pending += n;
+    }
+    return n;
+}
+
+/**
+ * Mueve lo que haya en el pipe `p' al socket `fd'. Devuelve como send.
+ */
+static ssize_t
+copy_splice_out(struct relay_pipe *p, int fd) {
+    ssize_t n = splice(p->fds[0], NULL, fd, NULL, p->pending,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0) {
+        p->pending -= n;
+    }
+    return n;
+}
+#endif
+
+/**
+ * Una lectura de `key->fd' hacia el buffer (o el pipe) de la otra
+ * dirección. Devuelve como recv; `full' indica si llenó todo el espacio que
+ * había, o sea que probablemente quedan datos en el socket.
+ */
+static ssize_t
+copy_recv(struct selector_key *key, struct socks5 *s, struct copy_st *copy, bool *full) {
+    struct iovec iov[2];
+    size_t count;
+    ssize_t n;
+    
+#ifdef __linux__
+    if (s->splice) {
+        n = copy_splice_in(key->fd, &copy->other->pipe);
+        *full = copy->other->pipe.pending >= copy->other->pipe.size;
+        return n;
+    }
+#endif
+    // (todo el espacio libre, aunque dé la vuelta al anillo)
+    count = ring_writable(copy->other->wb);
+    if (count == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    n = readv(key->fd, iov, ring_write_iov(copy->other->wb, iov));
+    *full = n > 0 && (size_t)n == count;
+    if (n > 0) {
+        ring_write_adv(copy->other->wb, n);
+        if (!s->sockmap) {
+            copy_adapt(key, s, copy->other->wb, *full);
+        }
+    }
+    return n;
+}
+
+/**
+ * Una escritura en `fd' de lo que espera la dirección `copy': primero lo que
+ * haya quedado en el buffer (en modo splice, lo que el cliente mandó junto
+ * con el handshake), después el pipe. Devuelve como send; ante un error
+ * cierra la dirección.
+ */
+static ssize_t
+copy_send(struct socks5 *s, struct copy_st *copy, int fd) {
+    struct iovec iov[2];
+    struct msghdr msg;
+    ssize_t n;
+    
+    if (ring_can_read(copy->wb)) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = ring_read_iov(copy->wb, iov);
+        n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n > 0) {
+            ring_read_adv(copy->wb, n);
+        }
+    }
+#ifdef __linux__
+    else if (s->splice && copy->pipe.pending > 0) {
+        n = copy_splice_out(&copy->pipe, fd);
+    }
+#endif
+    else {
+        // nada para escribir
+        n = -1;
+        errno = EAGAIN;
+    }
+    
+    if (n <= 0 && errno != EAGAIN) {
+        copy->shutdown_write = true;
+        copy->other->shutdown_read = true;
+    }
+    return n;
+}
+
+/**
+ * Suma a las métricas `n' bytes leídos del cliente (o del origen).
+ */
+static void
+copy_account(struct socks5 *s, bool from_client, size_t n) {
+    if (from_client) {
+        s->bytes_recv += n;
+        metrics_add_bytes_received(n);
+    } else {
+        s->bytes_sent += n;
+        metrics_add_bytes_sent(n);
+    }
+}
+
 static unsigned
 copy_read(struct selector_key *key) {
     struct socks5 *s = ATTACHMENT(key);
     
     bool is_client = (key->fd == s->client_fd);
-    struct copy_st *copy = is_client ? &s->client.copy : &s->origin_copy;
+    struct copy_st *copy = is_client ? &s->client_copy : &s->origin_copy;
+    const int other_fd = is_client ? s->origin_fd : s->client_fd;
     
-    uint8_t *ptr;
-    size_t count;
-    ssize_t n;
+    if (s->relay) {
+        // El selector ya copió: solo llegan los finales de cada dirección
+        // (ver `socksv5_relay')
+        return s->relay_failed ? ERROR : copy_done(s) ? DONE : COPY;
+    }
     
-    // Leer hacia el buffer de escritura del otro lado
-    ptr = buffer_write_ptr(copy->other->wb, &count);
-    n = recv(key->fd, ptr, count, 0);
+    // Leer hacia el buffer de escritura del otro lado, que recién ahora
+    // necesita un bloque
+    if (!s->splice && copy->other->wb->data == NULL
+        && !relay_acquire(copy->other->wb, copy_sizing(s, copy->other->wb)->size)) {
+        LOG_ERROR("Unable to allocate relay buffer");
+        return ERROR;
+    }
+    
+    // Mientras las lecturas llenen el espacio disponible (al socket le
+    // quedan datos) se vacía hacia el otro lado y se vuelve a leer, hasta
+    // agotar el presupuesto de la vuelta
+    const size_t max_bytes = (size_t)COPY_TURN_BYTES * s->weight;
+    unsigned reads = COPY_TURN_READS * s->weight;
+    size_t total = 0;
+    bool full;
+    ssize_t n;
     
-    if (n <= 0) {
-        if (n == 0 || errno != EAGAIN) {
-            copy->shutdown_read = true;
-            shutdown(key->fd, SHUT_RD);
-            copy->other->shutdown_write = true;
+    for (;;) {
+        n = copy_recv(key, s, copy, &full);
+        if (n <= 0) {
+            break;
         }
-    } else {
-        buffer_write_adv(copy->other->wb, n);
-        
-        // Actualizar métricas
-        if (is_client) {
-            s->bytes_recv += n;
-            metrics_add_bytes_received(n);
-        } else {
-            s->bytes_sent += n;
-            metrics_add_bytes_sent(n);
+        total += n;
+        if (!full || total >= max_bytes || --reads == 0 || s->sockmap || other_fd < 0) {
+            break;
         }
+        // sin lugar nuevo no tiene sentido volver a leer
+        if (copy_send(s, copy->other, other_fd) <= 0) {
+            break;
+        }
+    }
+    
+    if (n <= 0 && (n == 0 || errno != EAGAIN)) {
+        copy->shutdown_read = true;
+        shutdown(key->fd, SHUT_RD);
+        copy->other->shutdown_write = true;
+    }
+    if (total > 0 && !s->sockmap) {
+        // Actualizar métricas (con sockmap las cuenta TCP_INFO)
+        copy_account(s, is_client, total);
     }
     
+    copy_release_drained(s);
+    
     // Actualizar intereses
     selector_set_interest(key->s, s->client_fd, copy_compute_interests(s, s->client_fd));
     if (s->origin_fd >= 0) {
@@ -1389,8 +2633,7 @@ copy_read(struct selector_key *key) {
     }
     
     // Verificar si terminamos
-    if (s->client.copy.shutdown_read && s->origin_copy.shutdown_read &&
-        !buffer_can_read(&s->read_buffer) && !buffer_can_read(&s->write_buffer)) {
+    if (copy_done(s)) {
         return DONE;
     }
     
@@ -1402,23 +2645,10 @@ copy_write(struct selector_key *key) {
     struct socks5 *s = ATTACHMENT(key);
     
     bool is_client = (key->fd == s->client_fd);
-    struct copy_st *copy = is_client ? &s->client.copy : &s->origin_copy;
+    struct copy_st *copy = is_client ? &s->client_copy : &s->origin_copy;
     
-    uint8_t *ptr;
-    size_t count;
-    ssize_t n;
-    
-    ptr = buffer_read_ptr(copy->wb, &count);
-    n = send(key->fd, ptr, count, MSG_NOSIGNAL);
-    
-    if (n <= 0) {
-        if (errno != EAGAIN) {
-            copy->shutdown_write = true;
-            copy->other->shutdown_read = true;
-        }
-    } else {
-        buffer_read_adv(copy->wb, n);
-    }
+    copy_send(s, copy, key->fd);
+    copy_release_drained(s);
     
     // Actualizar intereses
     selector_set_interest(key->s, s->client_fd, copy_compute_interests(s, s->client_fd));
@@ -1427,14 +2657,38 @@ copy_write(struct selector_key *key) {
     }
     
     // Verificar si terminamos
-    if (s->client.copy.shutdown_read && s->origin_copy.shutdown_read &&
-        !buffer_can_read(&s->read_buffer) && !buffer_can_read(&s->write_buffer)) {
+    if (copy_done(s)) {
         return DONE;
     }
     
     return COPY;
 }
 
+/**
+ * En COPY el timer del cliente es el plazo de inactividad. El del origen es
+ * el tick de los buffers agrandados o, con sockmap, el de cosecha: como el
+ * proxy no ve el tráfico, el plazo de inactividad se rearma acá cuando los
+ * contadores avanzan.
+ */
+static unsigned
+copy_timeout(struct selector_key *key) {
+    struct socks5 *s = ATTACHMENT(key);
+    
+    if (key->fd == s->client_fd) {
+        LOG_DEBUG("Connection idle, closing");
+        return ERROR;
+    }
+    if (!s->sockmap) {
+        copy_relay_tick(key, s);
+        return COPY;
+    }
+    if (copy_sockmap_harvest(s)) {
+        selector_set_timeout(key->s, s->client_fd, state_timeouts[COPY]);
+    }
+    selector_set_timeout(key->s, key->fd, SOCKMAP_HARVEST_MS);
+    return COPY;
+}
+
 // ============================================================================
 // Handlers del selector
 // ============================================================================
@@ -1442,31 +2696,142 @@ copy_write(struct selector_key *key) {
 static void
 socksv5_done(struct selector_key *key);
 
+/**
+ * Rearma el plazo del cliente si cambió el de su estado, o si hubo
+ * actividad durante la copia.
+ */
+static void
+socksv5_deadline(struct selector_key *key, unsigned prev, unsigned st) {
+    struct socks5 *s = ATTACHMENT(key);
+    if (COPY == st || state_timeouts[prev] != state_timeouts[st]) {
+        selector_set_timeout(key->s, s->client_fd, state_timeouts[st]);
+    }
+}
+
+/**
+ * I/O optimista: al pasar a un estado que responde al cliente se intenta el
+ * send en el momento, y al terminar de responder se intenta el recv, en vez
+ * de esperar otra vuelta del selector (el socket casi siempre está listo).
+ * Cada estado registra interés solo si la operación da EAGAIN.
+ */
+static enum socks5_state
+socksv5_optimistic(struct selector_key *key, unsigned prev, enum socks5_state st) {
+    struct socks5 *s = ATTACHMENT(key);
+    
+    while (st != prev) {
+        prev = st;
+        switch (st) {
+            case HELLO_WRITE:
+            case AUTH_WRITE:
+            case REQUEST_WRITE:
+                st = stm_handler_write(&s->stm, key);
+                break;
+            case AUTH_READ:
+            case REQUEST_READ:
+                if (key->fd != s->client_fd) {
+                    return st;
+                }
+                st = stm_handler_read(&s->stm, key);
+                break;
+            default:
+                return st;
+        }
+    }
+    return st;
+}
+
 static void
 socksv5_read(struct selector_key *key) {
     struct state_machine *stm = &ATTACHMENT(key)->stm;
-    const enum socks5_state st = stm_handler_read(stm, key);
+    const unsigned prev = stm_state(stm);
+    const enum socks5_state st = socksv5_optimistic(key, prev,
+                                                    stm_handler_read(stm, key));
     
     if (ERROR == st || DONE == st) {
         socksv5_done(key);
+    } else {
+        socksv5_deadline(key, prev, st);
     }
 }
 
 static void
 socksv5_write(struct selector_key *key) {
     struct state_machine *stm = &ATTACHMENT(key)->stm;
-    const enum socks5_state st = stm_handler_write(stm, key);
+    const unsigned prev = stm_state(stm);
+    const enum socks5_state st = socksv5_optimistic(key, prev,
+                                                    stm_handler_write(stm, key));
     
     if (ERROR == st || DONE == st) {
         socksv5_done(key);
+    } else {
+        socksv5_deadline(key, prev, st);
     }
 }
 
 static void
 socksv5_block(struct selector_key *key) {
     struct state_machine *stm = &ATTACHMENT(key)->stm;
-    const enum socks5_state st = stm_handler_block(stm, key);
+    
+    // una notificación vieja (de un cliente anterior con el mismo fd) puede
+    // llegar en cualquier estado; solo REQUEST_RESOLVING espera una
+    if (stm_state(stm) != REQUEST_RESOLVING) {
+        return;
+    }
+    const enum socks5_state st = socksv5_optimistic(key, REQUEST_RESOLVING,
+                                                    stm_handler_block(stm, key));
     
+    if (ERROR == st || DONE == st) {
+        socksv5_done(key);
+    } else {
+        socksv5_deadline(key, REQUEST_RESOLVING, st);
+    }
+}
+
+static void
+socksv5_timeout(struct selector_key *key) {
+    struct state_machine *stm = &ATTACHMENT(key)->stm;
+    const unsigned prev = stm_state(stm);
+    
+    if (stm->current == NULL || stm->current->on_timeout == NULL) {
+        LOG_DEBUG("Connection timed out in state %u, closing", prev);
+        socksv5_done(key);
+        return;
+    }
+    const enum socks5_state st = socksv5_optimistic(key, prev,
+                                                    stm_handler_timeout(stm, key));
+    
+    if (ERROR == st || DONE == st) {
+        socksv5_done(key);
+    } else if (key->fd == ATTACHMENT(key)->client_fd) {
+        // el timer ya venció: hay que rearmarlo aunque no cambie el plazo
+        selector_set_timeout(key->s, key->fd, state_timeouts[st]);
+    }
+}
+
+/**
+ * Avance del relay por completitud de la dirección que sale de `key->fd':
+ * bytes entregados (que rearman el plazo de inactividad), o el final de la
+ * dirección, que pasa por la máquina de estados como una lectura.
+ */
+static void
+socksv5_relay(struct selector_key *key, ssize_t n) {
+    struct socks5 *s = ATTACHMENT(key);
+    const bool is_client = (key->fd == s->client_fd);
+    struct copy_st *copy = is_client ? &s->client_copy : &s->origin_copy;
+    
+    if (n > 0) {
+        copy_account(s, is_client, (size_t)n);
+        selector_set_timeout(key->s, s->client_fd, state_timeouts[COPY]);
+        return;
+    }
+    if (n < 0) {
+        LOG_DEBUG("Relay failed: %s", strerror((int)-n));
+        s->relay_failed = true;
+    }
+    copy->shutdown_read = true;
+    copy->other->shutdown_write = true;
+    
+    const enum socks5_state st = stm_handler_read(&s->stm, key);
     if (ERROR == st || DONE == st) {
         socksv5_done(key);
     }
@@ -1481,16 +2846,29 @@ static void
 socksv5_done(struct selector_key *key) {
     struct socks5 *s = ATTACHMENT(key);
     
-    if (s->client_fd >= 0) {
-        selector_unregister_fd(key->s, s->client_fd);
-        close(s->client_fd);
-        s->client_fd = -1;
+    if (s->sockmap) {
+        copy_sockmap_harvest(s);
     }
     
-    if (s->origin_fd >= 0) {
-        selector_unregister_fd(key->s, s->origin_fd);
-        close(s->origin_fd);
-        s->origin_fd = -1;
+    // El último unregister libera `s' (handle_close), no tocarlo después
+    int fds[2 + CONNECT_MAX_ATTEMPTS];
+    unsigned n = 0;
+    fds[n++] = s->client_fd;
+    fds[n++] = s->origin_fd;
+    for (unsigned i = 0; s->hs != NULL && i < s->hs->connect_n; i++) {
+        fds[n++] = s->hs->connect_fds[i];
+    }
+    s->client_fd = -1;
+    s->origin_fd = -1;
+    if (s->hs != NULL) {
+        s->hs->connect_n = 0;
+    }
+    
+    for (unsigned i = 0; i < n; i++) {
+        if (fds[i] >= 0) {
+            selector_unregister_fd(key->s, fds[i]);
+            close(fds[i]);
+        }
     }
 }
 
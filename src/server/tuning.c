@@ -0,0 +1,457 @@
+/**
+ * tuning.c - Perfiles de opciones para los sockets de la copia
+ *
+ * Perfiles y reglas viven en arreglos fijos. Quien elige un perfil se lleva
+ * una copia, así que aplicarlo no necesita el lock y un cambio desde gestión
+ * solo afecta a las conexiones nuevas.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "tuning.h"
+#include "users.h"
+#include "logger.h"
+
+/** índice de `default', que siempre existe */
+#define TUNING_DEFAULT 0
+
+/** largo máximo de la lista de opciones de un perfil */
+#define TUNING_OPTIONS_LEN 256
+
+struct user_rule {
+    char username[MAX_USERNAME_LEN + 1];
+    int  profile;
+};
+
+struct port_rule {
+    uint16_t port;
+    int      profile;
+};
+
+static struct tuning_profile profiles[MAX_TUNING_PROFILES];
+static int profiles_n = 0;
+
+static int listener_profile = TUNING_DEFAULT;
+static struct user_rule user_rules[MAX_TUNING_RULES];
+static int user_rules_n = 0;
+static struct port_rule port_rules[MAX_TUNING_RULES];
+static int port_rules_n = 0;
+
+static pthread_rwlock_t tuning_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/** opciones enteras, por clave, con su rango válido */
+static const struct {
+    const char *key;
+    size_t      offset;
+    int         min, max;
+} int_options[] = {
+    { "nodelay",      offsetof(struct tuning_profile, nodelay),       0, 1                 },
+    { "sndbuf",       offsetof(struct tuning_profile, sndbuf),        0, INT_MAX           },
+    { "rcvbuf",       offsetof(struct tuning_profile, rcvbuf),        0, INT_MAX           },
+    { "lowat",        offsetof(struct tuning_profile, notsent_lowat), 0, INT_MAX           },
+    { "keepalive",    offsetof(struct tuning_profile, keepalive),     0, INT_MAX           },
+    { "user_timeout", offsetof(struct tuning_profile, user_timeout),  0, INT_MAX           },
+    { "weight",       offsetof(struct tuning_profile, weight),        1, TUNING_WEIGHT_MAX },
+};
+
+#define N(x) (sizeof(x) / sizeof((x)[0]))
+
+static int *
+int_option(struct tuning_profile *p, unsigned i) {
+    return (int *)((char *)p + int_options[i].offset);
+}
+
+static void
+profile_clear(struct tuning_profile *p, const char *name) {
+    memset(p, 0, sizeof(*p));
+    strncpy(p->name, name, TUNING_NAME_LEN);
+    for (unsigned i = 0; i < N(int_options); i++) {
+        *int_option(p, i) = TUNING_UNSET;
+    }
+}
+
+static bool
+valid_name(const char *s, size_t len, size_t max) {
+    if (len == 0 || len > max) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (!isalnum((unsigned char)s[i]) && s[i] != '_' && s[i] != '-') {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Valor de una opción entera: "-" (la del kernel) o un número, con sufijo
+ * k o m opcional.
+ */
+static bool
+parse_value(const char *s, int *value) {
+    if (strcmp(s, "-") == 0) {
+        *value = TUNING_UNSET;
+        return true;
+    }
+
+    char *end;
+    errno = 0;
+    long n = strtol(s, &end, 10);
+    if (errno != 0 || end == s || n < 0) {
+        return false;
+    }
+    if (*end == 'k' || *end == 'K') {
+        n *= 1024;
+        end++;
+    } else if (*end == 'm' || *end == 'M') {
+        n *= 1024 * 1024;
+        end++;
+    }
+    if (*end != '\0' || n > 0x7fffffff) {
+        return false;
+    }
+    *value = (int)n;
+    return true;
+}
+
+static bool
+parse_option(struct tuning_profile *p, const char *key, const char *value) {
+    if (strcmp(key, "congestion") == 0) {
+        if (strcmp(value, "-") == 0) {
+            p->congestion[0] = '\0';
+            return true;
+        }
+        if (!valid_name(value, strlen(value), TUNING_CONGESTION_LEN)) {
+            return false;
+        }
+        strcpy(p->congestion, value);
+        return true;
+    }
+
+    for (unsigned i = 0; i < N(int_options); i++) {
+        if (strcmp(key, int_options[i].key) == 0) {
+            int v;
+            if (!parse_value(value, &v)
+                || (v != TUNING_UNSET && (v < int_options[i].min || v > int_options[i].max))) {
+                return false;
+            }
+            *int_option(p, i) = v;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool
+parse_options(struct tuning_profile *p, const char *options) {
+    char copy[TUNING_OPTIONS_LEN];
+
+    if (strlen(options) >= sizeof(copy)) {
+        return false;
+    }
+    strcpy(copy, options);
+
+    char *save;
+    for (char *tok = strtok_r(copy, " \t", &save); tok != NULL; tok = strtok_r(NULL, " \t", &save)) {
+        char *eq = strchr(tok, '=');
+        if (eq == NULL) {
+            return false;
+        }
+        *eq = '\0';
+        if (!parse_option(p, tok, eq + 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/** @return el índice del perfil, o -1 */
+static int
+profile_find(const char *name) {
+    for (int i = 0; i < profiles_n; i++) {
+        if (strcmp(profiles[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void
+tuning_init(void) {
+    pthread_rwlock_wrlock(&tuning_lock);
+    profiles_n = 0;
+
+    profile_clear(&profiles[profiles_n++], "default");
+
+    struct tuning_profile *p = &profiles[profiles_n++];
+    profile_clear(p, "interactive");
+    p->nodelay       = 1;
+    p->notsent_lowat = 16 * 1024;
+    p->keepalive     = 60;
+    p->user_timeout  = 30 * 1000;
+
+    p = &profiles[profiles_n++];
+    profile_clear(p, "bulk");
+    p->nodelay   = 0;
+    p->keepalive = 600;
+
+    listener_profile = TUNING_DEFAULT;
+    user_rules_n = 0;
+    port_rules_n = 0;
+    pthread_rwlock_unlock(&tuning_lock);
+}
+
+bool
+tuning_profile_set(const char *name, const char *options) {
+    if (name == NULL || options == NULL || !valid_name(name, strlen(name), TUNING_NAME_LEN)) {
+        return false;
+    }
+
+    bool result = false;
+    pthread_rwlock_wrlock(&tuning_lock);
+
+    struct tuning_profile p;
+    int i = profile_find(name);
+    if (i >= 0) {
+        p = profiles[i];
+    } else if (profiles_n < MAX_TUNING_PROFILES) {
+        i = profiles_n;
+        profile_clear(&p, name);
+    } else {
+        goto unlock;
+    }
+
+    if (!parse_options(&p, options)) {
+        goto unlock;
+    }
+    profiles[i] = p;
+    if (i == profiles_n) {
+        profiles_n++;
+    }
+    result = true;
+
+unlock:
+    pthread_rwlock_unlock(&tuning_lock);
+    return result;
+}
+
+static bool
+user_rule_set(const char *username, size_t len, int profile) {
+    for (int i = 0; i < user_rules_n; i++) {
+        if (strlen(user_rules[i].username) == len
+            && memcmp(user_rules[i].username, username, len) == 0) {
+            if (profile < 0) {
+                user_rules[i] = user_rules[--user_rules_n];
+            } else {
+                user_rules[i].profile = profile;
+            }
+            return true;
+        }
+    }
+    if (profile < 0) {
+        return true;
+    }
+    if (user_rules_n == MAX_TUNING_RULES) {
+        return false;
+    }
+    memcpy(user_rules[user_rules_n].username, username, len);
+    user_rules[user_rules_n].username[len] = '\0';
+    user_rules[user_rules_n].profile = profile;
+    user_rules_n++;
+    return true;
+}
+
+static bool
+port_rule_set(uint16_t port, int profile) {
+    for (int i = 0; i < port_rules_n; i++) {
+        if (port_rules[i].port == port) {
+            if (profile < 0) {
+                port_rules[i] = port_rules[--port_rules_n];
+            } else {
+                port_rules[i].profile = profile;
+            }
+            return true;
+        }
+    }
+    if (profile < 0) {
+        return true;
+    }
+    if (port_rules_n == MAX_TUNING_RULES) {
+        return false;
+    }
+    port_rules[port_rules_n].port = port;
+    port_rules[port_rules_n].profile = profile;
+    port_rules_n++;
+    return true;
+}
+
+bool
+tuning_rule_set(const char *rule) {
+    if (rule == NULL) {
+        return false;
+    }
+    // el perfil va después del último '=' (un usuario puede tener '=')
+    const char *eq = strrchr(rule, '=');
+    if (eq == NULL) {
+        return false;
+    }
+    const char *name = eq + 1;
+
+    bool result = false;
+    pthread_rwlock_wrlock(&tuning_lock);
+
+    int profile = -1;
+    if (*name != '\0' && (profile = profile_find(name)) < 0) {
+        goto unlock;
+    }
+
+    const size_t key_len = eq - rule;
+    if (key_len == strlen("listener") && strncmp(rule, "listener", key_len) == 0) {
+        listener_profile = profile < 0 ? TUNING_DEFAULT : profile;
+        result = true;
+    } else if (strncmp(rule, "user:", 5) == 0) {
+        const size_t len = key_len - 5;
+        result = len > 0 && len <= MAX_USERNAME_LEN && user_rule_set(rule + 5, len, profile);
+    } else if (strncmp(rule, "port:", 5) == 0) {
+        char *end;
+        long port = strtol(rule + 5, &end, 10);
+        result = end == eq && end != rule + 5 && port > 0 && port <= 65535
+              && port_rule_set((uint16_t)port, profile);
+    }
+
+unlock:
+    pthread_rwlock_unlock(&tuning_lock);
+    return result;
+}
+
+int
+tuning_for_listener(struct tuning_profile *out) {
+    pthread_rwlock_rdlock(&tuning_lock);
+    const int id = listener_profile;
+    *out = profiles[id];
+    pthread_rwlock_unlock(&tuning_lock);
+    return id;
+}
+
+int
+tuning_for_connection(const char *username, uint16_t port, struct tuning_profile *out) {
+    pthread_rwlock_rdlock(&tuning_lock);
+    int id = listener_profile;
+
+    for (int i = 0; username != NULL && i < user_rules_n; i++) {
+        if (strcmp(user_rules[i].username, username) == 0) {
+            id = user_rules[i].profile;
+            break;
+        }
+    }
+    for (int i = 0; i < port_rules_n; i++) {
+        if (port_rules[i].port == port) {
+            id = port_rules[i].profile;
+            break;
+        }
+    }
+    *out = profiles[id];
+    pthread_rwlock_unlock(&tuning_lock);
+    return id;
+}
+
+static void
+set_int(int fd, int level, int option, int value, const char *what) {
+    if (setsockopt(fd, level, option, &value, sizeof(value)) < 0) {
+        LOG_DEBUG("Unable to set %s=%d: %s", what, value, strerror(errno));
+    }
+}
+
+void
+tuning_apply(int fd, const struct tuning_profile *p) {
+    if (p->nodelay != TUNING_UNSET) {
+        set_int(fd, IPPROTO_TCP, TCP_NODELAY, p->nodelay, "TCP_NODELAY");
+    }
+    if (p->sndbuf != TUNING_UNSET) {
+        set_int(fd, SOL_SOCKET, SO_SNDBUF, p->sndbuf, "SO_SNDBUF");
+    }
+    if (p->rcvbuf != TUNING_UNSET) {
+        set_int(fd, SOL_SOCKET, SO_RCVBUF, p->rcvbuf, "SO_RCVBUF");
+    }
+#ifdef TCP_NOTSENT_LOWAT
+    if (p->notsent_lowat != TUNING_UNSET) {
+        set_int(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, p->notsent_lowat, "TCP_NOTSENT_LOWAT");
+    }
+#endif
+    if (p->keepalive != TUNING_UNSET) {
+        set_int(fd, SOL_SOCKET, SO_KEEPALIVE, p->keepalive > 0, "SO_KEEPALIVE");
+#ifdef TCP_KEEPIDLE
+        if (p->keepalive > 0) {
+            set_int(fd, IPPROTO_TCP, TCP_KEEPIDLE, p->keepalive, "TCP_KEEPIDLE");
+        }
+#endif
+    }
+#ifdef TCP_USER_TIMEOUT
+    if (p->user_timeout != TUNING_UNSET) {
+        set_int(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, p->user_timeout, "TCP_USER_TIMEOUT");
+    }
+#endif
+#ifdef TCP_CONGESTION
+    if (p->congestion[0] != '\0'
+        && setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, p->congestion, strlen(p->congestion)) < 0) {
+        LOG_DEBUG("Unable to set TCP_CONGESTION=%s: %s", p->congestion, strerror(errno));
+    }
+#endif
+}
+
+/**
+ * Escribe en `buf' las opciones que fija el perfil, "clave=valor" separadas
+ * por espacios.
+ */
+static void
+profile_describe(const struct tuning_profile *p, char *buf, size_t len) {
+    size_t used = 0;
+
+    buf[0] = '\0';
+    for (unsigned i = 0; i < N(int_options) && used < len; i++) {
+        const int v = *int_option((struct tuning_profile *)p, i);
+        if (v != TUNING_UNSET) {
+            used += snprintf(buf + used, len - used, " %s=%d", int_options[i].key, v);
+        }
+    }
+    if (p->congestion[0] != '\0' && used < len) {
+        used += snprintf(buf + used, len - used, " congestion=%s", p->congestion);
+    }
+    if (used == 0) {
+        snprintf(buf, len, " (kernel defaults)");
+    }
+}
+
+void
+tuning_foreach(void (*callback)(const char *line, void *ctx), void *ctx) {
+    char line[MAX_USERNAME_LEN + 64];
+    char options[TUNING_OPTIONS_LEN];
+
+    pthread_rwlock_rdlock(&tuning_lock);
+    for (int i = 0; i < profiles_n; i++) {
+        profile_describe(&profiles[i], options, sizeof(options));
+        snprintf(line, sizeof(line), "PROFILE %s%s", profiles[i].name, options);
+        callback(line, ctx);
+    }
+    snprintf(line, sizeof(line), "RULE listener=%s", profiles[listener_profile].name);
+    callback(line, ctx);
+    for (int i = 0; i < user_rules_n; i++) {
+        snprintf(line, sizeof(line), "RULE user:%s=%s", user_rules[i].username,
+                 profiles[user_rules[i].profile].name);
+        callback(line, ctx);
+    }
+    for (int i = 0; i < port_rules_n; i++) {
+        snprintf(line, sizeof(line), "RULE port:%u=%s", port_rules[i].port,
+                 profiles[port_rules[i].profile].name);
+        callback(line, ctx);
+    }
+    pthread_rwlock_unlock(&tuning_lock);
+}
@@ -4,8 +4,9 @@
  * Implementa RFC 1929: Username/Password Authentication for SOCKS V5
  *
  * Los usuarios se almacenan en memoria (volátiles).
- * Se usa un mutex para thread-safety (aunque en esta implementación
- * single-threaded no es estrictamente necesario).
+ * Se comparten entre todos los reactores (-t) y el thread de gestión, así que
+ * se protegen con un rwlock: las verificaciones de cada AUTH solo leen y
+ * pueden correr en paralelo; altas y bajas toman el lock exclusivo.
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -24,19 +25,19 @@ struct user_entry {
 // Base de datos de usuarios
 static struct user_entry users_db[MAX_TOTAL_USERS];
 static int users_count_val = 0;
-static pthread_mutex_t users_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_rwlock_t users_lock = PTHREAD_RWLOCK_INITIALIZER;
 
 void
 users_init(void) {
-    pthread_mutex_lock(&users_mutex);
+    pthread_rwlock_wrlock(&users_lock);
     memset(users_db, 0, sizeof(users_db));
     users_count_val = 0;
-    pthread_mutex_unlock(&users_mutex);
+    pthread_rwlock_unlock(&users_lock);
 }
 
 void
 users_destroy(void) {
-    pthread_mutex_lock(&users_mutex);
+    pthread_rwlock_wrlock(&users_lock);
     // Limpiar memoria sensible (contraseñas)
     for (int i = 0; i < MAX_TOTAL_USERS; i++) {
         if (users_db[i].active) {
@@ -45,7 +46,7 @@ users_destroy(void) {
     }
     memset(users_db, 0, sizeof(users_db));
     users_count_val = 0;
-    pthread_mutex_unlock(&users_mutex);
+    pthread_rwlock_unlock(&users_lock);
 }
 
 bool
@@ -64,7 +65,7 @@ users_add(const char *username, const char *password) {
     }
     
     bool result = false;
-    pthread_mutex_lock(&users_mutex);
+    pthread_rwlock_wrlock(&users_lock);
     
     // Verificar si el usuario ya existe
     for (int i = 0; i < MAX_TOTAL_USERS; i++) {
@@ -93,7 +94,7 @@ users_add(const char *username, const char *password) {
     }
     
 unlock:
-    pthread_mutex_unlock(&users_mutex);
+    pthread_rwlock_unlock(&users_lock);
     return result;
 }
 
@@ -104,7 +105,7 @@ users_remove(const char *username) {
     }
     
     bool result = false;
-    pthread_mutex_lock(&users_mutex);
+    pthread_rwlock_wrlock(&users_lock);
     
     for (int i = 0; i < MAX_TOTAL_USERS; i++) {
         if (users_db[i].active && 
@@ -119,7 +120,7 @@ users_remove(const char *username) {
         }
     }
     
-    pthread_mutex_unlock(&users_mutex);
+    pthread_rwlock_unlock(&users_lock);
     return result;
 }
 
@@ -130,7 +131,7 @@ users_verify(const char *username, const char *password) {
     }
     
     bool result = false;
-    pthread_mutex_lock(&users_mutex);
+    pthread_rwlock_rdlock(&users_lock);
     
     for (int i = 0; i < MAX_TOTAL_USERS; i++) {
         if (users_db[i].active && 
@@ -143,7 +144,7 @@ users_verify(const char *username, const char *password) {
         }
     }
     
-    pthread_mutex_unlock(&users_mutex);
+    pthread_rwlock_unlock(&users_lock);
     return result;
 }
 
@@ -154,7 +155,7 @@ users_exists(const char *username) {
     }
     
     bool result = false;
-    pthread_mutex_lock(&users_mutex);
+    pthread_rwlock_rdlock(&users_lock);
     
     for (int i = 0; i < MAX_TOTAL_USERS; i++) {
         if (users_db[i].active && 
@@ -164,15 +165,15 @@ users_exists(const char *username) {
         }
     }
     
-    pthread_mutex_unlock(&users_mutex);
+    pthread_rwlock_unlock(&users_lock);
     return result;
 }
 
 int
 users_count(void) {
-    pthread_mutex_lock(&users_mutex);
+    pthread_rwlock_rdlock(&users_lock);
     int count = users_count_val;
-    pthread_mutex_unlock(&users_mutex);
+    pthread_rwlock_unlock(&users_lock);
     return count;
 }
 
@@ -182,7 +183,7 @@ users_foreach(void (*callback)(const char *username, void *ctx), void *ctx) {
         return;
     }
     
-    pthread_mutex_lock(&users_mutex);
+    pthread_rwlock_rdlock(&users_lock);
     
     for (int i = 0; i < MAX_TOTAL_USERS; i++) {
         if (users_db[i].active) {
@@ -190,6 +191,6 @@ users_foreach(void (*callback)(const char *username, void *ctx), void *ctx) {
         }
     }
     
-    pthread_mutex_unlock(&users_mutex);
+    pthread_rwlock_unlock(&users_lock);
 }
 
@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+"""
+Handshake pipelineado seguido de FIN
+====================================
+El cliente manda HELLO, AUTH, REQUEST y los primeros datos en un solo
+segmento y cierra su lado (shutdown(SHUT_WR)) antes de que el servidor lea
+nada (el servidor está detenido con SIGSTOP). El servidor tiene que
+responder los tres mensajes y reenviar los datos al origen, cuya respuesta
+le llega al cliente.
+
+Uso: python3 tests/handshake_fin_test.py [ruta a socks5d]
+"""
+
+import os
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import threading
+import time
+
+USER = b'tester'
+PASS = b'secret'
+PAYLOAD = b'PING'
+RESPONSE = b'PONG'
+
+
+def free_port():
+    s = socket.socket()
+    s.bind(('127.0.0.1', 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def origin_server(listener):
+    """Espera el PAYLOAD entero, responde y cierra"""
+    conn, _ = listener.accept()
+    conn.settimeout(5)
+    data = b''
+    while len(data) < len(PAYLOAD):
+        chunk = conn.recv(64)
+        if not chunk:
+            break
+        data += chunk
+    if data == PAYLOAD:
+        conn.sendall(RESPONSE)
+    conn.close()
+
+
+def wait_listening(port, proc):
+    for _ in range(50):
+        if proc.poll() is not None:
+            return False
+        try:
+            socket.create_connection(('127.0.0.1', port), timeout=0.1).close()
+            return True
+        except OSError:
+            time.sleep(0.1)
+    return False
+
+
+def main():
+    binary = sys.argv[1] if len(sys.argv) > 1 else './socks5d'
+    socks_port = free_port()
+    mgmt_port = free_port()
+
+    listener = socket.socket()
+    listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    listener.bind(('127.0.0.1', 0))
+    listener.listen(1)
+    origin_port = listener.getsockname()[1]
+    threading.Thread(target=origin_server, args=(listener,), daemon=True).start()
+
+    proc = subprocess.Popen([binary, '-l', '127.0.0.1', '-p', str(socks_port),
+                             '-P', str(mgmt_port), '-u', '%s:%s' % (USER.decode(), PASS.decode())],
+                            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    try:
+        if not wait_listening(socks_port, proc):
+            print('FAIL: el servidor no arrancó')
+            return 1
+
+        hello = b'\x05\x01\x02'
+        auth = bytes([0x01, len(USER)]) + USER + bytes([len(PASS)]) + PASS
+        request = b'\x05\x01\x00\x01' + socket.inet_aton('127.0.0.1') + struct.pack('>H', origin_port)
+
+        # Con el servidor detenido todo llega junto, y el FIN también
+        os.kill(proc.pid, signal.SIGSTOP)
+        sock = socket.create_connection(('127.0.0.1', socks_port))
+        sock.sendall(hello + auth + request + PAYLOAD)
+        sock.shutdown(socket.SHUT_WR)
+        time.sleep(0.2)
+        os.kill(proc.pid, signal.SIGCONT)
+
+        sock.settimeout(5)
+        expected = b'\x05\x02' + b'\x01\x00' + b'\x05\x00\x00\x01' + b'\x00' * 6 + RESPONSE
+        received = b''
+        while len(received) < len(expected):
+            chunk = sock.recv(64)
+            if not chunk:
+                break
+            received += chunk
+        sock.close()
+
+        if received != expected:
+            print('FAIL: se esperaba %s, llegó %s' % (expected.hex(), received.hex()))
+            return 1
+        print('OK: handshake pipelineado con FIN')
+        return 0
+    finally:
+        os.kill(proc.pid, signal.SIGCONT)
+        proc.send_signal(signal.SIGINT)
+        try:
+            proc.wait(timeout=5)
+        except subprocess.TimeoutExpired:
+            proc.kill()
+
+
+if __name__ == '__main__':
+    sys.exit(main())
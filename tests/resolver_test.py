@@ -0,0 +1,224 @@
+#!/usr/bin/env python3
+"""
+Resolvedor DNS stub
+===================
+Levanta un servidor DNS propio en 127.0.0.1 y un servidor socks5d compilado
+para preguntarle a él (RESOLVER_CONF_PATH apunta a tests/resolv.conf y
+RESOLVER_PORT al puerto del test; ver el target `test' del Makefile).
+
+- tc.test: por UDP la respuesta llega truncada (TC), así que el resolvedor
+  tiene que repetir la pregunta por TCP, donde recibe 127.0.0.1. El CONNECT
+  tiene que llegar al origen.
+- nx.test: NXDOMAIN. El CONNECT tiene que fallar con "host unreachable".
+
+Uso: make test
+     (o RESOLVER_TEST_SERVER=build/test/socks5d RESOLVER_TEST_PORT=15353
+      python3 tests/resolver_test.py)
+"""
+
+import os
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import threading
+import time
+
+USER = b'tester'
+PASS = b'secret'
+PAYLOAD = b'PING'
+RESPONSE = b'PONG'
+
+TYPE_A = 1
+RCODE_NXDOMAIN = 3
+
+# preguntas recibidas por transporte, para verificar el paso a TCP
+queries = {'udp': [], 'tcp': []}
+
+
+def free_port():
+    s = socket.socket()
+    s.bind(('127.0.0.1', 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def parse_question(msg):
+    """Devuelve (nombre, tipo, sección de la pregunta)"""
+    off = 12
+    labels = []
+    while msg[off] != 0:
+        length = msg[off]
+        labels.append(msg[off + 1:off + 1 + length].decode())
+        off += 1 + length
+    qtype, = struct.unpack('>H', msg[off + 1:off + 3])
+    return '.'.join(labels).lower(), qtype, msg[12:off + 5]
+
+
+def answer(msg, tcp):
+    name, qtype, question = parse_question(msg)
+    queries['tcp' if tcp else 'udp'].append((name, qtype))
+
+    flags = 0x8180  # respuesta, RD y RA
+    records = b''
+    ancount = 0
+    if name == 'nx.test':
+        flags |= RCODE_NXDOMAIN
+    elif name == 'tc.test' and not tcp:
+        flags |= 0x0200  # TC: no entra por UDP
+    elif name == 'tc.test' and qtype == TYPE_A:
+        records = b'\xc0\x0c' + struct.pack('>HHIH', TYPE_A, 1, 60, 4) + socket.inet_aton('127.0.0.1')
+        ancount = 1
+    elif name != 'tc.test':
+        flags |= RCODE_NXDOMAIN
+    return msg[:2] + struct.pack('>HHHHH', flags, 1, ancount, 0, 0) + question + records
+
+
+def dns_udp(sock):
+    while True:
+        msg, addr = sock.recvfrom(4096)
+        sock.sendto(answer(msg, False), addr)
+
+
+def dns_tcp_conn(conn):
+    data = b''
+    while True:
+        chunk = conn.recv(4096)
+        if not chunk:
+            break
+        data += chunk
+        while len(data) >= 2 and len(data) >= 2 + struct.unpack('>H', data[:2])[0]:
+            length, = struct.unpack('>H', data[:2])
+            reply = answer(data[2:2 + length], True)
+            data = data[2 + length:]
+            conn.sendall(struct.pack('>H', len(reply)) + reply)
+    conn.close()
+
+
+def dns_tcp(listener):
+    while True:
+        conn, _ = listener.accept()
+        threading.Thread(target=dns_tcp_conn, args=(conn,), daemon=True).start()
+
+
+def origin_server(listener):
+    """Espera el PAYLOAD entero, responde y cierra"""
+    conn, _ = listener.accept()
+    conn.settimeout(5)
+    data = b''
+    while len(data) < len(PAYLOAD):
+        chunk = conn.recv(64)
+        if not chunk:
+            break
+        data += chunk
+    if data == PAYLOAD:
+        conn.sendall(RESPONSE)
+    conn.close()
+
+
+def wait_listening(port, proc):
+    for _ in range(50):
+        if proc.poll() is not None:
+            return False
+        try:
+            socket.create_connection(('127.0.0.1', port), timeout=0.1).close()
+            return True
+        except OSError:
+            time.sleep(0.1)
+    return False
+
+
+def recv_exactly(sock, n):
+    data = b''
+    while len(data) < n:
+        chunk = sock.recv(n - len(data))
+        if not chunk:
+            break
+        data += chunk
+    return data
+
+
+def connect(socks_port, host, port):
+    """Handshake completo y CONNECT a `host'. Devuelve (socket, respuesta)"""
+    sock = socket.create_connection(('127.0.0.1', socks_port))
+    sock.settimeout(5)
+    sock.sendall(b'\x05\x01\x02')
+    if recv_exactly(sock, 2) != b'\x05\x02':
+        return sock, None
+    sock.sendall(bytes([0x01, len(USER)]) + USER + bytes([len(PASS)]) + PASS)
+    if recv_exactly(sock, 2) != b'\x01\x00':
+        return sock, None
+    name = host.encode()
+    sock.sendall(b'\x05\x01\x00\x03' + bytes([len(name)]) + name + struct.pack('>H', port))
+    return sock, recv_exactly(sock, 10)
+
+
+def main():
+    binary = os.environ.get('RESOLVER_TEST_SERVER', 'build/test/socks5d')
+    dns_port = int(os.environ.get('RESOLVER_TEST_PORT', '15353'))
+    socks_port = free_port()
+    mgmt_port = free_port()
+
+    udp = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    udp.bind(('127.0.0.1', dns_port))
+    tcp = socket.socket()
+    tcp.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    tcp.bind(('127.0.0.1', dns_port))
+    tcp.listen(8)
+    threading.Thread(target=dns_udp, args=(udp,), daemon=True).start()
+    threading.Thread(target=dns_tcp, args=(tcp,), daemon=True).start()
+
+    listener = socket.socket()
+    listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    listener.bind(('127.0.0.1', 0))
+    listener.listen(1)
+    origin_port = listener.getsockname()[1]
+    threading.Thread(target=origin_server, args=(listener,), daemon=True).start()
+
+    proc = subprocess.Popen([binary, '-l', '127.0.0.1', '-p', str(socks_port),
+                             '-P', str(mgmt_port), '-u', '%s:%s' % (USER.decode(), PASS.decode())],
+                            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    try:
+        if not wait_listening(socks_port, proc):
+            print('FAIL: el servidor no arrancó (%s)' % binary)
+            return 1
+
+        # respuesta truncada por UDP: reintento por TCP
+        sock, reply = connect(socks_port, 'tc.test', origin_port)
+        if reply is None or len(reply) != 10 or reply[1] != 0x00:
+            print('FAIL: CONNECT a tc.test respondió %s' % (reply.hex() if reply else None))
+            return 1
+        sock.sendall(PAYLOAD)
+        received = recv_exactly(sock, len(RESPONSE))
+        sock.close()
+        if received != RESPONSE:
+            print('FAIL: el origen de tc.test no respondió (%s)' % received)
+            return 1
+        if ('tc.test', TYPE_A) not in queries['udp'] or ('tc.test', TYPE_A) not in queries['tcp']:
+            print('FAIL: la pregunta por tc.test no pasó de UDP a TCP: %s' % queries)
+            return 1
+
+        # NXDOMAIN: host unreachable
+        sock, reply = connect(socks_port, 'nx.test', origin_port)
+        sock.close()
+        if reply is None or len(reply) < 2 or reply[1] != 0x04:
+            print('FAIL: CONNECT a nx.test respondió %s' % (reply.hex() if reply else None))
+            return 1
+        if ('nx.test', TYPE_A) in queries['tcp']:
+            print('FAIL: NXDOMAIN no debería reintentarse por TCP: %s' % queries)
+            return 1
+
+        print('OK: resolvedor stub (TC -> TCP, NXDOMAIN)')
+        return 0
+    finally:
+        proc.send_signal(signal.SIGINT)
+        try:
+            proc.wait(timeout=5)
+        except subprocess.TimeoutExpired:
+            proc.kill()
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,205 @@
+#!/usr/bin/env python3
+"""
+Copia por completitud con io_uring
+==================================
+Levanta el servidor con -U y, en paralelo, varias conexiones que mandan
+datos a un origen que los devuelve a medida que llegan (eco). Los clientes
+empiezan a leer tarde, así que las colas del relay se llenan y frenan el
+recv, y los buffers provistos no alcanzan para todas las conexiones a la
+vez; igual todo tiene que llegar entero y en orden. Al
+terminar de mandar el cliente cierra su lado: el EOF tiene que llegar al
+origen, y el del origen de vuelta al cliente.
+
+También verifica que la copia no pasó por los recv del proceso (en
+/proc/<pid>/io las lecturas son pocas). Si el kernel no tiene io_uring (el
+servidor no abrió ningún ring) el servidor usa epoll y el test se saltea.
+
+Uso: python3 tests/uring_relay_test.py [ruta a socks5d]
+"""
+
+import os
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import threading
+import time
+
+USER = b'tester'
+PASS = b'secret'
+CONNECTIONS = 48
+SIZE = 1024 * 1024
+READ_DELAY = 0.5
+MAX_READ_SYSCALLS = 1000
+
+
+def free_port():
+    s = socket.socket()
+    s.bind(('127.0.0.1', 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def echo_conn(conn):
+    """Devuelve lo que llega; al EOF del cliente cierra"""
+    while True:
+        chunk = conn.recv(65536)
+        if not chunk:
+            break
+        conn.sendall(chunk)
+    conn.close()
+
+
+def origin_server(listener):
+    while True:
+        try:
+            conn, _ = listener.accept()
+        except OSError:
+            return
+        threading.Thread(target=echo_conn, args=(conn,), daemon=True).start()
+
+
+def wait_listening(port, proc):
+    for _ in range(50):
+        if proc.poll() is not None:
+            return False
+        try:
+            socket.create_connection(('127.0.0.1', port), timeout=0.1).close()
+            return True
+        except OSError:
+            time.sleep(0.1)
+    return False
+
+
+def recv_exactly(sock, n):
+    data = b''
+    while len(data) < n:
+        chunk = sock.recv(n - len(data))
+        if not chunk:
+            break
+        data += chunk
+    return data
+
+
+def connect(socks_port, origin_port):
+    sock = socket.create_connection(('127.0.0.1', socks_port))
+    sock.settimeout(20)
+    sock.sendall(b'\x05\x01\x02')
+    if recv_exactly(sock, 2) != b'\x05\x02':
+        return None
+    sock.sendall(bytes([0x01, len(USER)]) + USER + bytes([len(PASS)]) + PASS)
+    if recv_exactly(sock, 2) != b'\x01\x00':
+        return None
+    sock.sendall(b'\x05\x01\x00\x01' + socket.inet_aton('127.0.0.1') + struct.pack('>H', origin_port))
+    reply = recv_exactly(sock, 10)
+    if len(reply) != 10 or reply[1] != 0x00:
+        return None
+    return sock
+
+
+def transfer(socks_port, origin_port, index, errors):
+    payload = os.urandom(SIZE)
+    try:
+        sock = connect(socks_port, origin_port)
+        if sock is None:
+            errors.append('conexión %d: handshake fallido' % index)
+            return
+
+        def send():
+            sock.sendall(payload)
+            sock.shutdown(socket.SHUT_WR)
+
+        sender = threading.Thread(target=send, daemon=True)
+        sender.start()
+        time.sleep(READ_DELAY)
+        received = bytearray()
+        while True:
+            chunk = sock.recv(65536)
+            if not chunk:
+                break
+            received += chunk
+        sender.join(20)
+        sock.close()
+        if bytes(received) != payload:
+            errors.append('conexión %d: llegaron %d de %d bytes (o desordenados)'
+                          % (index, len(received), SIZE))
+    except OSError as e:
+        errors.append('conexión %d: %s' % (index, e))
+
+
+def uses_io_uring(pid):
+    """El servidor abrió un ring (los reactores lo crean al arrancar)"""
+    for _ in range(20):
+        for fd in os.listdir('/proc/%d/fd' % pid):
+            try:
+                if os.readlink('/proc/%d/fd/%s' % (pid, fd)) == 'anon_inode:[io_uring]':
+                    return True
+            except OSError:
+                pass
+        time.sleep(0.05)
+    return False
+
+
+def read_syscalls(pid):
+    with open('/proc/%d/io' % pid) as f:
+        for line in f:
+            if line.startswith('syscr:'):
+                return int(line.split()[1])
+    return None
+
+
+def main():
+    binary = sys.argv[1] if len(sys.argv) > 1 else './socks5d'
+    socks_port = free_port()
+    mgmt_port = free_port()
+
+    listener = socket.socket()
+    listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    listener.bind(('127.0.0.1', 0))
+    listener.listen(CONNECTIONS)
+    origin_port = listener.getsockname()[1]
+    threading.Thread(target=origin_server, args=(listener,), daemon=True).start()
+
+    proc = subprocess.Popen([binary, '-U', '-l', '127.0.0.1', '-p', str(socks_port),
+                             '-P', str(mgmt_port), '-u', '%s:%s' % (USER.decode(), PASS.decode())],
+                            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    try:
+        if not wait_listening(socks_port, proc):
+            print('FAIL: el servidor no arrancó (%s)' % binary)
+            return 1
+        if not uses_io_uring(proc.pid):
+            print('SKIP: io_uring no disponible')
+            return 0
+
+        before = read_syscalls(proc.pid)
+        errors = []
+        threads = [threading.Thread(target=transfer, args=(socks_port, origin_port, i, errors))
+                   for i in range(CONNECTIONS)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join(60)
+        if errors:
+            print('FAIL: %s' % '; '.join(errors[:5]))
+            return 1
+
+        reads = read_syscalls(proc.pid) - before
+        if reads > MAX_READ_SYSCALLS:
+            print('FAIL: %d lecturas para %d MiB: la copia no pasó por io_uring'
+                  % (reads, 2 * CONNECTIONS * SIZE // (1024 * 1024)))
+            return 1
+
+        print('OK: relay io_uring (%d conexiones, %d lecturas)' % (CONNECTIONS, reads))
+        return 0
+    finally:
+        proc.send_signal(signal.SIGINT)
+        try:
+            proc.wait(timeout=5)
+        except subprocess.TimeoutExpired:
+            proc.kill()
+
+
+if __name__ == '__main__':
+    sys.exit(main())